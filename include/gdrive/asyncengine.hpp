@@ -0,0 +1,96 @@
+#ifndef __GDRIVE_ASYNCENGINE_HPP__
+#define __GDRIVE_ASYNCENGINE_HPP__
+
+#include "gdrive/config.hpp"
+#include "common/all.hpp"
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <curl/curl.h>
+
+#define ASYNC_DEFAULT_IO_THREADS 1
+#define ASYNC_DEFAULT_MAX_STREAMS 100
+
+namespace GDRIVE {
+
+typedef std::function<void (CURLcode)> TransferCallback;
+
+enum HttpVersion {
+    HV_DEFAULT,
+    HV_HTTP2,
+    HV_HTTP2_PRIOR_KNOWLEDGE
+};
+
+// Event loop built on curl_multi. Prepared easy handles are submitted from any
+// thread and driven to completion by a small number of I/O threads; the
+// callback runs on the I/O thread once the transfer is done, so it must not
+// block for long.
+class AsyncEngine {
+    CLASS_MAKE_LOGGER
+    public:
+        static AsyncEngine& get_instance() {
+            return _single_instance;
+        }
+
+        // the I/O thread starts the transfer delay seconds from now
+        void submit(CURL* handle, TransferCallback callback, double delay = 0);
+        // takes a handle that still waits for its delay out, its callback gets
+        // CURLE_ABORTED_BY_CALLBACK on the I/O thread; others are left alone
+        void cancel(CURL* handle);
+        // Blocks until the transfer is done. Called from an I/O thread, e.g. by a
+        // blocking request inside a completion callback, the transfer runs right
+        // there with curl_easy_perform, waiting for the engine would never end.
+        CURLcode perform(CURL* handle);
+        // true on the engine's own I/O threads, which must not wait for the engine
+        static bool on_io_thread() { return _on_io_thread; }
+        void set_io_threads(int n);
+
+        // HTTP/2 turns on multiplexing, blocking requests are then routed through the engine
+        // as well so concurrent requests to a host share a single connection
+        void set_http_version(HttpVersion version);
+        void set_max_concurrent_streams(long streams);
+        inline bool multiplexing() const { return _http_version != HV_DEFAULT; }
+        void configure_handle(CURL* handle);
+        int in_flight();
+        void shutdown();
+    private:
+        AsyncEngine();
+        ~AsyncEngine();
+        AsyncEngine(const AsyncEngine& other);
+        AsyncEngine& operator=(const AsyncEngine& other);
+        static AsyncEngine _single_instance;
+        static thread_local bool _on_io_thread;
+
+        struct Worker {
+            Worker() :multi(NULL), running(false) {}
+            CURLM* multi;
+            std::thread thread;
+            std::mutex mutex;
+            bool running;
+            std::vector<std::pair<CURL*, TransferCallback> > pending;
+            // submitted with a delay, by the time they are due
+            std::multimap<double, std::pair<CURL*, TransferCallback> > delayed;
+            // callbacks of cancelled delayed handles, run by the I/O thread
+            std::vector<TransferCallback> cancelled;
+            std::map<CURL*, TransferCallback> active;
+        };
+
+        void _start();
+        void _run(Worker* worker);
+        void _wakeup(Worker* worker);
+        static double _now();
+
+        std::mutex _mutex;
+        std::vector<Worker*> _workers;
+        int _io_threads;
+        unsigned int _next;
+        HttpVersion _http_version;
+        long _max_concurrent_streams;
+};
+
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __GDRIVE_BATCH_HPP__
+#define __GDRIVE_BATCH_HPP__
+
+#include "gdrive/config.hpp"
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "common/all.hpp"
+
+#include <string>
+#include <vector>
+
+#define BATCH_MAX_REQUESTS 100
+
+namespace GDRIVE {
+
+// Sends many requests in one multipart/mixed POST to the batch endpoint.
+// After execute() every added request holds its own response, so the typed
+// result is read with request.result(), which throws
+// GoogleJsonResponseException for a failed part just like execute() would.
+class BatchRequest : public CredentialHttpRequest {
+    CLASS_MAKE_LOGGER
+    public:
+        BatchRequest(Credential* cred, std::string uri = BATCH_URL);
+
+        void add(CredentialHttpRequest* request);
+        inline size_t size() const { return _requests.size(); }
+        void set_max_batch_size(int max_size);
+        void execute();
+    protected:
+        std::string _generate_boundary() { return "batch_gdrive_boundary"; }
+        void _execute_chunk(size_t begin, size_t end);
+        std::string _serialize(CredentialHttpRequest* request, size_t index);
+        void _parse_batch_response(size_t begin, size_t end);
+        // the index of the request the part answers, -1 if it answers none
+        long _parse_part(std::string part, size_t begin, size_t end, size_t fallback);
+
+        std::vector<CredentialHttpRequest*> _requests;
+        int _max_batch_size;
+};
+
+}
+
+#endif
@@ -13,4 +13,5 @@
 
 #define SERVICE_URI "https://www.googleapis.com/drive/v2"
 #define FILE_UPLOAD_URL "https://www.googleapis.com/upload/drive/v2/files"
+#define BATCH_URL "https://www.googleapis.com/batch/drive/v2"
 #endif
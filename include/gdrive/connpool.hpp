@@ -0,0 +1,79 @@
+#ifndef __GDRIVE_CONNPOOL_HPP__
+#define __GDRIVE_CONNPOOL_HPP__
+
+#include "gdrive/config.hpp"
+#include "common/all.hpp"
+
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <time.h>
+#include <curl/curl.h>
+
+#define POOL_MAX_IDLE_PER_HOST 16
+#define POOL_MAX_IDLE_SECONDS 60
+
+namespace GDRIVE {
+
+struct ConnectionPoolStats {
+    ConnectionPoolStats()
+        :requests(0), hits(0), misses(0), idle_evictions(0), handshakes_avoided(0), connects(0), idle(0) {}
+
+    long requests;
+    long hits;
+    long misses;
+    long idle_evictions;
+    long handshakes_avoided;
+    long connects;
+    long idle;
+
+    inline double hit_rate() const {
+        return requests == 0 ? 0.0 : (double)hits / requests;
+    }
+};
+
+// Process-wide cache of warm CURL easy handles. Each handle keeps its own
+// connection cache, so handing a handle back to the next request to the same
+// host reuses the already established TCP/TLS connection.
+class ConnectionPool {
+    CLASS_MAKE_LOGGER
+    public:
+        static ConnectionPool& get_instance() {
+            return _single_instance;
+        }
+
+        CURL* acquire(std::string host);
+        void release(std::string host, CURL* handle);
+        void record_transfer(CURL* handle);
+
+        void set_max_idle_per_host(int max_idle);
+        void set_max_idle_seconds(long seconds);
+        ConnectionPoolStats stats();
+        void clear();
+
+        static std::string host_of(std::string uri);
+    private:
+        ConnectionPool();
+        ~ConnectionPool();
+        ConnectionPool(const ConnectionPool& other);
+        ConnectionPool& operator=(const ConnectionPool& other);
+        static ConnectionPool _single_instance;
+
+        struct IdleHandle {
+            CURL* handle;
+            time_t since;
+        };
+
+        void _evict_expired(time_t now);
+
+        std::map<std::string, std::vector<IdleHandle> > _idle;
+        std::mutex _mutex;
+        int _max_idle_per_host;
+        long _max_idle_seconds;
+        ConnectionPoolStats _stats;
+};
+
+}
+
+#endif
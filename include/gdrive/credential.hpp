@@ -5,9 +5,18 @@
 #include "gdrive/util.hpp"
 #include "gdrive/request.hpp"
 #include "gdrive/store.hpp"
+#include "gdrive/ratelimit.hpp"
 #include "common/all.hpp"
 
 #include <string>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// seconds before the access token expires at which requests start refreshing it in the background
+#define CREDENTIAL_REFRESH_MARGIN 300
 
 namespace GDRIVE {
 
@@ -17,9 +26,26 @@ class Credential {
     CLASS_MAKE_LOGGER
     public:
         Credential(Store* store);
+        // waits for a background refresh that is still running
+        ~Credential();
         inline bool invalid() const { return _invalid; }
         void refresh(std::string at, std::string rt, long te, std::string it = "");
+        // hands the tokens to the store, which saves them in the background
         void dump();
+        // waits until the tokens are saved; call it before the process exits
+        bool flush();
+        // a copy of the current access token, safe while another thread refreshes it
+        std::string access_token();
+        // the endpoint refresh tokens are exchanged at, TOKEN_URL unless set
+        void set_token_url(std::string url);
+        // refreshes that went to the token endpoint
+        long refresh_count();
+        // seconds since the epoch the access token is good until, 0 if unknown
+        long token_expiry();
+        // seconds before expiry at which the token is refreshed ahead, 0 to wait for a 401
+        void set_refresh_margin(long seconds);
+        // shared by every request made with this credential
+        inline RateLimiter& rate_limiter() { return _limiter; }
     private:
         std::string _access_token;
         std::string _client_id;
@@ -27,13 +53,47 @@ class Credential {
         std::string _refresh_token;
         long _token_expiry;
         std::string _id_token;
-        bool _invalid;
+        std::atomic<bool> _invalid;
+        std::string _token_url;
+        long _refresh_margin;
 
         Store *_store;
+        RateLimiter _limiter;
+
+        // guards the tokens; a single refresh runs at a time and the requests
+        // that found the same token stale wait for its result
+        std::mutex _mutex;
+        std::condition_variable _refreshed;
+        bool _refreshing;
+        // continuations of async requests waiting for the refresh that runs
+        std::vector<std::function<void ()> > _waiting;
+        // the last refresh got no token, a token near its expiry is then refreshed
+        // before the next request goes out rather than in the background again
+        bool _refresh_failed;
+        long _refreshes;
+        // keeps the writes of concurrent dumps apart
+        std::mutex _store_mutex;
 
         Credential(const Credential& other);
         Credential& operator=(const Credential& other);
 
+        std::string _token_request_body();
+        RequestHeader _token_request_header();
+        // Marks a refresh as running and returns the request to the token endpoint
+        // for it, which the exchange deletes; called with _mutex held. The request
+        // is aborted by cancel and times out after deadline seconds, 0 for none.
+        HttpRequest* _start_refresh(CancellationToken* cancel, double deadline);
+        // Exchanges the refresh token for a new access token as the one refresh
+        // running, then lets the waiting requests go on
+        std::exception_ptr _exchange(HttpRequest* request);
+        // the same on the engine, next gets the error of the exchange on an I/O thread
+        void _exchange_async(HttpRequest* request, RequestCallback next);
+        // takes the response of the token endpoint, error if there was none
+        void _exchanged(HttpResponse& resp, std::exception_ptr error);
+        void _parse_response(std::string content);
+        // ends the running refresh, the requests waiting for it go on
+        void _finish_refresh(bool ok);
+
     friend class CredentialHttpRequest;
 };
 
@@ -42,17 +102,33 @@ class CredentialHttpRequest : public HttpRequest {
     CLASS_MAKE_LOGGER
     public:
         CredentialHttpRequest(Credential *cred, std::string uri, RequestMethod method);
-        HttpResponse request();
+        HttpResponse& request();
+        void request_async(RequestCallback callback);
     protected:
         Credential *_cred;
+        // quota units the request takes, a batch takes one per part
+        int _rate_cost;
+
+        // the access token the last attempt was sent with
+        std::string _token;
 
         void _apply_header();
+        // every attempt passes through the rate limiter of the credential
+        void _transfer();
+        void _transfer_async(RequestCallback callback, double delay);
+        // Gets a new access token unless another request already replaced the one
+        // this request was sent with; joins a refresh that is running instead of
+        // starting a second one
         void _refresh();
-
-        std::string _generate_request_body();
-        RequestHeader _generate_request_header();
-
-        void _parse_response(std::string content);
+        // _refresh for async requests, next runs once there is a token to go on with
+        // and gets the error of a failed exchange this request started
+        void _refresh_async(RequestCallback next);
+        // Refreshes a token that is within the margin of its expiry on the engine,
+        // true if it has expired already or the last refresh failed, and it has to
+        // be refreshed first
+        bool _refresh_ahead();
+        // sends the request async with the current token, and once more after a refresh on a 401
+        void _send_async(RequestCallback callback);
 };
 
 }
@@ -0,0 +1,63 @@
+#ifndef __GDRIVE_DEDUP_HPP__
+#define __GDRIVE_DEDUP_HPP__
+
+#include "gdrive/gitem.hpp"
+#include "gdrive/util.hpp"
+#include "common/all.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+
+namespace GDRIVE {
+
+// What an upload does when its content is already in Drive
+enum DedupAction {
+    DA_NONE = 0,    // upload anyway
+    DA_COPY,        // server side copy of the existing file, with the new metadata
+    DA_SKIP         // return the existing file untouched
+};
+
+// Maps md5Checksum and fileSize of the files in Drive to their ids, so
+// content that is already there doesn't have to be sent again. It is fed
+// from list and change results as they come in and kept in a file between
+// runs.
+class DedupIndex {
+    CLASS_MAKE_LOGGER
+    public:
+        // loads the index kept at path, if there is one
+        DedupIndex(std::string path);
+
+        void add(const GFile& file);
+        void add(const std::vector<GFile>& files);
+        void apply(const GChange& change);
+        void apply(const std::vector<GChange>& changes);
+        void remove(std::string id);
+        // id of a file with this content, "" if there is none
+        std::string find(std::string md5, long long size);
+        // true if the file id is known to hold this content
+        bool contains(std::string id, std::string md5, long long size);
+        // largest change id applied, to continue the change list from
+        long long change_id();
+        size_t size();
+        bool dump();
+    private:
+        DedupIndex(const DedupIndex& other);
+        DedupIndex& operator=(const DedupIndex& other);
+        static std::string _key(std::string md5, long long size);
+        void _add(std::string key, std::string id);
+        void _remove(std::string id);
+
+        std::string _path;
+        std::mutex _mutex;
+        std::map<std::string, std::string> _ids;     // content key -> file id
+        std::map<std::string, std::string> _keys;    // file id -> content key
+        std::map<std::string, std::set<std::string> > _files;  // content key -> every file id with it
+        long long _change_id;
+};
+
+}
+
+#endif
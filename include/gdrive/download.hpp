@@ -0,0 +1,106 @@
+#ifndef __GDRIVE_DOWNLOAD_HPP__
+#define __GDRIVE_DOWNLOAD_HPP__
+
+#include "gdrive/config.hpp"
+#include "gdrive/credential.hpp"
+#include "gdrive/gitem.hpp"
+#include "gdrive/error.hpp"
+#include "common/all.hpp"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <exception>
+
+#define DOWNLOAD_RANGE_SIZE 8 * 1024 * 1024
+#define DOWNLOAD_PARALLELISM 4
+#define DOWNLOAD_MAX_RETRIES 3
+#define DOWNLOAD_JOURNAL_SUFFIX ".gdjournal"
+
+namespace GDRIVE {
+
+struct ByteRange {
+    ByteRange(long long s, long long e) :start(s), end(e) {}
+    long long start;
+    long long end; // inclusive
+};
+
+// Records the byte ranges of a download that already made it to disk, so an
+// interrupted download only fetches what is missing. The journal belongs to
+// one version of the remote file, identified by etag, md5Checksum and size.
+class DownloadJournal {
+    CLASS_MAKE_LOGGER
+    public:
+        DownloadJournal(std::string path);
+        ~DownloadJournal();
+        // true if the journal on disk was written for this version of file
+        bool load(GFile& file);
+        void reset(GFile& file);
+        void commit(ByteRange range);
+        void remove();
+        inline const std::vector<ByteRange>& completed() const { return _completed; }
+    private:
+        DownloadJournal(const DownloadJournal& other);
+        DownloadJournal& operator=(const DownloadJournal& other);
+        std::string _header(GFile& file);
+
+        std::string _path;
+        int _fd;
+        std::mutex _mutex;
+        std::vector<ByteRange> _completed;
+};
+
+// Downloads the content of a file into fd. Large files are split into
+// byte ranges that are fetched concurrently over pooled connections and
+// written in place, a failed range is retried on its own, and the result
+// is checked against md5Checksum.
+class FileDownloadRequest {
+    CLASS_MAKE_LOGGER
+    public:
+        FileDownloadRequest(Credential* cred, std::string uri, int fd);
+        // Downloads into path and keeps a journal next to it, so a failed download can be resumed
+        FileDownloadRequest(Credential* cred, std::string uri, std::string path);
+
+        GFile execute();
+        void set_parallelism(int n);
+        void set_range_size(long long size);
+        void set_max_retries(int retries);
+        inline void set_use_mmap(bool flag) { _use_mmap = flag; }
+        inline void set_verify_checksum(bool flag) { _verify_checksum = flag; }
+        inline void set_journal(std::string path) { _journal_path = path; }
+        // every request of the download is aborted once token is cancelled
+        inline void set_cancellation_token(CancellationToken* token) { _cancel = token; }
+    protected:
+        struct DownloadState {
+            DownloadState() :next(0), map(NULL), journal(NULL) {}
+            std::mutex mutex;
+            size_t next;
+            char* map;
+            DownloadJournal* journal;
+            std::exception_ptr error;
+        };
+
+        std::vector<ByteRange> _split(long long length, const std::vector<ByteRange>& completed);
+        GFile _execute();
+        void _worker(std::string url, long long length, DownloadState* state);
+        void _download_range(ByteRange range, std::string url, long long length, DownloadState* state);
+        void _sync(long long start, long long end, char* map);
+        std::string _checksum(char* map, long long length);
+
+        Credential* _cred;
+        std::string _uri;
+        std::string _path;
+        std::string _journal_path;
+        int _fd;
+        int _parallelism;
+        long long _range_size;
+        int _max_retries;
+        bool _use_mmap;
+        bool _verify_checksum;
+        CancellationToken* _cancel;
+        std::vector<ByteRange> _ranges;
+};
+
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include "gdrive/credential.hpp"
 #include "gdrive/gitem.hpp"
 #include "gdrive/config.hpp"
+#include "gdrive/batch.hpp"
 #include "gdrive/service/files.hpp"
 #include "gdrive/service/about.hpp"
 #include "gdrive/service/changes.hpp"
@@ -36,6 +37,7 @@ class Drive {
         AppService& apps();
         ReplyService& replies();
         CommentService& comments();
+        BatchRequest batch();
     protected:
         Credential* _cred;
 };
@@ -4,6 +4,7 @@
 #include <vector>
 #include <map>
 #include <exception>
+#include <curl/curl.h>
 
 #include "gdrive/gitem.hpp"
 
@@ -40,6 +41,59 @@ class CurlException : public std::exception {
 };
 
 
+// An attempt ran past its timeout or moved too slowly, or the request ran out of its deadline
+class TimeoutException : public CurlException {
+    public:
+        TimeoutException(std::string error)
+            :CurlException(CURLE_OPERATION_TIMEDOUT, error) {}
+        virtual ~TimeoutException() throw() {}
+};
+
+
+// The CancellationToken of the request was cancelled
+class CancelledException : public CurlException {
+    public:
+        CancelledException()
+            :CurlException(CURLE_ABORTED_BY_CALLBACK, "Request cancelled") {}
+        virtual ~CancelledException() throw() {}
+};
+
+
+class DownloadException : public std::exception {
+    public:
+        DownloadException(std::string error)
+            :_error(error) {}
+        std::string error() { return _error; }
+        virtual ~DownloadException() throw() {}
+    private:
+        std::string _error;
+};
+
+
+class UploadException : public std::exception {
+    public:
+        UploadException(std::string error)
+            :_error(error) {}
+        std::string error() { return _error; }
+        virtual ~UploadException() throw() {}
+    private:
+        std::string _error;
+};
+
+
+class IntegrityException : public std::exception {
+    public:
+        IntegrityException(std::string expected, std::string actual)
+            :_expected(expected), _actual(actual) {}
+        std::string expected() { return _expected; }
+        std::string actual() { return _actual; }
+        virtual ~IntegrityException() throw() {}
+    private:
+        std::string _expected;
+        std::string _actual;
+};
+
+
 }
 
 #endif
@@ -3,17 +3,24 @@
 
 #include "gdrive/util.hpp"
 #include "gdrive/config.hpp"
+#include "gdrive/md5.hpp"
 #include "common/all.hpp"
 
 #include <fstream>
+#include <functional>
 
 namespace GDRIVE {
 
+// Fills buffer with up to length bytes of a stream, 0 at its end, negative on errors
+typedef std::function<long long (char* buffer, long long length)> StreamReadFunction;
+
+// Source of an upload. Seekable sources know their length and can be read
+// at any position; the others can only be read front to back once.
 class FileContent {
     CLASS_MAKE_LOGGER
     public:
         FileContent(std::ifstream& fin, std::string mimetype)
-            :_fin(fin), _mimetype(mimetype)
+            :_fin(&fin), _mimetype(mimetype), _digested(0)
         {
             _length = -1;
             _resumable_cur_pos = _resumable_start_pos = _resumable_length = 0;
@@ -22,8 +29,45 @@ class FileContent {
 #endif
         }
 
+        virtual ~FileContent() {}
+ 
+        // -1 if the source doesn't know its length
+        virtual long long get_length();
+        virtual bool seekable() { return true; }
+        // sequential read from the current position, 0 at the end, negative on errors
+        virtual long long read_next(char* buffer, long long length);
+        inline std::string mimetype() const { return _mimetype; }
+
+        virtual std::string get_content();
+        // positioned read that leaves the stream where resumable_read expects it
+        virtual long long read_at(long long pos, char* buffer, long long length);
+        // The whole content in memory, NULL if it can only be read. Uploads
+        // hand such content to curl directly instead of copying it through a
+        // read callback.
+        virtual const char* data() { return NULL; }
+        // Everything before pos has been sent and won't be read again
+        virtual void release(long long) {}
+
+        static size_t read(void* ptr, size_t size, size_t nmemb, void* userp);
+        static size_t resumable_read(void* ptr, size_t size, size_t nmemb, void* userp);
+
+        void set_resumable_start_pos(long long pos);
+        void set_resumable_length(long long length);
+
+        // Running md5 of what the uploads read. Bytes already digested are
+        // skipped, so resent chunks count once.
+        void digest(long long pos, const char* data, long long length);
+        void reset_digest();
+        // md5 of the whole content, "" if it hasn't all been read
+        std::string md5();
+        // reads a seekable source once to compute its md5 ahead of an upload
+        std::string compute_md5();
+        // digests what hasn't been up to end, reading it from the source
+        void digest_to(long long end);
+    protected:
+        // a copy of a subclass would be sliced into a FileContent without a source
         FileContent(const FileContent& other)
-            :_fin(other._fin), _mimetype(other._mimetype)
+            :_fin(other._fin), _mimetype(other._mimetype), _md5(other._md5), _digested(other._digested)
         {
             _length = other._length;
             _resumable_length = other._resumable_length;
@@ -33,25 +77,84 @@ class FileContent {
             CLASS_INIT_LOGGER("FileContent", COMMON::L_DEBUG)
 #endif
         }
+
+        FileContent(std::string mimetype)
+            :_fin(NULL), _mimetype(mimetype), _digested(0)
+        {
+            _length = -1;
+            _resumable_cur_pos = _resumable_start_pos = _resumable_length = 0;
+#ifdef GDRIVE_DEBUG
+            CLASS_INIT_LOGGER("FileContent", COMMON::L_DEBUG)
+#endif
+        }
+
+        // sequential access behind read() and resumable_read()
+        virtual size_t _read(char* buffer, size_t length);
+        virtual void _seek(long long pos);
+        virtual long long _tell();
+
+        long long _getRemainingLength();
+        std::ifstream* _fin;
+        std::string _mimetype;
+        MD5 _md5;
+        long long _digested;
+        long long _length;
  
-        int get_length();
-        inline std::string mimetype() const { return _mimetype; }
+        long long _resumable_start_pos;
+        long long _resumable_length;
+        long long _resumable_cur_pos;
+};
+
+// Maps the source file read-only. Uploads send straight from the mapping,
+// pages are read ahead sequentially and dropped once they have been sent, so
+// memory use stays flat however large the file is. If the file can't be
+// mapped it is read with pread instead.
+class MmapFileContent : public FileContent {
+    CLASS_MAKE_LOGGER
+    public:
+        MmapFileContent(std::string path, std::string mimetype);
+        ~MmapFileContent();
 
         std::string get_content();
-        static size_t read(void* ptr, size_t size, size_t nmemb, void* userp);
-        static size_t resumable_read(void* ptr, size_t size, size_t nmemb, void* userp);
+        long long read_at(long long pos, char* buffer, long long length);
+        inline const char* data() { return _map; }
+        void release(long long pos);
+    protected:
+        size_t _read(char* buffer, size_t length);
+        void _seek(long long pos);
+        long long _tell();
+    private:
+        MmapFileContent(const MmapFileContent& other);
+        MmapFileContent& operator=(const MmapFileContent& other);
+
+        int _fd;
+        char* _map;
+        long long _pos;
+        long long _released;
+};
 
-        void set_resumable_start_pos(int pos);
-        void set_resumable_length(int length);
+// Non-seekable source such as a pipe, a socket or a generator. Its length is
+// only known once it has been read to the end, so it always goes through a
+// resumable session that keeps just the chunk in flight for retransmission.
+class StreamFileContent : public FileContent {
+    CLASS_MAKE_LOGGER
+    public:
+        StreamFileContent(int fd, std::string mimetype);
+        StreamFileContent(StreamReadFunction reader, std::string mimetype);
+
+        inline long long get_length() { return -1; }
+        inline bool seekable() { return false; }
+        long long read_next(char* buffer, long long length);
+        std::string get_content();
+        long long read_at(long long pos, char* buffer, long long length);
     protected:
-        int _getRemainingLength();
-        std::ifstream& _fin;
-        std::string _mimetype;
-        int _length;
- 
-        int _resumable_start_pos;
-        int _resumable_length;
-        int _resumable_cur_pos;
+        size_t _read(char* buffer, size_t length);
+        void _seek(long long pos);
+        long long _tell();
+    private:
+        int _fd;
+        StreamReadFunction _reader;
+        long long _pos;
 };
 
 }
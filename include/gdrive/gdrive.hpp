@@ -2,12 +2,20 @@
 #define __GDRIVE_GDRIVE_HPP__
 
 
+#include "gdrive/connpool.hpp"
 #include "gdrive/credential.hpp"
+#include "gdrive/dedup.hpp"
+#include "gdrive/download.hpp"
 #include "gdrive/drive.hpp"
 #include "gdrive/filecontent.hpp"
 #include "gdrive/gitem.hpp"
 #include "gdrive/oauth.hpp"
+#include "gdrive/ratelimit.hpp"
+#include "gdrive/retry.hpp"
 #include "gdrive/servicerequest.hpp"
+#include "gdrive/sink.hpp"
 #include "gdrive/store.hpp"
+#include "gdrive/upload.hpp"
+#include "gdrive/uploadmanager.hpp"
 
 #endif
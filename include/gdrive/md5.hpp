@@ -0,0 +1,31 @@
+#ifndef __GDRIVE_MD5_HPP__
+#define __GDRIVE_MD5_HPP__
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace GDRIVE {
+
+// Incremental MD5 (RFC 1321), used to check transfers against
+// GFile::md5Checksum without an extra pass over the data.
+class MD5 {
+    public:
+        MD5();
+        void update(const void* data, size_t length);
+        // lowercase hex digest, the format Drive reports md5Checksum in
+        std::string hexdigest();
+        void reset();
+    private:
+        void _transform(const unsigned char block[64]);
+
+        uint32_t _state[4];
+        uint64_t _count;
+        unsigned char _buffer[64];
+        bool _finalized;
+        unsigned char _digest[16];
+};
+
+}
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef __GDRIVE_RATELIMIT_HPP__
+#define __GDRIVE_RATELIMIT_HPP__
+
+#include "gdrive/config.hpp"
+#include "gdrive/request.hpp"
+#include "common/all.hpp"
+
+#include <string>
+#include <mutex>
+
+#define RATE_LIMIT_BURST 10
+// rate after a rate limit error, as a share of the rate it came at
+#define RATE_LIMIT_BACKOFF 0.8
+// share of the learned limit the rate settles at
+#define RATE_LIMIT_TARGET 0.95
+// share of the learned limit the rate regains per second after a cut
+#define RATE_LIMIT_RECOVERY 0.05
+// the learned limit grows by this share per second, in case the quota went up
+#define RATE_LIMIT_PROBE 0.002
+// seconds after a cut in which more rate limit errors don't cut again, they
+// come from requests that were already in flight
+#define RATE_LIMIT_HOLD 1.0
+
+namespace GDRIVE {
+
+// Drive counts quota per user, the classes share a credential but get their own rate
+enum RateClass {
+    RC_LIST = 0,    // GET of a collection: files, children, changes, ...
+    RC_GET,         // GET of a single resource or its content
+    RC_UPLOAD,      // everything sent to the upload endpoint
+    RC_OTHER,       // metadata writes, deletes, batches
+    RC_COUNT
+};
+
+struct RateLimitStats {
+    RateLimitStats() :admitted(0), throttled(0), rate_limited(0), waited(0), rate(0), limit(0) {}
+    long long admitted;     // requests let through, a batch counts every part
+    long long throttled;    // requests that had to wait
+    long long rate_limited; // rate limit errors seen
+    double waited;          // seconds spent waiting
+    double rate;            // requests per second let through now, 0 if unlimited
+    double limit;           // learned from rate limit errors, 0 if none came yet
+};
+
+// Token bucket of one request class. Without a configured rate it lets
+// everything through until Drive answers with a rate limit error. A rate
+// limit error takes the rate requests got through at as the limit and cuts
+// the rate below it; from there the rate climbs back to just under the
+// limit and stays there.
+class TokenBucket {
+    CLASS_MAKE_LOGGER
+    public:
+        TokenBucket();
+        // rate 0 lets everything through until Drive says otherwise
+        void configure(double rate, double burst);
+        // blocks until cost more requests may go out
+        void acquire(int cost);
+        // takes cost more requests and returns the seconds until they may go
+        // out, for callers that wait some other way
+        double reserve(int cost);
+        // cost requests went through without a rate limit error
+        void succeeded(int cost);
+        void rate_limited();
+        RateLimitStats stats();
+    private:
+        TokenBucket(const TokenBucket& other);
+        TokenBucket& operator=(const TokenBucket& other);
+        static double _now();
+        // refills the bucket and moves the rate towards its target; called with _mutex held
+        void _update(double now);
+        // starts a new counting window each second; called with _mutex held
+        void _roll(double now);
+
+        std::mutex _mutex;
+        double _max_rate;
+        double _burst;
+        double _limit;
+        double _rate;
+        double _tokens;
+        double _last;
+        double _last_cut;
+        // requests let through and requests that succeeded, in the current second and as
+        // rates over the second before; what succeeded is the best guess at the quota
+        double _window_start;
+        long long _window_admitted;
+        long long _window_ok;
+        double _admitted_rate;
+        double _ok_rate;
+        RateLimitStats _stats;
+};
+
+// Client side rate limits of a credential, every CredentialHttpRequest passes through them
+class RateLimiter {
+    public:
+        // requests per second of a class, up to burst at once
+        void set_rate(RateClass cls, double rate, double burst = RATE_LIMIT_BURST);
+        void set_rate(double rate, double burst = RATE_LIMIT_BURST);
+        inline void acquire(RateClass cls, int cost = 1) { _buckets[cls].acquire(cost); }
+        inline double reserve(RateClass cls, int cost = 1) { return _buckets[cls].reserve(cost); }
+        // true if resp is a rate limit error, which slows the class down
+        bool update(RateClass cls, HttpResponse& resp, int cost = 1);
+        inline RateLimitStats stats(RateClass cls) { return _buckets[cls].stats(); }
+
+        static RateClass classify(std::string uri, RequestMethod method);
+        // 429, or 403 with reason rateLimitExceeded or userRateLimitExceeded
+        static bool is_rate_limited(HttpResponse& resp);
+    private:
+        TokenBucket _buckets[RC_COUNT];
+};
+
+}
+
+#endif
@@ -2,12 +2,26 @@
 #define __GDRIVE_REQUEST_HPP__
 
 #include "gdrive/config.hpp"
+#include "gdrive/retry.hpp"
 #include "common/all.hpp"
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
+#include <exception>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <curl/curl.h>
 
+// Every request gives up on a connection that takes this long to set up, or
+// that moves less than the low speed limit (bytes per second) for the low
+// speed time; a stalled connection would hold its thread forever otherwise
+#define REQUEST_CONNECT_TIMEOUT 30
+#define REQUEST_LOW_SPEED_LIMIT 1
+#define REQUEST_LOW_SPEED_TIME 60
+
 namespace GDRIVE {
 
 enum RequestMethod {
@@ -26,36 +40,88 @@ enum EncodeMethod {
 typedef std::map<std::string, std::string> RequestHeader;
 typedef std::map<std::string, std::string> RequestQuery;
 typedef size_t (*ReadFunction) (void*, size_t, size_t, void*);
+typedef size_t (*WriteFunction) (void*, size_t, size_t, void*);
+// curl transfer progress (context, dltotal, dlnow, ultotal, ulnow), non-zero aborts the transfer
+typedef int (*ProgressFunction) (void*, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+// Completion hook of an asynchronous request, error is empty on success
+typedef std::function<void (std::exception_ptr error)> RequestCallback;
 
 class HttpResponse;
 class HttpRequest;
 
+// Aborts the requests it is set on from another thread. They fail with
+// CancelledException, a running transfer within about a second, a retry
+// wait at once. A cancelled token stays cancelled.
+class CancellationToken {
+    public:
+        CancellationToken() :_cancelled(false) {}
+        void cancel();
+        inline bool cancelled() const { return _cancelled; }
+        // sleeps up to seconds, true if the token was cancelled meanwhile
+        bool wait_for(double seconds);
+    private:
+        CancellationToken(const CancellationToken& other);
+        CancellationToken& operator=(const CancellationToken& other);
+        // a handle the engine holds back for a delay, false if the token is cancelled already
+        bool _hold(CURL* handle);
+        void _release(CURL* handle);
+
+        std::atomic<bool> _cancelled;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        // taken out of the engine's delayed queue on cancel()
+        std::set<CURL*> _held;
+
+        friend class HttpRequest;
+};
+
 class MemoryString {
     public:
-        MemoryString(const char* str, int size)
+        MemoryString(const char* str, size_t size)
             :_str(str), _size(size), _pos(0) {}
         static size_t read(void* ptr, size_t size, size_t nmemb, void* userp) {
             MemoryString* self = (MemoryString*)userp;
             if (self->_size - self->_pos == 0) return 0;
-            int length = self->_size - self->_pos > size * nmemb ? size * nmemb : self->_size - self->_pos;
+            size_t length = self->_size - self->_pos > size * nmemb ? size * nmemb : self->_size - self->_pos;
             memcpy(ptr, self->_str + self->_pos, length);
             self->_pos += length;
             return length;
         }
     private:
         const char*  _str;
-        int _size;
-        int _pos;
+        size_t _size;
+        size_t _pos;
+};
+
+// Bounded per-thread cache of spare response buffers, so steady state
+// responses reuse capacity instead of growing a fresh string each time.
+class ResponseBufferPool {
+    public:
+        static void acquire(std::string& buffer);
+        static void recycle(std::string& buffer);
+        static void set_enabled(bool enabled) { _enabled = enabled; }
+        static bool enabled() { return _enabled; }
+    private:
+        static bool _enabled;
 };
 
 class HttpResponse {
     CLASS_MAKE_LOGGER
     public:
-        HttpResponse() { _header_map.clear(); }
+        HttpResponse() :_status(0) { _header_map.clear(); }
+        HttpResponse(const HttpResponse& other);
+        HttpResponse& operator=(const HttpResponse& other);
+        ~HttpResponse();
         static size_t curl_write_callback(void* content, size_t size, size_t nmemb, void* userp);
-        inline std::string content() const { return _content; };
-        inline std::string header() const { return _header; };
-        inline void clear() { _content = ""; _header = ""; _header_map.clear(); }
+        static size_t curl_header_callback(void* content, size_t size, size_t nmemb, void* userp);
+        inline const std::string& content() const { return _content; };
+        inline const std::string& header() const { return _header; };
+        // view of the body without copying it, valid until the next request or clear()
+        inline const char* data() const { return _content.data(); }
+        inline size_t size() const { return _content.size(); }
+        // moves the body out, the response is left empty
+        std::string release();
+        void clear();
         inline int status() const { return _status; }
         inline void set_status(int status) { _status = status;}
 
@@ -68,6 +134,7 @@ class HttpResponse {
         std::map<std::string, std::string> _header_map;
 
         friend class HttpRequest;
+        friend class BatchRequest;
 };
 
 
@@ -85,20 +152,102 @@ class HttpRequest {
         void clear();
         void set_uri(std::string uri);
         HttpResponse& request();
+        // The request object has to outlive the transfer, callback runs on an I/O thread
+        void request_async(RequestCallback callback);
         inline HttpResponse& response() { return _resp;}
-        ~HttpRequest();
+        // Successful response bodies go to hook instead of response().content(), error bodies are kept.
+        // With status set, a successful body of any other status never reaches the hook: the
+        // transfer stops and the response has that status and no content.
+        inline void set_response_sink(WriteFunction hook, void* context, long status = 0) {
+            _write_hook = hook;
+            _write_context = context;
+            _sink_status = status;
+        }
+        inline void set_progress_hook(ProgressFunction hook, void* context) {
+            _progress_hook = hook;
+            _progress_context = context;
+        }
+        // Sends length bytes at data as the body without copying them, data has to outlive the transfer
+        inline void set_body_view(const char* data, long long length) {
+            _body_view = data;
+            _body_view_length = length;
+        }
+        // RetryPolicy::get_instance() unless set, NULL sends the request once
+        inline void set_retry_policy(RetryPolicy* policy) { _retry = policy; }
+        // Seconds a single attempt may take, 0 for no limit. A timed out attempt
+        // throws TimeoutException unless it is retried.
+        inline void set_timeout(double seconds) { _timeout = seconds; }
+        inline void set_connect_timeout(double seconds) { _connect_timeout = seconds; }
+        // an attempt moving less than bytes per second for seconds times out, 0 bytes turns it off
+        inline void set_low_speed_limit(long bytes, long seconds) {
+            _low_speed_limit = bytes;
+            _low_speed_time = seconds;
+        }
+        // Seconds from the call to request() for every attempt and retry wait together, 0 for none;
+        // a credential's refresh after a 401 and the resend count against it as well
+        inline void set_deadline(double seconds) { _deadline = seconds; }
+        inline void set_cancellation_token(CancellationToken* token) { _cancel = token; }
+        virtual ~HttpRequest();
     protected:
         std::string _uri;
         RequestMethod _method;
         RequestHeader _header;
         RequestQuery _query;
         std::string _body;
+        const char* _body_view;
+        long long _body_view_length;
+        MemoryString _body_reader;
         HttpResponse _resp;
         CURL *_handle;
+        curl_slist* _header_list;
         ReadFunction _read_hook;
         void* _read_context;
+        WriteFunction _write_hook;
+        void* _write_context;
+        long _sink_status;
+        // the body had a status other than _sink_status and was stopped
+        bool _sink_refused;
+        ProgressFunction _progress_hook;
+        void* _progress_context;
+        RetryPolicy* _retry;
+        double _timeout;
+        double _connect_timeout;
+        long _low_speed_limit;
+        long _low_speed_time;
+        double _deadline;
+        double _started_at;
+        double _deadline_at;
+        CancellationToken* _cancel;
+        // cancellation check in front of _progress_hook
+        static int _progress(void* context, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+        // throws if the request was cancelled or ran out of time before the next attempt
+        void _check_continue();
+        // Starts the deadline of a call to request() or request_async(). A subclass that
+        // sends more than once for one call, like after a 401, starts it once and sends
+        // with _perform, so every send shares the deadline.
+        void _start_clock();
+        // the attempts of one send as the retry policy says
+        HttpResponse& _perform();
+        void _perform_async(RequestCallback callback);
+        // one attempt, request() and request_async() repeat it as the retry policy says
+        virtual void _transfer();
+        // the attempt starts delay seconds later, without a thread waiting for it
+        virtual void _transfer_async(RequestCallback callback, double delay);
+        // prepares the handle and hands it to the engine, which starts it delay seconds later
+        void _submit(RequestCallback callback, double delay = 0);
+        void _request_async(int attempt, double start, RequestCallback callback, double delay = 0);
+        // seconds to wait before trying again, negative if the attempt was the last one
+        double _retry_delay(int attempt, double start, int curl_code);
+        static double _now();
+        static size_t _sink_write(void* content, size_t size, size_t nmemb, void* userp);
+        virtual void _prepare_body() {}
         void _init_curl_handle();
+        void _release_curl_handle();
+        void _prepare_request();
+        void _finish_request(CURLcode res);
         curl_slist* _build_header();
+
+        friend class BatchRequest;
 };
 
 }
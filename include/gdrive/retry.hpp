@@ -0,0 +1,87 @@
+#ifndef __GDRIVE_RETRY_HPP__
+#define __GDRIVE_RETRY_HPP__
+
+#include "gdrive/config.hpp"
+#include "common/all.hpp"
+
+#include <set>
+#include <mutex>
+
+#define RETRY_MAX_ATTEMPTS 5
+#define RETRY_INITIAL_DELAY 0.5
+#define RETRY_MULTIPLIER 2.0
+#define RETRY_MAX_DELAY 32.0
+// share of each delay that is randomized away, 1 is full jitter
+#define RETRY_JITTER 0.5
+
+namespace GDRIVE {
+
+class HttpResponse;
+
+struct RetryStats {
+    RetryStats() :retries(0), status_retries(0), curl_retries(0), recovered(0), exhausted(0) {}
+    long long retries;
+    long long status_retries;   // after a retryable HTTP status
+    long long curl_retries;     // after a retryable curl error
+    long long recovered;        // requests that succeeded after retrying
+    long long exhausted;        // requests that ran out of attempts or time
+};
+
+// When a failed attempt of an HttpRequest is tried again. Only requests
+// with an idempotent method (GET, PUT, DELETE) whose body can be sent again
+// are retried. Delays grow exponentially from the initial delay up to the
+// maximum, each shortened by a random share of at most the jitter, and a
+// Retry-After header from the server is never undercut.
+class RetryPolicy {
+    CLASS_MAKE_LOGGER
+    public:
+        // the policy requests use unless they are given another one
+        static RetryPolicy& get_instance() {
+            return _single_instance;
+        }
+
+        RetryPolicy();
+        // The policy is shared by requests on every thread, it may be changed while they run.
+        // 500, 502, 503, 504, 429 and the connect, timeout, send and receive curl errors
+        void set_statuses(std::set<int> statuses);
+        void set_curl_codes(std::set<int> codes);
+        // also retry 403 rateLimitExceeded and userRateLimitExceeded, on by default
+        void set_retry_rate_limited(bool flag);
+        // attempts in all, the first one included; 1 turns retrying off
+        void set_max_attempts(int attempts);
+        void set_backoff(double initial, double multiplier, double max_delay);
+        void set_jitter(double jitter);
+        // seconds from the first attempt after which no retry starts, 0 for none
+        void set_deadline(double seconds);
+
+        bool retryable(int curl_code);
+        bool retryable(HttpResponse& resp);
+        // Seconds to wait before the attempt after attempt, negative if there is no
+        // time or attempt left. resp is NULL after a curl error, time_left is what
+        // the request itself has left, negative if it has no deadline.
+        double backoff(int attempt, double elapsed, HttpResponse* resp, double time_left = -1);
+        void recovered();
+        RetryStats stats();
+    private:
+        RetryPolicy(const RetryPolicy& other);
+        RetryPolicy& operator=(const RetryPolicy& other);
+        static RetryPolicy _single_instance;
+
+        std::set<int> _statuses;
+        std::set<int> _curl_codes;
+        bool _rate_limited;
+        int _max_attempts;
+        double _initial_delay;
+        double _multiplier;
+        double _max_delay;
+        double _jitter;
+        double _deadline;
+
+        // guards the settings and the stats
+        std::mutex _mutex;
+        RetryStats _stats;
+};
+
+}
+
+#endif
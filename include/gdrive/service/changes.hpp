@@ -6,6 +6,7 @@
 #include "gdrive/util.hpp"
 #include "gdrive/gitem.hpp"
 #include "gdrive/servicerequest.hpp"
+#include "gdrive/dedup.hpp"
 #include "common/all.hpp"
 
 #include <vector>
@@ -23,6 +24,8 @@ class ChangeService {
         ChangeGetRequest Get(std::string id);
         ChangeListRequest List();
         std::vector<GChange> Listall();
+        // Listall applies the changes to index
+        inline void set_dedup_index(DedupIndex* index) { _dedup = index; }
     private:
         ChangeService();
         ChangeService(const ChangeService& other);
@@ -31,6 +34,7 @@ class ChangeService {
         static ChangeService _single_instance;
 
         Credential* _cred;
+        DedupIndex* _dedup;
         inline void set_cred(Credential* cred) {
             _cred = cred;
         }
@@ -7,6 +7,8 @@
 #include "gdrive/gitem.hpp"
 #include "gdrive/servicerequest.hpp"
 #include "gdrive/filecontent.hpp"
+#include "gdrive/download.hpp"
+#include "gdrive/dedup.hpp"
 #include "common/all.hpp"
 
 #include <vector>
@@ -34,6 +36,16 @@ class FileService {
         FileCopyRequest Copy(std::string file_id, GFile* file);
         FileInsertRequest Insert(GFile* file, FileContent* content, bool resumable = false);
         FileUpdateRequest Update(std::string id, GFile* file, FileContent* content, bool resumable = false);
+        // Resumable insert of the content read from path that journals its session, and
+        // continues the session journaled by an earlier run if path hasn't changed since
+        FileInsertRequest ResumeUpload(UploadJournal* journal, std::string path, GFile* file, FileContent* content);
+        FileDownloadRequest Download(std::string id, int fd);
+        FileDownloadRequest Download(std::string id, std::string path);
+        // Listall feeds index, Insert and Update look their content up in it first
+        inline void set_dedup_index(DedupIndex* index, DedupAction action = DA_COPY) {
+            _dedup = index;
+            _dedup_action = action;
+        }
     private: 
         FileService();
         FileService(const FileService& other);
@@ -41,6 +53,8 @@ class FileService {
         static FileService _single_instance;
 
         Credential *_cred;
+        DedupIndex* _dedup;
+        DedupAction _dedup_action;
         inline void set_cred(Credential* cred) {
             _cred = cred;
         }
@@ -6,17 +6,30 @@
 #include "gdrive/util.hpp"
 #include "gdrive/gitem.hpp"
 #include "gdrive/filecontent.hpp"
+#include "gdrive/upload.hpp"
+#include "gdrive/dedup.hpp"
 #include "gdrive/error.hpp"
 #include "common/all.hpp"
 
 #include <vector>
 #include <set>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <functional>
 
 #define FILES_URL SERVICE_URI "/files"
 #define ABOUT_URL SERVICE_URI "/about"
 #define CHANGES_URL SERVICE_URI "/changes"
 #define APPS_URL SERVICE_URI "/apps"
 
+#define RESUMABLE_THRESHOLD (5 * 1024 * 1024)
+// chunks of a resumable session have to be multiples of this
+#define RESUMABLE_CHUNK_SIZE (256 * 1024)
+#define RESUMABLE_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+// seconds a chunk round trip may take before chunks stop growing
+#define RESUMABLE_CHUNK_TARGET 1.0
+
 #define STRING_SET_ATTR(name) void set_##name(std::string name) { \
     _query[#name] = name;\
 }
@@ -52,6 +65,8 @@ template<class ResType, RequestMethod method>
 class ResourceRequest : public CredentialHttpRequest {
     CLASS_MAKE_LOGGER
     public:
+        typedef std::function<void (ResType& res, std::exception_ptr error)> ResultCallback;
+
         ResourceRequest(Credential* cred, std::string uri)
             :CredentialHttpRequest(cred, uri, method) {}
 
@@ -63,6 +78,35 @@ class ResourceRequest : public CredentialHttpRequest {
 
         }
 
+        // Runs the request on the AsyncEngine, the request has to stay alive until callback is called
+        virtual void execute_async(ResultCallback callback) {
+            _prepare_body();
+            CredentialHttpRequest::request_async([this, callback](std::exception_ptr error) {
+                ResType _1 = _initial_resource();
+                if (!error) {
+                    try {
+                        get_resource(_1);
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                }
+                callback(_1, error);
+            });
+        }
+
+        std::future<ResType> execute_async() {
+            std::shared_ptr<std::promise<ResType> > promise(new std::promise<ResType>());
+            std::future<ResType> future = promise->get_future();
+            execute_async([promise](ResType& res, std::exception_ptr error) {
+                if (error) {
+                    promise->set_exception(error);
+                } else {
+                    promise->set_value(res);
+                }
+            });
+            return future;
+        }
+
         inline void clear_fields() {
             if (_query.find("fields") == _query.end()) return;
             _query.erase("fields");
@@ -76,7 +120,16 @@ class ResourceRequest : public CredentialHttpRequest {
             }
         };
 
+        // Typed result of a request whose response was filled in by a BatchRequest
+        ResType result() {
+            ResType _1 = _initial_resource();
+            get_resource(_1);
+            return _1;
+        }
+
     protected:
+        virtual ResType _initial_resource() { return ResType(); }
+
         void get_resource(ResType& res) {
 
             if (_resp.status() != 200) {
@@ -99,6 +152,11 @@ class DeleteRequest : public CredentialHttpRequest {
         DeleteRequest(Credential* cred, std::string uri)
             :CredentialHttpRequest(cred, uri, RM_DELETE) {}
         void execute();
+        void execute_async(RequestCallback callback);
+        std::future<void> execute_async();
+        inline void result() { _check_status(); }
+    protected:
+        void _check_status();
 };
 
 template<class ResType, RequestMethod method>
@@ -117,6 +175,9 @@ class ResourceAttachedRequest : public ResourceRequest<ResType, method> {
         }
 
     protected:
+        void _prepare_body() { _json_encode_body(); }
+        ResType _initial_resource() { return *_resource; }
+
         void _json_encode_body() {
             std::set<std::string> fields = _resource->get_modified_fields();
             _resource->clear();
@@ -215,13 +276,79 @@ enum UploadType {
     UT_UPDATE
 };
 
+enum UploadProtocol {
+    UP_MEDIA,
+    UP_MULTIPART,
+    UP_RESUMABLE
+};
+
+// What a resumable session does after a chunk
+enum ChunkOutcome {
+    CO_NEXT,        // send the next chunk
+    CO_RESUME,      // ask the server what it has, then go on from there
+    CO_DONE
+};
+
 class FileUploadRequest: public ResourceAttachedRequest<GFile, RM_POST> {
     CLASS_MAKE_LOGGER
     public:
         FileUploadRequest(FileContent* content, GFile* file, Credential* cred, std::string uri, bool resumable = false)
-            :ResourceAttachedRequest<GFile, RM_POST>(file, cred, uri), _content(content), _resumable(resumable), _type(UT_CREATE) {}
+            :ResourceAttachedRequest<GFile, RM_POST>(file, cred, uri), _content(content), _resumable(resumable), _type(UT_CREATE),
+             _pipelined(false), _pipeline_depth(UPLOAD_PIPELINE_DEPTH), _adaptive(true), _chunk_size(RESUMABLE_CHUNK_SIZE),
+             _min_chunk_size(RESUMABLE_CHUNK_SIZE), _max_chunk_size(RESUMABLE_MAX_CHUNK_SIZE),
+             _chunk_target(RESUMABLE_CHUNK_TARGET), _verify_checksum(true), _dedup(NULL), _dedup_action(DA_NONE),
+             _files_url(FILES_URL), _journal(NULL), _chunk_start(0), _chunk_length(0), _cur_pos(0), _prev_pos(0), _file_length(0),
+             _chunk_seconds(0), _session_seconds(0), _buffer_start(0), _origin_method(RM_POST)
+        {
+            // a failed chunk is picked up by a status query, which also adapts the chunk size
+            set_retry_policy(NULL);
+        }
 
         GFile execute();
+        using ResourceAttachedRequest<GFile, RM_POST>::execute_async;
+        // Every round trip of the upload is a continuation on the engine, so the content is
+        // read and the progress callback called on an I/O thread. A stream source that is
+        // slow to produce its next chunk holds that thread up, execute() is better for those.
+        // With a dedup index the content is hashed on the calling thread first.
+        void execute_async(ResultCallback callback);
+
+        // Read the next chunks of a resumable session while the current one is in flight
+        inline void set_pipelined(bool flag) { _pipelined = flag; }
+        inline void set_pipeline_depth(int depth) { _pipeline_depth = depth; }
+        // Size of the first chunk, rounded up to a multiple of RESUMABLE_CHUNK_SIZE
+        void set_chunk_size(long long size);
+        // Chunks double while a round trip stays under the target and halve after a 5xx or a
+        // timeout, always within the bounds. Without it every chunk has the size set above.
+        inline void set_adaptive_chunk_size(bool flag) { _adaptive = flag; }
+        void set_chunk_size_bounds(long long min_size, long long max_size);
+        inline void set_chunk_target(double seconds) { _chunk_target = seconds; }
+        inline void set_progress_callback(UploadProgressCallback callback) { _progress = callback; }
+        inline const UploadStats& stats() const { return _stats; }
+        // Compare the md5 of what was sent with md5Checksum of the uploaded file,
+        // IntegrityException if they differ
+        inline void set_verify_checksum(bool flag) { _verify_checksum = flag; }
+        // Look the content up in index before sending it. An insert of content that is
+        // already in Drive becomes a copy of that file or is skipped, an update of a file
+        // with the same content only changes its metadata. Uploads add their result.
+        inline void set_dedup(DedupIndex* index, DedupAction action) {
+            _dedup = index;
+            _dedup_action = action;
+        }
+        // id of the file an update replaces, the dedup index needs it
+        inline void set_file_id(std::string id) { _file_id = id; }
+        // the endpoint a deduplicated upload copies or patches the file it found at, FILES_URL unless set
+        inline void set_files_url(std::string url) { _files_url = url; }
+        // Record the resumable session of the content read from path in journal. If the
+        // journal already has a session for path and the file hasn't changed since, the
+        // upload continues from what the server has instead of starting over.
+        inline void set_journal(UploadJournal* journal, std::string path) {
+            _journal = journal;
+            _journal_path = path;
+        }
+        // chunk size that keeps a link of this bandwidth (bytes per second) and round trip busy
+        static long long chunk_size_for(double bandwidth, double rtt);
+        // Typed result after a BatchRequest sent the upload, checked like execute() checks it
+        GFile result();
         BOOL_SET_ATTR(convert)
         BOOL_SET_ATTR(ocr)
         STRING_SET_ATTR(orcLanguag)
@@ -236,10 +363,110 @@ class FileUploadRequest: public ResourceAttachedRequest<GFile, RM_POST> {
 
     protected:
         std::string _generate_boundary() { return "======xxxxx=="; }
-        int _resume();
+        UploadProtocol _prepare_upload();
+        // Content-Type header and the strings around the content of a multipart upload
+        void _multipart_framing(std::string& preamble, std::string& epilogue);
+        // every attempt sends a streamed body from its start, the one after a 401 too
+        void _transfer();
+        void _transfer_async(RequestCallback callback, double delay);
+        // back to the start of the multipart body or of the chunk in flight
+        void _rewind_body();
+        // A batch part carries its whole body, so the content is read into memory
+        // and goes out as a media or multipart upload
+        void _prepare_body();
+        void _check_upload_status();
+        void _check_checksum(GFile& file);
+        // the checked result of a finished upload, added to the dedup index
+        GFile _uploaded(bool check_status);
+        // md5 and length of the content if it is to be looked up in the dedup index
+        bool _dedup_key(std::string& md5, long long& length);
+        // id of a file in the dedup index the upload can be taken care of with, "" if there is none
+        std::string _dedup_source(std::string md5, long long length);
+        // true if the upload was taken care of without sending the content
+        bool _deduplicate(GFile& file);
+        void _deduplicate_async(std::string md5, long long length, ResultCallback callback);
+        void _upload_async(ResultCallback callback);
+        // A resumable session is a chain of round trips, each step below sets up or
+        // takes the response of one of them; execute() runs the chain on its own
+        // thread, execute_async() as continuations on the engine
+        void _resumable_upload();
+        void _resumable_upload_async(RequestCallback callback);
+        // Steps 1 and 2, the session URI becomes the uri of the request
+        void _prepare_session();
+        void _session_opened();
+        void _open_session_async(RequestCallback callback);
+        // the session the journal has for the content, false if there is none or the file changed
+        bool _journaled_session(UploadSession& session);
+        // asks the server how far the journaled session got
+        void _prepare_reopen(UploadSession& session);
+        // false if the session expired and a new one has to be opened
+        bool _session_reopened();
+        // true if the server had the whole content already
+        bool _start_chunks(bool resumed);
+        void _prepare_chunk();
+        void _prepare_stream_chunk();
+        // true if the chunk timed out, any other failure of it is thrown
+        bool _chunk_timed_out(std::exception_ptr error);
+        bool _send_chunk();
+        ChunkOutcome _chunk_sent(bool timeout);
+        ChunkOutcome _stream_chunk_sent(bool timeout);
+        // the status query after a failed chunk, total < 0 while the length of the content is unknown
+        void _prepare_resume(long long total);
+        // bytes the server has after a status query
+        long long _resumed(long long total);
+        // true if the status query found the upload finished
+        bool _chunk_resumed();
+        // drops what the server confirmed from the front of a stream's buffer
+        void _confirm_stream(long long acked);
+        void _next_chunk_async(RequestCallback callback);
+        void _finish_chunks();
+        void _track_chunk(long long length);
+        void _report(long long sent, long long chunk_bytes, double seconds, double total_seconds);
+        // digests mapped content and drops its pages as soon as curl has sent them
+        static int _release_sent(void* context, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+        void _adapt_chunk_size(double seconds, bool failed);
+        static long long _round_chunk_size(long long size);
         FileContent* _content;
         bool _resumable;
         UploadType _type;
+        bool _pipelined;
+        int _pipeline_depth;
+        bool _adaptive;
+        long long _chunk_size;
+        long long _min_chunk_size;
+        long long _max_chunk_size;
+        double _chunk_target;
+        bool _verify_checksum;
+        DedupIndex* _dedup;
+        DedupAction _dedup_action;
+        std::string _files_url;
+        std::string _file_id;
+        UploadJournal* _journal;
+        std::string _journal_path;
+        UploadProgressCallback _progress;
+        UploadStats _stats;
+        long long _chunk_start;
+        long long _chunk_length;
+        MultipartReader _multipart;
+        // a resumable session between its round trips
+        long long _cur_pos;
+        long long _prev_pos;
+        // < 0 while a stream hasn't ended
+        long long _file_length;
+        std::unique_ptr<ChunkPipeline> _pipeline;
+        std::chrono::steady_clock::time_point _session_start;
+        std::chrono::steady_clock::time_point _sent_at;
+        double _chunk_seconds;
+        double _session_seconds;
+        // The source of a stream can't be read twice, so whatever the server hasn't
+        // confirmed yet stays in the buffer, which starts at _buffer_start and holds
+        // at most one chunk plus what was left over when the chunk size shrank
+        std::string _buffer;
+        long long _buffer_start;
+        // where the request went before a journaled session was tried
+        std::string _origin_uri;
+        RequestQuery _origin_query;
+        RequestMethod _origin_method;
 };
 
 typedef FileUploadRequest FileInsertRequest;
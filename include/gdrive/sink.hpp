@@ -0,0 +1,85 @@
+#ifndef __GDRIVE_SINK_HPP__
+#define __GDRIVE_SINK_HPP__
+
+#include "gdrive/config.hpp"
+#include "common/all.hpp"
+#include "jconer/json.hpp"
+
+#include <string>
+#include <sys/types.h>
+
+namespace GDRIVE {
+
+// Response sinks for HttpRequest::set_response_sink(Sink::write, &sink).
+// Each one sees the body chunk by chunk, so memory stays bounded by the
+// chunk size curl hands out rather than by the size of the response.
+
+class FdSink {
+    CLASS_MAKE_LOGGER
+    public:
+        // With offset >= 0 the body is written with pwrite starting at offset,
+        // otherwise it is appended at the current position of fd. With limit >= 0
+        // a body longer than limit bytes stops the transfer once limit is written.
+        FdSink(int fd, off_t offset = -1, long long limit = -1)
+            :_fd(fd), _offset(offset), _limit(limit), _written(0) {}
+        static size_t write(void* ptr, size_t size, size_t nmemb, void* userp);
+        inline long long written() const { return _written; }
+    private:
+        int _fd;
+        off_t _offset;
+        long long _limit;
+        long long _written;
+};
+
+class MmapSink {
+    CLASS_MAKE_LOGGER
+    public:
+        MmapSink(void* region, size_t length)
+            :_region((char*)region), _length(length), _pos(0) {}
+        static size_t write(void* ptr, size_t size, size_t nmemb, void* userp);
+        inline size_t written() const { return _pos; }
+    private:
+        char* _region;
+        size_t _length;
+        size_t _pos;
+};
+
+typedef void (*JsonItemFunction) (JCONER::JObject* item, void* context);
+
+// Incremental parser for list responses. Every element of the top level
+// "items" array is parsed and handed to the callback as soon as it is
+// complete; the rest of the document (nextPageToken and friends) is kept
+// and parsed once the body is done.
+class JsonItemSink {
+    CLASS_MAKE_LOGGER
+    public:
+        JsonItemSink(JsonItemFunction callback, void* context);
+        static size_t write(void* ptr, size_t size, size_t nmemb, void* userp);
+        // caller owns the returned object, NULL if the envelope isn't valid JSON
+        JCONER::JObject* envelope();
+        inline long items() const { return _items; }
+    private:
+        void _feed(char c);
+        void _emit();
+
+        JsonItemFunction _callback;
+        void* _context;
+        std::string _envelope;
+        std::string _capture;
+        std::string _string;
+        std::string _last_string;
+        // the last top-level string that was followed by a colon
+        std::string _key;
+        // the next top-level token is the value of _key
+        bool _after_colon;
+        int _depth;
+        bool _in_string;
+        bool _escape;
+        bool _in_items;
+        bool _capturing;
+        long _items;
+};
+
+}
+
+#endif
@@ -5,7 +5,13 @@
 #include "common/all.hpp"
 
 #include <map>
+#include <set>
+#include <list>
 #include <fstream>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
 namespace GDRIVE {
 
@@ -19,21 +25,90 @@ class Store {
         virtual std::string get(std::string key) = 0;
         virtual void put(std::string key, std::string value) = 0;
         virtual bool dump() = 0;
+        // Saves the content later, off the calling thread; stores that can't do
+        // that save it right away
+        virtual void dump_async() { dump(); }
+        // waits for a save dump_async put off
+        virtual bool flush() { return true; }
         inline StoreStatus status() const { return _status; }
     protected:
         StoreStatus _status;
 };
 
+// Writes the file next to itself and renames it over the old one, a crash
+// leaves either the old content or the new one
 class FileStore : public Store {
     CLASS_MAKE_LOGGER
     public:
         FileStore(std::string filename);
+        // writes what dump_async still has to
+        ~FileStore();
         std::string get(std::string);
         void put(std::string key, std::string value);
         bool dump();
+        // leaves the write to the StoreWriter, dumps in quick succession are written once
+        void dump_async();
+        bool flush();
     private:
+        FileStore(const FileStore& other);
+        FileStore& operator=(const FileStore& other);
+
+        std::mutex _mutex;
         std::map<std::string, std::string>  _content;
         std::string _filename;
+        // one write of the file at a time
+        std::mutex _write_mutex;
+};
+
+struct StoreWriterStats {
+    StoreWriterStats() :scheduled(0), written(0), failed(0) {}
+    long long scheduled;    // dump_async calls
+    long long written;      // files written, what was scheduled less what was coalesced
+    long long failed;
+};
+
+// Background thread that writes the stores dump_async was called on. A store
+// that is scheduled again before the thread gets to it is written once, with
+// the content it has by then.
+class StoreWriter {
+    CLASS_MAKE_LOGGER
+    public:
+        static StoreWriter& get_instance() {
+            return _single_instance;
+        }
+
+        void schedule(FileStore* store);
+        // Returns once every store scheduled so far has been written; call it
+        // before the process exits
+        void flush();
+        // takes store off the queue, true if it was on it; waits while it is being written
+        bool remove(FileStore* store);
+        StoreWriterStats stats();
+        // False before the writer is constructed and once it is destroyed. A store
+        // with static storage duration may outlive it, it then saves on its own.
+        static bool alive() { return _alive; }
+    private:
+        StoreWriter();
+        // flushes and stops the thread
+        ~StoreWriter();
+        StoreWriter(const StoreWriter& other);
+        StoreWriter& operator=(const StoreWriter& other);
+        static StoreWriter _single_instance;
+        // constant initialized, so it can be read before and after the writer's lifetime
+        static std::atomic<bool> _alive;
+
+        void _run();
+
+        std::mutex _mutex;
+        std::condition_variable _wakeup;
+        std::condition_variable _idle;
+        std::list<FileStore*> _queue;
+        std::set<FileStore*> _queued;
+        FileStore* _writing;
+        bool _started;
+        bool _stopping;
+        std::thread _thread;
+        StoreWriterStats _stats;
 };
 
 
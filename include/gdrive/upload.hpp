@@ -0,0 +1,137 @@
+#ifndef __GDRIVE_UPLOAD_HPP__
+#define __GDRIVE_UPLOAD_HPP__
+
+#include "gdrive/filecontent.hpp"
+#include "gdrive/error.hpp"
+#include "gdrive/util.hpp"
+#include "gdrive/store.hpp"
+#include "common/all.hpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+
+#define UPLOAD_PIPELINE_DEPTH 3
+#define UPLOAD_PIPELINE_BLOCK_SIZE (4 * 1024 * 1024)
+#define UPLOAD_SESSION_PREFIX "upload_session:"
+
+namespace GDRIVE {
+
+// Progress of one resumable session, reported after every acknowledged chunk
+struct UploadStats {
+    UploadStats() :sent(0), total(0), chunks(0), rate(0), average_rate(0),
+        chunk_size(0), min_chunk_size(0), max_chunk_size(0), shrinks(0) {}
+    long long sent; // bytes the server has confirmed
+    long long total;
+    int chunks;
+    double rate; // bytes per second of the last chunk
+    double average_rate; // bytes per second since the session started
+    long long chunk_size; // size of the last chunk sent
+    long long min_chunk_size; // smallest and largest chunk of the session
+    long long max_chunk_size;
+    int shrinks; // times the chunk size was cut after a failure
+};
+
+typedef std::function<void (const UploadStats& stats)> UploadProgressCallback;
+
+// Produces a multipart/related body on the fly: the preamble with the
+// metadata part, the file bytes, then the epilogue. Only the two framing
+// strings are held in memory.
+class MultipartReader {
+    public:
+        MultipartReader() :_content(NULL), _pos(0) {}
+        void reset(std::string preamble, FileContent* content, std::string epilogue);
+        // Content-Length of the whole body
+        long long length();
+        // back to the start of the body, for sending it again
+        inline void rewind() { _pos = 0; }
+        static size_t read(void* ptr, size_t size, size_t nmemb, void* userp);
+    private:
+        std::string _preamble;
+        FileContent* _content;
+        std::string _epilogue;
+        long long _pos;
+};
+
+// Reads a resumable upload ahead of the network on a thread of its own,
+// into a fixed ring of depth blocks, so the next chunk is in memory as soon
+// as the current one is acknowledged. Chunks don't have to line up with
+// blocks.
+class ChunkPipeline {
+    CLASS_MAKE_LOGGER
+    public:
+        ChunkPipeline(FileContent* content, int block_size = UPLOAD_PIPELINE_BLOCK_SIZE, int depth = UPLOAD_PIPELINE_DEPTH);
+        ~ChunkPipeline();
+        // Bytes of the file from pos on, blocks until they are read. length is
+        // set to what is buffered contiguously, 0 at the end of the file. The
+        // pointer stays valid until the next call.
+        const char* data_at(long long pos, long long& length);
+        // Next chunk for read(), length bytes from pos
+        void set_range(long long pos, long long length);
+        // back to the start of the chunk, for sending it again
+        void rewind();
+        // curl read callback over the range, userp is the pipeline
+        static size_t read(void* ptr, size_t size, size_t nmemb, void* userp);
+        inline std::string error() const { return _read_error; }
+    private:
+        struct Block {
+            long long offset;
+            std::string data;
+        };
+        ChunkPipeline(const ChunkPipeline& other);
+        ChunkPipeline& operator=(const ChunkPipeline& other);
+        void _start(long long pos);
+        void _stop();
+        void _read_loop();
+
+        FileContent* _content;
+        long long _block_size;
+        long long _length;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::deque<Block> _ready;
+        std::vector<std::string> _spare;
+        long long _next;
+        bool _stopping;
+        std::string _error;
+        std::thread _reader;
+        long long _range_start;
+        long long _range_length;
+        long long _cursor;
+        long long _remaining;
+        std::string _read_error;
+};
+
+// A resumable session that was started for a local file
+struct UploadSession {
+    UploadSession() :size(-1), mtime(-1) {}
+    std::string uri;
+    long long size;
+    long long mtime;
+};
+
+// Keeps the resumable session URIs of running uploads in a Store, so an
+// upload interrupted by a restart continues where the server left off.
+// Sessions are keyed by the path of the source file; its size and mtime
+// tell whether the file is still the one the session was started for.
+class UploadJournal {
+    CLASS_MAKE_LOGGER
+    public:
+        UploadJournal(Store* store);
+        bool load(std::string path, UploadSession& session);
+        void save(std::string path, UploadSession& session);
+        void remove(std::string path);
+        // the session describing path as it is now, without uri
+        static bool current(std::string path, UploadSession& session);
+    private:
+        Store* _store;
+        std::mutex _mutex;
+};
+
+}
+
+#endif
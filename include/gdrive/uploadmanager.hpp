@@ -0,0 +1,161 @@
+#ifndef __GDRIVE_UPLOADMANAGER_HPP__
+#define __GDRIVE_UPLOADMANAGER_HPP__
+
+#include "gdrive/config.hpp"
+#include "gdrive/credential.hpp"
+#include "gdrive/gitem.hpp"
+#include "gdrive/filecontent.hpp"
+#include "gdrive/upload.hpp"
+#include "gdrive/batch.hpp"
+#include "common/all.hpp"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+#define UPLOAD_MANAGER_WORKERS 4
+#define UPLOAD_BATCH_FILE_SIZE (4 * 1024)
+
+namespace GDRIVE {
+
+enum UploadJobState {
+    UJ_QUEUED = 0,
+    UJ_RUNNING,
+    UJ_DONE,
+    UJ_FAILED
+};
+
+struct UploadJobStatus {
+    UploadJobStatus() :id(-1), state(UJ_QUEUED), size(0), sent(0) {}
+    int id;
+    UploadJobState state;
+    long long size; // -1 for streams of unknown length
+    long long sent;
+    GFile result;
+    std::exception_ptr error;
+};
+
+struct UploadManagerStats {
+    UploadManagerStats() :queued(0), running(0), done(0), failed(0), batches(0), bytes(0), rate(0), files_per_second(0) {}
+    size_t queued;
+    size_t running;
+    size_t done;
+    size_t failed;
+    size_t batches; // BatchRequests sent, each carrying several jobs
+    long long bytes; // confirmed by the server, finished jobs and running ones
+    double rate; // bytes per second since the first job started
+    double files_per_second;
+};
+
+typedef std::function<void (int job, GFile& file, std::exception_ptr error)> UploadJobCallback;
+typedef std::function<void (int job, const UploadStats& stats)> UploadJobProgressCallback;
+
+// Runs file inserts on a fixed pool of workers. Each job is a
+// FileInsertRequest of the manager's credential, which picks media,
+// multipart or resumable upload for it. The smallest queued job runs first, so a few large files don't hold up
+// many small ones; a large file is still started whenever none is running,
+// and large files never take all the workers.
+//
+// With batching on, a worker that picks a small enough job takes the other
+// small ones at the front of the queue with it and sends them all in one
+// BatchRequest, each as a media or multipart upload part. Drive's own batch
+// endpoint doesn't take upload parts, so batching stays off until
+// set_batch_uri() names an endpoint that does. Every job still
+// gets its own result or error. Batched jobs don't look their content up in
+// the dedup index, though their results are added to it.
+class UploadManager {
+    CLASS_MAKE_LOGGER
+    public:
+        UploadManager(Credential* cred, int workers = UPLOAD_MANAGER_WORKERS);
+        ~UploadManager();
+
+        // content has to stay alive until the job has finished, callback runs on a worker
+        int add(GFile file, FileContent* content, UploadJobCallback callback = UploadJobCallback());
+        inline void set_progress_callback(UploadJobProgressCallback callback) { _progress = callback; }
+        // Files from this size on count as large
+        inline void set_large_file_size(long long size) { _large_size = size; }
+        // Files up to max_file_size go out up to max_files at a time in one BatchRequest,
+        // max_files below 2 sends every file on its own, which is the default. Only takes
+        // effect with a batch endpoint from set_batch_uri.
+        void set_batching(int max_files, long long max_file_size = UPLOAD_BATCH_FILE_SIZE);
+        inline void set_upload_uri(std::string uri) { _upload_uri = uri; }
+        // a batch endpoint that takes upload parts, there is none by default
+        void set_batch_uri(std::string uri);
+        // jobs look their content up in index before sending it, see FileUploadRequest::set_dedup
+        inline void set_dedup_index(DedupIndex* index, DedupAction action = DA_COPY) {
+            _dedup = index;
+            _dedup_action = action;
+        }
+        UploadJobStatus status(int job);
+        UploadManagerStats stats();
+        size_t queue_depth();
+        // drops the status of finished jobs
+        void clear_finished();
+        // blocks until every job added so far has finished
+        void wait();
+        // jobs that haven't started fail with UploadException
+        void shutdown();
+    private:
+        UploadManager(const UploadManager& other);
+        UploadManager& operator=(const UploadManager& other);
+
+        struct Job {
+            GFile file;
+            FileContent* content;
+            UploadJobCallback callback;
+            UploadJobStatus status;
+        };
+        // (size, id) orders the queue by size, then by arrival
+        typedef std::set<std::pair<long long, int> > JobQueue;
+
+        void _run();
+        // the next job to start, -1 if there is none; called with _mutex held
+        int _next_job();
+        // adds the batchable jobs that go out with ids[0]; called with _mutex held
+        void _next_batch(std::vector<int>& ids);
+        void _upload(int id, GFile& file, FileContent* content, bool large);
+        void _upload_batch(const std::vector<int>& ids, std::vector<GFile>& files, std::vector<FileContent*>& contents);
+        void _finish(int id, bool large, GFile& file, std::exception_ptr error);
+        bool _large(long long size) { return size < 0 || size >= _large_size; }
+        bool _batchable(long long size) {
+            return _batch_files > 1 && _batch_uri != "" && size >= 0 && size <= _batch_file_size;
+        }
+
+        Credential* _cred;
+        int _workers;
+        long long _large_size;
+        int _batch_files;
+        long long _batch_file_size;
+        std::string _upload_uri;
+        std::string _batch_uri;
+        DedupIndex* _dedup;
+        DedupAction _dedup_action;
+        UploadJobProgressCallback _progress;
+
+        std::mutex _mutex;
+        std::condition_variable _work;
+        std::condition_variable _idle;
+        std::vector<std::thread> _threads;
+        bool _stopping;
+        int _next_id;
+        JobQueue _small;
+        JobQueue _large_queue;
+        int _running;
+        int _running_large;
+        std::map<int, Job> _jobs;
+        UploadManagerStats _stats; // done, failed and bytes of finished jobs
+        long long _running_bytes;
+        bool _started;
+        std::chrono::steady_clock::time_point _start;
+};
+
+}
+
+#endif
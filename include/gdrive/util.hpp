@@ -7,6 +7,10 @@
 #include <cctype>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
 #include "common/all.hpp"
 
 #define UNSAFE " $&+,/:;=@\"<>#%{}|\\^~[]`"
@@ -56,6 +60,62 @@ class URLHelper {
         }
 };
 
+// Byte counts and offsets of large files don't fit into an int, these keep them 64-bit
+class SizeHelper {
+    public:
+        static std::string itos(long long size) {
+            char tmp[32];
+            snprintf(tmp, sizeof(tmp), "%lld", size);
+            return tmp;
+        }
+
+        static long long stoll(std::string str) {
+            return strtoll(str.c_str(), NULL, 10);
+        }
+
+        // last byte of a Range header like "bytes=0-1234", -1 if nothing is covered
+        static long long range_end(std::string range) {
+            size_t pos = range.rfind('-');
+            if (pos == std::string::npos) return -1;
+            return stoll(range.substr(pos + 1));
+        }
+};
+
+class FileHelper {
+    public:
+        // Writes content next to path and renames it over path, a crash leaves
+        // either the old content or the new one. The directory is synced after
+        // the rename, which is only durable once it is.
+        static bool write_atomic(std::string path, const std::string& content, mode_t mode) {
+            std::string tmp = path + ".tmp";
+            int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+            if (fd < 0) {
+                return false;
+            }
+            size_t done = 0;
+            while (done < content.size()) {
+                ssize_t n = write(fd, content.data() + done, content.size() - done);
+                if (n <= 0) break;
+                done += n;
+            }
+            bool ok = done == content.size() && fsync(fd) == 0;
+            close(fd);
+            if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+                unlink(tmp.c_str());
+                return false;
+            }
+
+            size_t slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd < 0) {
+                return false;
+            }
+            ok = fsync(dir_fd) == 0;
+            close(dir_fd);
+            return ok;
+        }
+};
 
 }
 
@@ -1,6 +1,8 @@
 #include "gdrive/gdrive.hpp"
 
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <assert.h>
@@ -17,18 +19,25 @@ GFile get_file(Drive& service, std::string file_id) {
     return file;
 }
 
-void download_file(GFile& file, Credential* cred) {
-    std::string url = file.get_downloadUrl();
-    if (url == "") {
-        url = file.get_exportLinks()["application/pdf"];
-    }
-    CredentialHttpRequest request(cred, url, RM_GET);
-    HttpResponse resp = request.request();
+void download_file(Drive& service, GFile& file, Credential* cred) {
     std::string filename = file.get_originalFilename();
     if (filename == "") {
         filename = file.get_title();
     }
 
+    std::string url = file.get_downloadUrl();
+    if (url != "") {
+        int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        service.files().Download(file.get_id(), fd).execute();
+        close(fd);
+        return;
+    }
+
+    url = file.get_exportLinks()["application/pdf"];
+    CredentialHttpRequest request(cred, url, RM_GET);
+    HttpResponse& resp = request.request();
+
     std::ofstream fout(filename.c_str(), std::ios::binary);
     fout.write(resp.content().c_str(), resp.content().size());
     fout.close();
@@ -79,5 +88,5 @@ int main(int argc, char** argv) {
     Drive service(&cred);
 
     GFile file = get_file(service, argv[1]);
-    download_file(file, &cred);
+    download_file(service, file, &cred);
 }
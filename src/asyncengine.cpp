@@ -0,0 +1,281 @@
+#include "gdrive/asyncengine.hpp"
+
+#include <future>
+#include <chrono>
+
+#define ASYNC_WAIT_MS 100
+#define ASYNC_FALLBACK_WAIT_MS 5
+
+namespace GDRIVE {
+
+AsyncEngine AsyncEngine::_single_instance;
+thread_local bool AsyncEngine::_on_io_thread = false;
+
+AsyncEngine::AsyncEngine()
+    :_io_threads(ASYNC_DEFAULT_IO_THREADS), _next(0),
+     _http_version(HV_DEFAULT), _max_concurrent_streams(ASYNC_DEFAULT_MAX_STREAMS)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("AsyncEngine", L_DEBUG)
+#endif
+}
+
+AsyncEngine::~AsyncEngine() {
+    shutdown();
+}
+
+void AsyncEngine::set_io_threads(int n) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_workers.size() != 0) {
+        CLOG_WARN("AsyncEngine is already running, io threads stay at %d\n", (int)_workers.size());
+        return;
+    }
+    _io_threads = n < 1 ? 1 : n;
+}
+
+void AsyncEngine::set_http_version(HttpVersion version) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_workers.size() != 0) {
+        CLOG_WARN("AsyncEngine is already running, http version is not changed\n");
+        return;
+    }
+#if LIBCURL_VERSION_NUM < 0x073100
+    if (version != HV_DEFAULT) {
+        CLOG_WARN("libcurl is too old for HTTP/2 multiplexing, staying on HTTP/1.1\n");
+        version = HV_DEFAULT;
+    }
+#endif
+    _http_version = version;
+}
+
+void AsyncEngine::set_max_concurrent_streams(long streams) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_workers.size() != 0) {
+        CLOG_WARN("AsyncEngine is already running, max concurrent streams is not changed\n");
+        return;
+    }
+    _max_concurrent_streams = streams < 1 ? 1 : streams;
+}
+
+void AsyncEngine::configure_handle(CURL* handle) {
+#if LIBCURL_VERSION_NUM >= 0x073100
+    if (_http_version == HV_HTTP2) {
+        // ALPN negotiates h2 and falls back to HTTP/1.1 if the server doesn't offer it
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    } else if (_http_version == HV_HTTP2_PRIOR_KNOWLEDGE) {
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    }
+#else
+    (void)handle;
+#endif
+}
+
+CURLcode AsyncEngine::perform(CURL* handle) {
+    if (_on_io_thread) {
+        // only this thread could finish the transfer, it can't wait for itself
+        CLOG_DEBUG("Blocking transfer on an I/O thread, performing it in place\n");
+        return curl_easy_perform(handle);
+    }
+    std::promise<CURLcode> promise;
+    std::future<CURLcode> future = promise.get_future();
+    submit(handle, [&promise](CURLcode res) {
+        promise.set_value(res);
+    });
+    return future.get();
+}
+
+void AsyncEngine::_start() {
+    for (int i = 0; i < _io_threads; i ++) {
+        Worker* worker = new Worker();
+        worker->multi = curl_multi_init();
+#if LIBCURL_VERSION_NUM >= 0x073100
+        if (_http_version != HV_DEFAULT) {
+            curl_multi_setopt(worker->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+            curl_multi_setopt(worker->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, _max_concurrent_streams);
+#endif
+        }
+#endif
+        worker->running = true;
+        worker->thread = std::thread(&AsyncEngine::_run, this, worker);
+        _workers.push_back(worker);
+    }
+}
+
+double AsyncEngine::_now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void AsyncEngine::submit(CURL* handle, TransferCallback callback, double delay) {
+    Worker* worker;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_workers.size() == 0) {
+            _start();
+        }
+        worker = _workers[_next ++ % _workers.size()];
+    }
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if (delay > 0) {
+            worker->delayed.insert(std::make_pair(_now() + delay, std::make_pair(handle, callback)));
+        } else {
+            worker->pending.push_back(std::make_pair(handle, callback));
+        }
+    }
+    // the I/O thread may have to wait less than it is about to
+    _wakeup(worker);
+}
+
+void AsyncEngine::cancel(CURL* handle) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i = 0; i < _workers.size(); i ++) {
+        Worker* worker = _workers[i];
+        {
+            std::lock_guard<std::mutex> worker_lock(worker->mutex);
+            std::multimap<double, std::pair<CURL*, TransferCallback> >::iterator iter = worker->delayed.begin();
+            while (iter != worker->delayed.end() && iter->second.first != handle) {
+                iter ++;
+            }
+            if (iter == worker->delayed.end()) continue;
+            worker->cancelled.push_back(iter->second.second);
+            worker->delayed.erase(iter);
+        }
+        _wakeup(worker);
+        return;
+    }
+}
+
+int AsyncEngine::in_flight() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    int total = 0;
+    for (size_t i = 0; i < _workers.size(); i ++) {
+        std::lock_guard<std::mutex> worker_lock(_workers[i]->mutex);
+        total += _workers[i]->pending.size() + _workers[i]->delayed.size() + _workers[i]->cancelled.size()
+            + _workers[i]->active.size();
+    }
+    return total;
+}
+
+void AsyncEngine::shutdown() {
+    std::vector<Worker*> workers;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        workers.swap(_workers);
+    }
+    for (size_t i = 0; i < workers.size(); i ++) {
+        Worker* worker = workers[i];
+        {
+            std::lock_guard<std::mutex> worker_lock(worker->mutex);
+            worker->running = false;
+        }
+        _wakeup(worker);
+        worker->thread.join();
+        curl_multi_cleanup(worker->multi);
+        delete worker;
+    }
+}
+
+void AsyncEngine::_wakeup(Worker* worker) {
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_wakeup(worker->multi);
+#else
+    (void)worker;
+#endif
+}
+
+void AsyncEngine::_run(Worker* worker) {
+    _on_io_thread = true;
+    std::vector<std::pair<TransferCallback, CURLcode> > finished;
+    while (true) {
+        int wait_ms = ASYNC_WAIT_MS;
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            if (!worker->running) break;
+            for (size_t i = 0; i < worker->pending.size(); i ++) {
+                curl_multi_add_handle(worker->multi, worker->pending[i].first);
+                worker->active[worker->pending[i].first] = worker->pending[i].second;
+            }
+            worker->pending.clear();
+            for (size_t i = 0; i < worker->cancelled.size(); i ++) {
+                finished.push_back(std::make_pair(worker->cancelled[i], CURLE_ABORTED_BY_CALLBACK));
+            }
+            worker->cancelled.clear();
+
+            double now = _now();
+            while (!worker->delayed.empty() && worker->delayed.begin()->first <= now) {
+                std::pair<CURL*, TransferCallback>& due = worker->delayed.begin()->second;
+                curl_multi_add_handle(worker->multi, due.first);
+                worker->active[due.first] = due.second;
+                worker->delayed.erase(worker->delayed.begin());
+            }
+            if (!worker->delayed.empty()) {
+                int next_ms = (int)((worker->delayed.begin()->first - now) * 1000) + 1;
+                if (next_ms < wait_ms) wait_ms = next_ms;
+            }
+        }
+
+        int still_running = 0;
+        curl_multi_perform(worker->multi, &still_running);
+
+        CURLMsg* msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(worker->multi, &msgs_left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL* handle = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(worker->multi, handle);
+
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            std::map<CURL*, TransferCallback>::iterator iter = worker->active.find(handle);
+            if (iter != worker->active.end()) {
+                finished.push_back(std::make_pair(iter->second, res));
+                worker->active.erase(iter);
+            }
+        }
+
+        // callbacks run without the lock held, they are free to submit again
+        for (size_t i = 0; i < finished.size(); i ++) {
+            finished[i].first(finished[i].second);
+        }
+        finished.clear();
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+        curl_multi_poll(worker->multi, NULL, 0, wait_ms, NULL);
+#else
+        curl_multi_wait(worker->multi, NULL, 0, wait_ms < ASYNC_FALLBACK_WAIT_MS ? wait_ms : ASYNC_FALLBACK_WAIT_MS, NULL);
+#endif
+    }
+
+    // fail whatever is left so no caller waits forever
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        for (std::map<CURL*, TransferCallback>::iterator iter = worker->active.begin();
+                iter != worker->active.end(); iter ++) {
+            curl_multi_remove_handle(worker->multi, iter->first);
+            finished.push_back(std::make_pair(iter->second, CURLE_ABORTED_BY_CALLBACK));
+        }
+        worker->active.clear();
+        for (size_t i = 0; i < worker->pending.size(); i ++) {
+            finished.push_back(std::make_pair(worker->pending[i].second, CURLE_ABORTED_BY_CALLBACK));
+        }
+        worker->pending.clear();
+        for (std::multimap<double, std::pair<CURL*, TransferCallback> >::iterator iter = worker->delayed.begin();
+                iter != worker->delayed.end(); iter ++) {
+            finished.push_back(std::make_pair(iter->second.second, CURLE_ABORTED_BY_CALLBACK));
+        }
+        worker->delayed.clear();
+        for (size_t i = 0; i < worker->cancelled.size(); i ++) {
+            finished.push_back(std::make_pair(worker->cancelled[i], CURLE_ABORTED_BY_CALLBACK));
+        }
+        worker->cancelled.clear();
+    }
+    for (size_t i = 0; i < finished.size(); i ++) {
+        finished[i].first(finished[i].second);
+    }
+}
+
+}
@@ -0,0 +1,170 @@
+#include "gdrive/batch.hpp"
+#include "gdrive/connpool.hpp"
+
+#include <sstream>
+#include <vector>
+
+namespace GDRIVE {
+
+BatchRequest::BatchRequest(Credential* cred, std::string uri)
+    :CredentialHttpRequest(cred, uri, RM_POST), _max_batch_size(BATCH_MAX_REQUESTS)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("BatchRequest", L_DEBUG)
+#endif
+}
+
+void BatchRequest::add(CredentialHttpRequest* request) {
+    _requests.push_back(request);
+}
+
+void BatchRequest::set_max_batch_size(int max_size) {
+    if (max_size < 1 || max_size > BATCH_MAX_REQUESTS) {
+        CLOG_WARN("Wrong batch size[%d], using %d\n", max_size, BATCH_MAX_REQUESTS);
+        max_size = BATCH_MAX_REQUESTS;
+    }
+    _max_batch_size = max_size;
+}
+
+void BatchRequest::execute() {
+    for (size_t begin = 0; begin < _requests.size(); begin += _max_batch_size) {
+        size_t end = begin + _max_batch_size;
+        if (end > _requests.size()) end = _requests.size();
+        _execute_chunk(begin, end);
+    }
+}
+
+std::string BatchRequest::_serialize(CredentialHttpRequest* request, size_t index) {
+    request->_prepare_body();
+
+    std::string path = request->_uri.substr(ConnectionPool::host_of(request->_uri).size());
+    if (request->_query.size() != 0) {
+        path += "?" + URLHelper::encode(request->_query);
+    }
+
+    std::string method;
+    switch (request->_method) {
+        case RM_GET: method = "GET"; break;
+        case RM_POST: method = "POST"; break;
+        case RM_PUT: method = "PUT"; break;
+        case RM_DELETE: method = "DELETE"; break;
+        case RM_PATCH: method = "PATCH"; break;
+    }
+
+    VarString vs;
+    vs.append("Content-Type: application/http\r\n")
+      .append("Content-ID: <item").append(VarString::itos(index)).append(">\r\n\r\n")
+      .append(method).append(' ').append(path).append(" HTTP/1.1\r\n");
+    for (RequestHeader::iterator iter = request->_header.begin(); iter != request->_header.end(); iter ++) {
+        // the outer request carries the credential for every part
+        if (iter->first == "Authorization") continue;
+        vs.append(iter->first).append(": ").append(iter->second).append("\r\n");
+    }
+    vs.append("\r\n").append(request->_body);
+    return vs.toString();
+}
+
+void BatchRequest::_execute_chunk(size_t begin, size_t end) {
+    clear();
+    std::string boundary = _generate_boundary();
+    for (size_t i = begin; i < end; i ++) {
+        _body += "--" + boundary + "\r\n" + _serialize(_requests[i], i) + "\r\n";
+    }
+    _body += "--" + boundary + "--\r\n";
+    _header["Content-Type"] = "multipart/mixed; boundary=" + boundary;
+    _header["Content-Length"] = VarString::itos(_body.size());
+
+    CLOG_DEBUG("Sending batch of %d requests\n", (int)(end - begin));
+    // every part counts against the quota
+    _rate_cost = end - begin;
+    CredentialHttpRequest::request();
+    if (_resp.status() != 200) {
+        GoogleJsonResponseException exc = make_json_exception(_resp.content());
+        throw exc;
+    }
+    _parse_batch_response(begin, end);
+}
+
+void BatchRequest::_parse_batch_response(size_t begin, size_t end) {
+    std::vector<bool> answered(end - begin, false);
+    std::string content_type = _resp.get_header("Content-Type");
+    size_t pos = content_type.find("boundary=");
+    if (pos == std::string::npos) {
+        CLOG_ERROR("No boundary in batch response: %s\n", content_type.c_str());
+    } else {
+        std::string boundary = content_type.substr(pos + 9);
+        if (boundary.size() > 1 && boundary[0] == '"') {
+            boundary = boundary.substr(1, boundary.find('"', 1) - 1);
+        }
+        boundary = "--" + boundary;
+
+        const std::string& content = _resp.content();
+        size_t start = content.find(boundary);
+        size_t index = begin;
+        while (start != std::string::npos) {
+            start += boundary.size();
+            if (content.compare(start, 2, "--") == 0) break;
+            size_t next = content.find(boundary, start);
+            if (next == std::string::npos) break;
+            long answer = _parse_part(content.substr(start, next - start), begin, end, index ++);
+            if (answer >= 0) {
+                answered[answer - begin] = true;
+            }
+            start = next;
+        }
+    }
+
+    // a request the response has no part for would otherwise keep whatever its response held before
+    for (size_t i = begin; i < end; i ++) {
+        if (answered[i - begin]) continue;
+        CLOG_WARN("No response to batch request %d\n", (int)i);
+        HttpResponse& resp = _requests[i]->_resp;
+        resp.clear();
+        resp._content = "{\"error\": {\"code\": 500, \"message\": \"The batch response has no part for this request\"}}";
+        resp.set_status(500);
+    }
+}
+
+long BatchRequest::_parse_part(std::string part, size_t begin, size_t end, size_t fallback) {
+    // a part is: part headers, blank line, status line, response headers, blank line, body
+    size_t sep = part.find("\r\n\r\n");
+    if (sep == std::string::npos) return -1;
+    std::string part_header = part.substr(0, sep);
+    std::string response = part.substr(sep + 4);
+
+    size_t index = fallback;
+    size_t id_pos = part_header.find("response-item");
+    if (id_pos != std::string::npos) {
+        index = atol(part_header.c_str() + id_pos + 13);
+    }
+    if (index < begin || index >= end) {
+        CLOG_WARN("Batch response part %d doesn't belong to this batch\n", (int)index);
+        return -1;
+    }
+
+    sep = response.find("\r\n\r\n");
+    std::string head = sep == std::string::npos ? response : response.substr(0, sep);
+    std::string body = sep == std::string::npos ? "" : response.substr(sep + 4);
+    // drop the line break in front of the next boundary
+    if (body.size() >= 2 && body.compare(body.size() - 2, 2, "\r\n") == 0) {
+        body.erase(body.size() - 2);
+    }
+
+    int status = 0;
+    std::stringstream ssin(head);
+    std::string version;
+    ssin >> version >> status;
+
+    HttpResponse& resp = _requests[index]->_resp;
+    resp.clear();
+    resp._header = head;
+    resp._content = body;
+    resp.set_status(status);
+    // the batch as a whole already counted as a success
+    if (RateLimiter::is_rate_limited(resp)) {
+        _cred->rate_limiter().update(RateLimiter::classify(_uri, _method), resp);
+    }
+    return index;
+}
+
+}
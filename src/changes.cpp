@@ -9,7 +9,9 @@ namespace GDRIVE {
 
 ChangeService ChangeService::_single_instance;
 
-ChangeService::ChangeService() {
+ChangeService::ChangeService()
+    :_dedup(NULL)
+{
 #ifdef GDRIVE_DEBUG
     CLASS_INIT_LOGGER("FileService", L_DEBUG)
 #endif
@@ -37,6 +39,9 @@ std::vector<GChange> ChangeService::Listall() {
         list.clear();
         const std::vector<GChange>& tmp = changelist.get_items();
         changes.insert(changes.end(), tmp.begin(), tmp.end());
+        if (_dedup != NULL) {
+            _dedup->apply(tmp);
+        }
         std::string pageToken = changelist.get_nextPageToken();
         if (pageToken == "") {
             break;
@@ -0,0 +1,123 @@
+#include "gdrive/connpool.hpp"
+
+namespace GDRIVE {
+
+ConnectionPool ConnectionPool::_single_instance;
+
+ConnectionPool::ConnectionPool()
+    :_max_idle_per_host(POOL_MAX_IDLE_PER_HOST), _max_idle_seconds(POOL_MAX_IDLE_SECONDS)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("ConnectionPool", L_DEBUG)
+#endif
+}
+
+ConnectionPool::~ConnectionPool() {
+    clear();
+}
+
+std::string ConnectionPool::host_of(std::string uri) {
+    size_t start = uri.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    size_t end = uri.find_first_of("/?#", start);
+    if (end == std::string::npos) {
+        return uri;
+    }
+    return uri.substr(0, end);
+}
+
+CURL* ConnectionPool::acquire(std::string host) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _evict_expired(time(NULL));
+    _stats.requests ++;
+
+    std::vector<IdleHandle>& idle = _idle[host];
+    if (idle.size() != 0) {
+        // most recently used handle first, its connection is the warmest
+        CURL* handle = idle.back().handle;
+        idle.pop_back();
+        _stats.hits ++;
+        _stats.idle --;
+        curl_easy_reset(handle);
+        return handle;
+    }
+    _stats.misses ++;
+    CLOG_DEBUG("No idle handle for %s, creating one\n", host.c_str());
+    return curl_easy_init();
+}
+
+void ConnectionPool::release(std::string host, CURL* handle) {
+    if (handle == NULL) return;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<IdleHandle>& idle = _idle[host];
+    if ((int)idle.size() >= _max_idle_per_host) {
+        curl_easy_cleanup(handle);
+        return;
+    }
+    IdleHandle ih;
+    ih.handle = handle;
+    ih.since = time(NULL);
+    idle.push_back(ih);
+    _stats.idle ++;
+}
+
+void ConnectionPool::record_transfer(CURL* handle) {
+    long num_connects = 0;
+    if (curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &num_connects) != CURLE_OK) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats.connects += num_connects;
+    if (num_connects == 0) {
+        _stats.handshakes_avoided ++;
+    }
+}
+
+void ConnectionPool::set_max_idle_per_host(int max_idle) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_idle_per_host = max_idle < 0 ? 0 : max_idle;
+}
+
+void ConnectionPool::set_max_idle_seconds(long seconds) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_idle_seconds = seconds;
+}
+
+ConnectionPoolStats ConnectionPool::stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+void ConnectionPool::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (std::map<std::string, std::vector<IdleHandle> >::iterator iter = _idle.begin();
+            iter != _idle.end(); iter ++) {
+        for (size_t i = 0; i < iter->second.size(); i ++) {
+            curl_easy_cleanup(iter->second[i].handle);
+        }
+    }
+    _idle.clear();
+    _stats.idle = 0;
+}
+
+void ConnectionPool::_evict_expired(time_t now) {
+    for (std::map<std::string, std::vector<IdleHandle> >::iterator iter = _idle.begin();
+            iter != _idle.end(); iter ++) {
+        std::vector<IdleHandle>& idle = iter->second;
+        // handles are pushed in release order, so the stale ones sit in front
+        size_t expired = 0;
+        while (expired < idle.size() && now - idle[expired].since > _max_idle_seconds) {
+            curl_easy_cleanup(idle[expired].handle);
+            expired ++;
+        }
+        if (expired != 0) {
+            idle.erase(idle.begin(), idle.begin() + expired);
+            _stats.idle_evictions += expired;
+            _stats.idle -= expired;
+        }
+    }
+}
+
+}
@@ -1,12 +1,17 @@
 #include "gdrive/credential.hpp"
+#include "gdrive/asyncengine.hpp"
+#include "gdrive/error.hpp"
 #include "jconer/json.hpp"
 
+#include <algorithm>
+#include <chrono>
+
 using namespace JCONER;
 
 namespace GDRIVE {
 
 Credential::Credential(Store* store)
-    :_store(store)
+    :_token_url(TOKEN_URL), _refresh_margin(CREDENTIAL_REFRESH_MARGIN), _store(store), _refreshing(false), _refresh_failed(false), _refreshes(0)
 {
 #ifdef GDRIVE_DEBUG
     CLASS_INIT_LOGGER("Credential", L_DEBUG);
@@ -26,15 +31,23 @@ Credential::Credential(Store* store)
         _refresh_token = _store->get("refresh_token");
         _id_token = _store->get("id_token");
     }
-    _token_expiry = 0;
+    _token_expiry = _store->get("token_expiry") == "" ? 0 : (long)SizeHelper::stoll(_store->get("token_expiry"));
+}
+
+Credential::~Credential() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _refreshed.wait(lock, [this]() { return !_refreshing; });
 }
 
 void Credential::refresh(std::string at, std::string rt, long te, std::string it) {
-    _access_token = at;
-    _refresh_token = rt;
-    _token_expiry = te;
-    _id_token = it;
-    _invalid = false;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _access_token = at;
+        _refresh_token = rt;
+        _token_expiry = te;
+        _id_token = it;
+        _invalid = false;
+    }
     dump();
 }
 
@@ -43,95 +56,352 @@ void Credential::dump() {
         CLOG_WARN("This is no store to save tokens\n");
         return;
     }
-    _store->put("access_token", _access_token);
-    _store->put("client_id", _client_id);
-    _store->put("client_secret", _client_secret);
-    _store->put("refresh_token", _refresh_token);
-    _store->put("id_token", _id_token);
-    _store->dump(); 
+    // the snapshot is taken under the store lock, so a later dump never writes older tokens
+    std::lock_guard<std::mutex> store_lock(_store_mutex);
+    std::string access_token, client_id, client_secret, refresh_token, id_token;
+    long token_expiry;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        access_token = _access_token;
+        client_id = _client_id;
+        client_secret = _client_secret;
+        refresh_token = _refresh_token;
+        id_token = _id_token;
+        token_expiry = _token_expiry;
+    }
+    _store->put("access_token", access_token);
+    _store->put("client_id", client_id);
+    _store->put("client_secret", client_secret);
+    _store->put("refresh_token", refresh_token);
+    _store->put("id_token", id_token);
+    _store->put("token_expiry", SizeHelper::itos(token_expiry));
+    // refreshes happen on the request path, the store is written in the background
+    _store->dump_async();
+}
+
+bool Credential::flush() {
+    if (_store == NULL) {
+        return true;
+    }
+    return _store->flush();
+}
+
+std::string Credential::access_token() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _access_token;
+}
+
+void Credential::set_token_url(std::string url) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _token_url = url;
+}
+
+long Credential::refresh_count() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _refreshes;
+}
+
+long Credential::token_expiry() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _token_expiry;
+}
+
+void Credential::set_refresh_margin(long seconds) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _refresh_margin = seconds < 0 ? 0 : seconds;
 }
 
 CredentialHttpRequest::CredentialHttpRequest(Credential* cred, std::string uri, RequestMethod method)
-    :HttpRequest(uri, method), _cred(cred)
+    :HttpRequest(uri, method), _cred(cred), _rate_cost(1)
 {
 }
 
+void CredentialHttpRequest::_transfer() {
+    RateClass cls = RateLimiter::classify(_uri, _method);
+    _cred->_limiter.acquire(cls, _rate_cost);
+    HttpRequest::_transfer();
+    _cred->_limiter.update(cls, _resp, _rate_cost);
+}
+
+void CredentialHttpRequest::_transfer_async(RequestCallback callback, double delay) {
+    RateClass cls = RateLimiter::classify(_uri, _method);
+    // a throttled request waits in the engine, the thread that submits it goes on;
+    // the limiter's wait and a retry wait run side by side
+    double wait = _cred->_limiter.reserve(cls, _rate_cost);
+    _submit([this, cls, callback](std::exception_ptr error) {
+        if (!error) {
+            _cred->_limiter.update(cls, _resp, _rate_cost);
+        }
+        callback(error);
+    }, wait > delay ? wait : delay);
+}
+
 void CredentialHttpRequest::_apply_header() {
-    add_header("Authorization", "Bearer " + _cred->_access_token);
+    _token = _cred->access_token();
+    add_header("Authorization", "Bearer " + _token);
     add_header("user-agent", USER_AGENT);
 }
 
-std::string CredentialHttpRequest::_generate_request_body() {
+std::string Credential::_token_request_body() {
     std::map<std::string, std::string> body;
     body["grant_type"] = "refresh_token";
-    body["client_id"] = _cred->_client_id;
-    body["client_secret"] = _cred->_client_secret;
-    body["refresh_token"] = _cred->_refresh_token;
+    body["client_id"] = _client_id;
+    body["client_secret"] = _client_secret;
+    body["refresh_token"] = _refresh_token;
     return URLHelper::encode(body);
 }
 
-RequestHeader CredentialHttpRequest::_generate_request_header() {
+RequestHeader Credential::_token_request_header() {
     RequestHeader header;
     header["User-Agent"] = USER_AGENT;
     header["Content-Type"] = "application/x-www-form-urlencoded";
     return header;
 }
 
-void CredentialHttpRequest::_parse_response(std::string content) {
+HttpRequest* Credential::_start_refresh(CancellationToken* cancel, double deadline) {
+    _refreshing = true;
+    _refreshes ++;
+    RequestHeader header = _token_request_header();
+    HttpRequest* request = new HttpRequest(_token_url, RM_POST, header, _token_request_body());
+    request->set_cancellation_token(cancel);
+    request->set_deadline(deadline);
+    return request;
+}
+
+void Credential::_parse_response(std::string content) {
     PError perr;
     JObject* rst = (JObject*)loads(content, perr);
     if (rst != NULL){
+        std::lock_guard<std::mutex> lock(_mutex);
         if (rst->contain("access_token")) {
-            _cred->_access_token = ((JString*)rst->get("access_token"))->getValue();
+            _access_token = ((JString*)rst->get("access_token"))->getValue();
         }
         if (rst->contain("refresh_token")) {
-            _cred->_refresh_token = ((JString*)rst->get("refresh_token"))->getValue();
+            _refresh_token = ((JString*)rst->get("refresh_token"))->getValue();
         }
-        if (rst->contain("expire_in")) {
-            long expire_in = ((JInt*)rst->get("expire_in"))->getValue();
-            _cred->_token_expiry = (long)time(NULL) + expire_in;
+        if (rst->contain("expires_in")) {
+            long expires_in = ((JInt*)rst->get("expires_in"))->getValue();
+            _token_expiry = (long)time(NULL) + expires_in;
         } else {
-            _cred->_token_expiry = 0;
+            _token_expiry = 0;
         }
         delete rst;
     }
-    _cred->dump();
+    dump();
 }
 
-void CredentialHttpRequest::_refresh() {
-    RequestHeader header = _generate_request_header(); 
-    std::string body = _generate_request_body(); 
-    
-    HttpRequest request(TOKEN_URL, RM_POST, header, body);
-    HttpResponse resp = request.request();
+std::exception_ptr Credential::_exchange(HttpRequest* request) {
+    std::exception_ptr error;
+    try {
+        request->request();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    _exchanged(request->response(), error);
+    delete request;
+    return error;
+}
 
-    if (resp.status() == 200) {
+void Credential::_exchange_async(HttpRequest* request, RequestCallback next) {
+    request->request_async([this, request, next](std::exception_ptr error) {
+        _exchanged(request->response(), error);
+        delete request;
+        next(error);
+    });
+}
+
+void Credential::_exchanged(HttpResponse& resp, std::exception_ptr error) {
+    bool ok = false;
+    if (error) {
+        CLOG_ERROR("Refreshing the access token failed\n");
+    } else if (resp.status() == 200) {
         _parse_response(resp.content());
+        ok = true;
     } else {
         CLOG_ERROR("error_msg:%s\n", resp.content().c_str());
     }
+    _finish_refresh(ok);
+}
+
+void Credential::_finish_refresh(bool ok) {
+    // the waiting requests go on with whatever token there is now, a failed refresh included;
+    // notified under the lock, the credential may be gone as soon as it is released unless
+    // async requests wait for it
+    std::vector<std::function<void ()> > waiting;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _refreshing = false;
+        _refresh_failed = !ok;
+        waiting.swap(_waiting);
+        _refreshed.notify_all();
+    }
+    for (size_t i = 0; i < waiting.size(); i ++) {
+        waiting[i]();
+    }
 }
 
-HttpResponse CredentialHttpRequest::request() {
+void CredentialHttpRequest::_refresh() {
+    _check_continue();
+    std::unique_lock<std::mutex> lock(_cred->_mutex);
+    if (_cred->_access_token != _token) {
+        // another request got a new token after this one was sent
+        return;
+    }
+    if (_cred->_refreshing) {
+        if (AsyncEngine::on_io_thread()) {
+            // the running refresh may be an async one this very thread has to finish;
+            // the request goes on with the token it has
+            CLOG_WARN("Blocking request on an I/O thread doesn't wait for the running refresh\n");
+            return;
+        }
+        if (_deadline_at <= 0) {
+            _cred->_refreshed.wait(lock, [this]() { return !_cred->_refreshing; });
+        } else if (!_cred->_refreshed.wait_for(lock, std::chrono::duration<double>(_deadline_at - _now()),
+                                               [this]() { return !_cred->_refreshing; })) {
+            throw TimeoutException("Request deadline exceeded");
+        }
+        return;
+    }
+    // the exchange is part of this request, it has what is left of its deadline and its token
+    HttpRequest* request = _cred->_start_refresh(_cancel, _deadline_at > 0 ? std::max(_deadline_at - _now(), 0.001) : 0);
+    lock.unlock();
+
+    std::exception_ptr error = _cred->_exchange(request);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void CredentialHttpRequest::_refresh_async(RequestCallback next) {
+    try {
+        _check_continue();
+    } catch (...) {
+        next(std::current_exception());
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_cred->_mutex);
+    if (_cred->_access_token != _token) {
+        lock.unlock();
+        next(std::exception_ptr());
+        return;
+    }
+    if (_cred->_refreshing) {
+        _cred->_waiting.push_back([next]() {
+            next(std::exception_ptr());
+        });
+        return;
+    }
+    HttpRequest* request = _cred->_start_refresh(_cancel, _deadline_at > 0 ? std::max(_deadline_at - _now(), 0.001) : 0);
+    lock.unlock();
+
+    _cred->_exchange_async(request, next);
+}
+
+bool CredentialHttpRequest::_refresh_ahead() {
+    std::unique_lock<std::mutex> lock(_cred->_mutex);
+    if (_cred->_token_expiry == 0 || _cred->_refresh_margin == 0 || _cred->_access_token == "") {
+        return false;
+    }
+    long left = _cred->_token_expiry - (long)time(NULL);
+    if (left <= 0) {
+        // nothing refreshed it in time, the request would only get a 401
+        CLOG_INFO("Access token expired, refreshing\n");
+        _token = _cred->_access_token;
+        return true;
+    }
+    if (left > _cred->_refresh_margin || _cred->_refreshing) {
+        return false;
+    }
+    if (_cred->_refresh_failed) {
+        // another background try could fail the same way until the token expires
+        CLOG_INFO("Refreshing ahead failed, refreshing before the request goes out\n");
+        _token = _cred->_access_token;
+        return true;
+    }
+
+    CLOG_DEBUG("Access token expires in %lds, refreshing in the background\n", left);
+    // no request waits for it, so it has neither a deadline nor a token of theirs
+    HttpRequest* request = _cred->_start_refresh(NULL, 0);
+    lock.unlock();
+
+    // on the engine, the old token stays good until it expires and requests go on with it meanwhile
+    _cred->_exchange_async(request, [](std::exception_ptr) {});
+    return false;
+}
+
+HttpResponse& CredentialHttpRequest::request() {
     if (_cred->_invalid == true) {
         CLOG_FATAL("Credential is invalid\n");
     }
-    if (_cred->_access_token == ""){
+    // the refresh and the resend after a 401 count against the deadline of this call
+    _start_clock();
+    if (_cred->access_token() == ""){
         CLOG_INFO("Attempting refresh to obtain initial access_token\n");
+        _token = "";
+        _refresh();
+    } else if (_refresh_ahead()) {
         _refresh();
     }
 
     _apply_header();
-    HttpRequest::request();
+    _perform();
 
     if (_resp.status() == 401) {
         CLOG_INFO("Need to refresh\n");
         _resp.clear();
         _refresh();
         _apply_header();
-        HttpRequest::request();
+        _perform();
     }
     return _resp;
 }
 
+void CredentialHttpRequest::request_async(RequestCallback callback) {
+    if (_cred->_invalid == true) {
+        CLOG_FATAL("Credential is invalid\n");
+    }
+    _start_clock();
+    bool stale = false;
+    if (_cred->access_token() == ""){
+        CLOG_INFO("Attempting refresh to obtain initial access_token\n");
+        _token = "";
+        stale = true;
+    } else {
+        stale = _refresh_ahead();
+    }
+    if (!stale) {
+        _send_async(callback);
+        return;
+    }
+    // the request goes out once there is a token, no thread waits for it meanwhile
+    _refresh_async([this, callback](std::exception_ptr error) {
+        if (error) {
+            callback(error);
+            return;
+        }
+        _send_async(callback);
+    });
+}
+
+void CredentialHttpRequest::_send_async(RequestCallback callback) {
+    _apply_header();
+    _perform_async([this, callback](std::exception_ptr error) {
+        if (error || _resp.status() != 401) {
+            callback(error);
+            return;
+        }
+        // the refresh and the resend are continuations too, the I/O thread goes on meanwhile
+        CLOG_INFO("Need to refresh\n");
+        _resp.clear();
+        _refresh_async([this, callback](std::exception_ptr error) {
+            if (error) {
+                callback(error);
+                return;
+            }
+            _apply_header();
+            _perform_async(callback);
+        });
+    });
+}
+
 }
@@ -0,0 +1,151 @@
+#include "gdrive/dedup.hpp"
+
+#include <fstream>
+#include <sstream>
+
+namespace GDRIVE {
+
+DedupIndex::DedupIndex(std::string path)
+    :_path(path), _change_id(0)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("DedupIndex", L_DEBUG)
+#endif
+    std::ifstream fin(_path.c_str());
+    if (!fin.good()) {
+        return;
+    }
+
+    std::string line;
+    while (getline(fin, line)) {
+        if (line.compare(0, 7, "change=") == 0) {
+            _change_id = SizeHelper::stoll(line.substr(7));
+            continue;
+        }
+        std::istringstream entry(line);
+        std::string md5, id;
+        long long size;
+        // a torn last line from a crash is simply dropped
+        if (entry >> md5 >> size >> id) {
+            _add(_key(md5, size), id);
+        }
+    }
+    CLOG_DEBUG("Loaded %zu entries from %s\n", _keys.size(), _path.c_str());
+}
+
+std::string DedupIndex::_key(std::string md5, long long size) {
+    return md5 + " " + SizeHelper::itos(size);
+}
+
+void DedupIndex::_add(std::string key, std::string id) {
+    // a list fed in again mustn't move the source of any content
+    std::map<std::string, std::string>::iterator iter = _keys.find(id);
+    if (iter != _keys.end() && iter->second == key) return;
+    _remove(id);
+    _keys[id] = key;
+    _files[key].insert(id);
+    // the first file seen with some content stays its source
+    if (_ids.find(key) == _ids.end()) {
+        _ids[key] = id;
+    }
+}
+
+void DedupIndex::_remove(std::string id) {
+    std::map<std::string, std::string>::iterator iter = _keys.find(id);
+    if (iter == _keys.end()) return;
+    std::string key = iter->second;
+    _keys.erase(iter);
+    std::map<std::string, std::set<std::string> >::iterator files = _files.find(key);
+    files->second.erase(id);
+    if (_ids[key] != id) return;
+    if (files->second.empty()) {
+        _files.erase(files);
+        _ids.erase(key);
+    } else {
+        // another file with the same content takes over
+        _ids[key] = *files->second.begin();
+    }
+}
+
+void DedupIndex::add(const GFile& file) {
+    GFile& f = const_cast<GFile&>(file);
+    // folders and Google documents have no md5Checksum, trashed files aren't worth copying
+    if (f.get_id() == "" || f.get_md5Checksum() == "" || f.get_labels().trashed) {
+        if (f.get_id() != "") remove(f.get_id());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _add(_key(f.get_md5Checksum(), f.get_fileSize()), f.get_id());
+}
+
+void DedupIndex::add(const std::vector<GFile>& files) {
+    for (size_t i = 0; i < files.size(); i ++) {
+        add(files[i]);
+    }
+}
+
+void DedupIndex::apply(const GChange& change) {
+    GChange& c = const_cast<GChange&>(change);
+    if (c.get_deleted()) {
+        remove(c.get_fileId());
+    } else {
+        add(c.get_file());
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    long long id = SizeHelper::stoll(c.get_id());
+    if (id > _change_id) {
+        _change_id = id;
+    }
+}
+
+void DedupIndex::apply(const std::vector<GChange>& changes) {
+    for (size_t i = 0; i < changes.size(); i ++) {
+        apply(changes[i]);
+    }
+}
+
+void DedupIndex::remove(std::string id) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _remove(id);
+}
+
+std::string DedupIndex::find(std::string md5, long long size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::map<std::string, std::string>::iterator iter = _ids.find(_key(md5, size));
+    return iter == _ids.end() ? "" : iter->second;
+}
+
+bool DedupIndex::contains(std::string id, std::string md5, long long size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::map<std::string, std::string>::iterator iter = _keys.find(id);
+    return iter != _keys.end() && iter->second == _key(md5, size);
+}
+
+long long DedupIndex::change_id() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _change_id;
+}
+
+size_t DedupIndex::size() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _keys.size();
+}
+
+bool DedupIndex::dump() {
+    VarString vs;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        vs.append("change=").append(SizeHelper::itos(_change_id)).append('\n');
+        for (std::map<std::string, std::string>::iterator iter = _keys.begin();
+                iter != _keys.end(); iter ++) {
+            vs.append(iter->second).append(' ').append(iter->first).append('\n');
+        }
+    }
+    if (!FileHelper::write_atomic(_path, vs.toString(), 0644)) {
+        CLOG_ERROR("Can't write the dedup index to %s\n", _path.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
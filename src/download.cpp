@@ -0,0 +1,390 @@
+#include "gdrive/download.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/sink.hpp"
+#include "gdrive/md5.hpp"
+
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CHECKSUM_BUFFER_SIZE 1024 * 1024
+
+namespace GDRIVE {
+
+static bool range_before(const ByteRange& a, const ByteRange& b) {
+    return a.start < b.start;
+}
+
+DownloadJournal::DownloadJournal(std::string path)
+    :_path(path), _fd(-1)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("DownloadJournal", L_DEBUG)
+#endif
+}
+
+DownloadJournal::~DownloadJournal() {
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+std::string DownloadJournal::_header(GFile& file) {
+    VarString vs;
+    vs.append("etag=").append(file.get_etag()).append('\n')
+      .append("md5Checksum=").append(file.get_md5Checksum()).append('\n')
+      .append("fileSize=").append(SizeHelper::itos(file.get_fileSize())).append('\n');
+    return vs.toString();
+}
+
+bool DownloadJournal::load(GFile& file) {
+    _completed.clear();
+    std::ifstream fin(_path.c_str());
+    if (!fin.good()) {
+        return false;
+    }
+
+    std::string header, line;
+    while (getline(fin, line)) {
+        if (line.compare(0, 6, "range=") != 0) {
+            header += line + "\n";
+            continue;
+        }
+        long long start, end;
+        // a torn last line from a crash is simply not counted
+        if (sscanf(line.c_str() + 6, "%lld-%lld", &start, &end) == 2 && start <= end) {
+            _completed.push_back(ByteRange(start, end));
+        }
+    }
+    if (header != _header(file)) {
+        CLOG_INFO("Journal %s belongs to another version of %s, restarting\n",
+                  _path.c_str(), file.get_id().c_str());
+        _completed.clear();
+        return false;
+    }
+
+    _fd = open(_path.c_str(), O_WRONLY | O_APPEND);
+    if (_fd < 0) {
+        throw DownloadException("Can't open journal " + _path + ": " + strerror(errno));
+    }
+    return true;
+}
+
+void DownloadJournal::reset(GFile& file) {
+    _completed.clear();
+    if (_fd >= 0) {
+        close(_fd);
+    }
+    _fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (_fd < 0) {
+        throw DownloadException("Can't create journal " + _path + ": " + strerror(errno));
+    }
+    std::string header = _header(file);
+    if (write(_fd, header.data(), header.size()) != (ssize_t)header.size() || fdatasync(_fd) != 0) {
+        throw DownloadException("Can't write journal " + _path + ": " + strerror(errno));
+    }
+}
+
+void DownloadJournal::commit(ByteRange range) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::string line = "range=" + SizeHelper::itos(range.start) + "-" + SizeHelper::itos(range.end) + "\n";
+    // one small O_APPEND write per range, so concurrent commits never interleave
+    if (write(_fd, line.data(), line.size()) != (ssize_t)line.size() || fdatasync(_fd) != 0) {
+        // losing a journal entry only costs a refetch on resume
+        CLOG_WARN("Can't write journal %s: %s\n", _path.c_str(), strerror(errno));
+        return;
+    }
+    _completed.push_back(range);
+}
+
+void DownloadJournal::remove() {
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+    unlink(_path.c_str());
+    _completed.clear();
+}
+
+FileDownloadRequest::FileDownloadRequest(Credential* cred, std::string uri, int fd)
+    :_cred(cred), _uri(uri), _fd(fd), _parallelism(DOWNLOAD_PARALLELISM), _range_size(DOWNLOAD_RANGE_SIZE),
+     _max_retries(DOWNLOAD_MAX_RETRIES), _use_mmap(false), _verify_checksum(true), _cancel(NULL)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("FileDownloadRequest", L_DEBUG)
+#endif
+}
+
+FileDownloadRequest::FileDownloadRequest(Credential* cred, std::string uri, std::string path)
+    :_cred(cred), _uri(uri), _path(path), _journal_path(path + DOWNLOAD_JOURNAL_SUFFIX), _fd(-1),
+     _parallelism(DOWNLOAD_PARALLELISM), _range_size(DOWNLOAD_RANGE_SIZE),
+     _max_retries(DOWNLOAD_MAX_RETRIES), _use_mmap(false), _verify_checksum(true), _cancel(NULL)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("FileDownloadRequest", L_DEBUG)
+#endif
+}
+
+void FileDownloadRequest::set_parallelism(int n) {
+    _parallelism = n < 1 ? 1 : n;
+}
+
+void FileDownloadRequest::set_range_size(long long size) {
+    if (size <= 0) {
+        CLOG_WARN("Wrong range size[%lld], using %d\n", size, DOWNLOAD_RANGE_SIZE);
+        size = DOWNLOAD_RANGE_SIZE;
+    }
+    _range_size = size;
+}
+
+void FileDownloadRequest::set_max_retries(int retries) {
+    _max_retries = retries < 0 ? 0 : retries;
+}
+
+std::vector<ByteRange> FileDownloadRequest::_split(long long length, const std::vector<ByteRange>& completed) {
+    // the gaps between completed ranges are what is left to fetch
+    std::vector<ByteRange> done(completed);
+    std::sort(done.begin(), done.end(), range_before);
+    std::vector<ByteRange> missing;
+    long long pos = 0;
+    for (size_t i = 0; i < done.size() && pos < length; i ++) {
+        if (done[i].start > pos) {
+            missing.push_back(ByteRange(pos, std::min(done[i].start, length) - 1));
+        }
+        pos = std::max(pos, done[i].end + 1);
+    }
+    if (pos < length) {
+        missing.push_back(ByteRange(pos, length - 1));
+    }
+
+    std::vector<ByteRange> ranges;
+    for (size_t i = 0; i < missing.size(); i ++) {
+        for (long long start = missing[i].start; start <= missing[i].end; start += _range_size) {
+            long long end = start + _range_size - 1;
+            ranges.push_back(ByteRange(start, end < missing[i].end ? end : missing[i].end));
+        }
+    }
+    return ranges;
+}
+
+GFile FileDownloadRequest::execute() {
+    if (_path == "") {
+        return _execute();
+    }
+
+    _fd = open(_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) {
+        throw DownloadException("Can't open download target " + _path + ": " + strerror(errno));
+    }
+    try {
+        GFile file = _execute();
+        close(_fd);
+        _fd = -1;
+        return file;
+    } catch (...) {
+        close(_fd);
+        _fd = -1;
+        throw;
+    }
+}
+
+GFile FileDownloadRequest::_execute() {
+    FileGetRequest get(_cred, _uri);
+    get.set_cancellation_token(_cancel);
+    GFile file = get.execute();
+
+    std::string url = file.get_downloadUrl();
+    if (url == "") {
+        throw DownloadException("File " + file.get_id() + " has no downloadUrl");
+    }
+    long long length = file.get_fileSize();
+
+    DownloadState state;
+    DownloadJournal journal(_journal_path);
+    std::vector<ByteRange> completed;
+    if (_journal_path != "") {
+        if (journal.load(file)) {
+            completed = journal.completed();
+        } else {
+            journal.reset(file);
+        }
+        state.journal = &journal;
+    }
+
+    if (ftruncate(_fd, length) != 0) {
+        throw DownloadException(std::string("Can't resize download target: ") + strerror(errno));
+    }
+
+    if (_use_mmap && length > 0) {
+        void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (map == MAP_FAILED) {
+            CLOG_WARN("Can't map download target, falling back to pwrite: %s\n", strerror(errno));
+        } else {
+            state.map = (char*)map;
+        }
+    }
+
+    _ranges = _split(length, completed);
+    int workers = (int)_ranges.size() < _parallelism ? (int)_ranges.size() : _parallelism;
+    CLOG_DEBUG("Downloading %lld bytes in %d ranges with %d workers, %d ranges already done\n",
+               length, (int)_ranges.size(), workers, (int)completed.size());
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; i ++) {
+        threads.push_back(std::thread(&FileDownloadRequest::_worker, this, url, length, &state));
+    }
+    for (size_t i = 0; i < threads.size(); i ++) {
+        threads[i].join();
+    }
+
+    std::string checksum;
+    if (!state.error && _verify_checksum && file.get_md5Checksum() != "") {
+        checksum = _checksum(state.map, length);
+    }
+    if (state.map != NULL) {
+        munmap(state.map, length);
+    }
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+    // a corrupt result can't be fixed by resuming, so the journal goes either way
+    if (state.journal != NULL) {
+        journal.remove();
+    }
+    if (checksum != "" && checksum != file.get_md5Checksum()) {
+        throw IntegrityException(file.get_md5Checksum(), checksum);
+    }
+    return file;
+}
+
+void FileDownloadRequest::_worker(std::string url, long long length, DownloadState* state) {
+    while (true) {
+        size_t index;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->error || state->next >= _ranges.size()) return;
+            index = state->next ++;
+        }
+        try {
+            _download_range(_ranges[index], url, length, state);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (!state->error) {
+                state->error = std::current_exception();
+            }
+            return;
+        }
+    }
+}
+
+void FileDownloadRequest::_download_range(ByteRange range, std::string url, long long length, DownloadState* state) {
+    char* map = state->map;
+    long long pos = range.start;
+    int attempt = 0;
+    while (true) {
+        long long begin = pos;
+        CredentialHttpRequest request(_cred, url, RM_GET);
+        // a retry has to continue from what the sink already has, that's done here
+        request.set_retry_policy(NULL);
+        request.set_cancellation_token(_cancel);
+        request.add_header("Range", "bytes=" + SizeHelper::itos(pos) + "-" + SizeHelper::itos(range.end));
+        FdSink fd_sink(_fd, pos, range.end - pos + 1);
+        MmapSink mmap_sink(map == NULL ? NULL : map + pos, range.end - pos + 1);
+        // 200 means the range was ignored, that's only fine if we asked for the whole file;
+        // otherwise the body starts at byte 0 and must not reach the sink at pos
+        bool whole = pos == 0 && range.end == length - 1;
+        long sink_status = whole ? 0 : 206;
+        if (map != NULL) {
+            request.set_response_sink(MmapSink::write, &mmap_sink, sink_status);
+        } else {
+            request.set_response_sink(FdSink::write, &fd_sink, sink_status);
+        }
+
+        std::string failure;
+        try {
+            request.request();
+            int status = request.response().status();
+            if (status == 206 || (status == 200 && whole)) {
+                // keep whatever arrived, a short body is continued from there
+                pos += map != NULL ? mmap_sink.written() : fd_sink.written();
+                if (state->journal != NULL && pos > begin) {
+                    _sync(begin, pos - 1, map);
+                    state->journal->commit(ByteRange(begin, pos - 1));
+                }
+                if (pos > range.end) return;
+                failure = "short body";
+            } else if (status >= 200 && status < 300) {
+                throw DownloadException("Range " + SizeHelper::itos(range.start) + "-" + SizeHelper::itos(range.end)
+                                        + " failed: the server ignored the Range header (status "
+                                        + VarString::itos(status) + ")");
+            } else if (status >= 500 || status == 429) {
+                failure = "status " + VarString::itos(status);
+            } else {
+                GoogleJsonResponseException exc = make_json_exception(request.response().content());
+                throw exc;
+            }
+        } catch (CancelledException& e) {
+            throw;
+        } catch (CurlException& e) {
+            pos += map != NULL ? mmap_sink.written() : fd_sink.written();
+            if (state->journal != NULL && pos > begin) {
+                _sync(begin, pos - 1, map);
+                state->journal->commit(ByteRange(begin, pos - 1));
+            }
+            // the whole range may have arrived before the connection failed
+            if (pos > range.end) return;
+            failure = e.error();
+        }
+
+        if (++ attempt > _max_retries) {
+            throw DownloadException("Range " + SizeHelper::itos(range.start) + "-" + SizeHelper::itos(range.end)
+                                    + " failed: " + failure);
+        }
+        CLOG_WARN("Retrying range %lld-%lld from %lld: %s\n", range.start, range.end, pos, failure.c_str());
+    }
+}
+
+// Bytes have to be on disk before the journal says so, otherwise a crash
+// could leave a hole that resume believes is already filled.
+void FileDownloadRequest::_sync(long long start, long long end, char* map) {
+    int rst;
+    if (map != NULL) {
+        long long page = sysconf(_SC_PAGESIZE);
+        long long aligned = start - start % page;
+        rst = msync(map + aligned, end - aligned + 1, MS_SYNC);
+    } else {
+        rst = fdatasync(_fd);
+    }
+    if (rst != 0) {
+        throw DownloadException(std::string("Can't sync download target: ") + strerror(errno));
+    }
+}
+
+std::string FileDownloadRequest::_checksum(char* map, long long length) {
+    MD5 md5;
+    if (map != NULL) {
+        md5.update(map, length);
+        return md5.hexdigest();
+    }
+
+    std::vector<char> buffer(CHECKSUM_BUFFER_SIZE);
+    long long pos = 0;
+    while (pos < length) {
+        ssize_t n = pread(_fd, &buffer[0], buffer.size(), pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw DownloadException(std::string("Can't read back download target: ") + strerror(errno));
+        }
+        md5.update(&buffer[0], n);
+        pos += n;
+    }
+    return md5.hexdigest();
+}
+
+}
@@ -50,4 +50,9 @@ CommentService& Drive::comments() {
     return CommentService::get_instance(_cred);
 }
 
+BatchRequest Drive::batch() {
+    BatchRequest batch(_cred);
+    return batch;
+}
+
 }
@@ -1,52 +1,92 @@
 #include "gdrive/filecontent.hpp"
+#include "gdrive/error.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <vector>
+#include <algorithm>
+
+#define CHECKSUM_BUFFER_SIZE 1024 * 1024
 
 namespace GDRIVE  {
 
-int FileContent::get_length() {
+long long FileContent::get_length() {
     if (_length == -1) {
-        long cur_pos = _fin.tellg();
-        _fin.seekg(0, std::ios::end);
-        _length = _fin.tellg();
-        _fin.seekg(cur_pos, std::ios::beg);
+        std::streamoff cur_pos = _fin->tellg();
+        _fin->seekg(0, std::ios::end);
+        _length = (std::streamoff)_fin->tellg();
+        _fin->seekg(cur_pos, std::ios::beg);
     }
     return _length;
 }
 
-int FileContent::_getRemainingLength() {
-    long cur_pos = _fin.tellg();
-    return get_length() - cur_pos;
+long long FileContent::_getRemainingLength() {
+    return get_length() - _tell();
+}
+
+size_t FileContent::_read(char* buffer, size_t length) {
+    _fin->read(buffer, length);
+    return _fin->gcount();
+}
+
+long long FileContent::read_next(char* buffer, long long length) {
+    return _read(buffer, length);
+}
+
+void FileContent::_seek(long long pos) {
+    _fin->clear();
+    _fin->seekg(pos, std::ios::beg);
+}
+
+long long FileContent::_tell() {
+    return (std::streamoff)_fin->tellg();
 }
 
 std::string FileContent::get_content() {
-    long cur_pos = _fin.tellg();
-    int filesize = get_length();
+    std::streamoff cur_pos = _fin->tellg();
+    long long filesize = get_length();
     if (filesize < 0) {
-        CLOG_FATAL("File size is less than 0: [%d]\n", filesize);
+        CLOG_FATAL("File size is less than 0: [%lld]\n", filesize);
     }
     char* buffer = new char[filesize];
-    _fin.seekg(0, std::ios::beg);
-    _fin.read(buffer, filesize);
+    _fin->seekg(0, std::ios::beg);
+    _fin->read(buffer, filesize);
     std::string rst(buffer, filesize);
     delete [] buffer;
-    _fin.seekg(cur_pos, std::ios::beg);
+    _fin->seekg(cur_pos, std::ios::beg);
     return rst;
 }
 
+long long FileContent::read_at(long long pos, char* buffer, long long length) {
+    _fin->clear();
+    _fin->seekg(pos, std::ios::beg);
+    _fin->read(buffer, length);
+    long long n = _fin->gcount();
+    _fin->clear();
+    return n;
+}
+
 size_t FileContent::read(void* ptr, size_t size, size_t nmemb, void* userp) {
     FUNC_MAKE_LOGGER
     FUNC_LOGGER_SET_LEVEL(COMMON::L_DEBUG);
 
     FileContent* fc = (FileContent*)userp;
 
-    int remaining_length = fc->_getRemainingLength();
+    long long remaining_length = fc->_getRemainingLength();
     if (remaining_length == 0) {
-        fc->_fin.seekg(0, std::ios::beg);
+        fc->_seek(0);
         return 0;
     }
 
-    int length = size * nmemb > remaining_length ? remaining_length : size * nmemb;
-    fc->_fin.read((char*)ptr, length);
-    FLOG_DEBUG("Read %d from filecontent\n", length);
+    size_t length = (long long)(size * nmemb) > remaining_length ? remaining_length : size * nmemb;
+    long long pos = fc->_tell();
+    length = fc->_read((char*)ptr, length);
+    fc->digest(pos, (char*)ptr, length);
+    FLOG_DEBUG("Read %zu from filecontent\n", length);
     return length;
 }
 
@@ -56,31 +96,247 @@ size_t FileContent::resumable_read(void *ptr, size_t size, size_t nmemb, void* u
 
     FileContent* fc = (FileContent*)userp;
 
-    int remaining = fc->_resumable_length - (fc->_resumable_cur_pos - fc->_resumable_start_pos);
+    long long remaining = fc->_resumable_length - (fc->_resumable_cur_pos - fc->_resumable_start_pos);
     if (remaining == 0) {
         return 0;
     }
 
-    int length = size * nmemb > remaining ? remaining : size * nmemb;
-    fc->_fin.read((char*)ptr, length);
-    FLOG_DEBUG("Read %d from filecontent\n", length);
+    size_t length = (long long)(size * nmemb) > remaining ? remaining : size * nmemb;
+    length = fc->_read((char*)ptr, length);
+    fc->digest(fc->_resumable_cur_pos, (char*)ptr, length);
+    FLOG_DEBUG("Read %zu from filecontent\n", length);
     fc->_resumable_cur_pos += length;
     return length;
 }
 
-void FileContent::set_resumable_start_pos(int pos) {
+void FileContent::digest(long long pos, const char* data, long long length) {
+    if (pos > _digested) {
+        // a gap can't be filled in later, md5() stays empty
+        CLOG_DEBUG("Can't digest %lld bytes at %lld, only %lld digested\n", length, pos, _digested);
+        return;
+    }
+    long long skip = _digested - pos;
+    if (skip >= length) return;
+    _md5.update(data + skip, length - skip);
+    _digested += length - skip;
+}
+
+void FileContent::reset_digest() {
+    _md5.reset();
+    _digested = 0;
+}
+
+std::string FileContent::md5() {
+    long long length = get_length();
+    if (length >= 0 && _digested < length && data() != NULL) {
+        // curl may finish a mapped upload without reporting the last bytes
+        digest(_digested, data() + _digested, length - _digested);
+    }
+    if (length >= 0 && _digested != length) {
+        return "";
+    }
+    return _md5.hexdigest();
+}
+
+std::string FileContent::compute_md5() {
+    if (!seekable()) {
+        return "";
+    }
+    reset_digest();
+    digest_to(get_length());
+    return md5();
+}
+
+void FileContent::digest_to(long long end) {
+    if (!seekable() || _digested >= end) {
+        return;
+    }
+    if (data() != NULL) {
+        digest(_digested, data() + _digested, end - _digested);
+        return;
+    }
+    // the sequential readers carry on from where they were
+    long long cur_pos = _tell();
+    std::vector<char> buffer(CHECKSUM_BUFFER_SIZE);
+    for (long long pos = _digested; pos < end; ) {
+        long long n = read_at(pos, &buffer[0], std::min((long long)buffer.size(), end - pos));
+        if (n <= 0) break;
+        digest(pos, &buffer[0], n);
+        pos += n;
+    }
+    _seek(cur_pos);
+}
+
+void FileContent::set_resumable_start_pos(long long pos) {
     if (pos < 0 || pos > get_length()) {
-        CLOG_FATAL("Error start pos for resumable: %d\n", pos);
+        CLOG_FATAL("Error start pos for resumable: %lld\n", pos);
     }
-    _resumable_start_pos = pos;
-    _fin.seekg(pos, std::ios::beg);
+    _resumable_start_pos = _resumable_cur_pos = pos;
+    _seek(pos);
 }
 
-void FileContent::set_resumable_length(int length) {
+void FileContent::set_resumable_length(long long length) {
     if (length <= 0 || length + _resumable_start_pos > get_length()) {
-        CLOG_FATAL("Error length for resumable: %d\n", length);
+        CLOG_FATAL("Error length for resumable: %lld\n", length);
     }
     _resumable_length = length;
 }
 
+MmapFileContent::MmapFileContent(std::string path, std::string mimetype)
+    :FileContent(mimetype), _map(NULL), _pos(0), _released(0)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("MmapFileContent", COMMON::L_DEBUG)
+#endif
+    _fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (_fd < 0 || fstat(_fd, &st) != 0) {
+        std::string error = strerror(errno);
+        if (_fd >= 0) close(_fd);
+        throw UploadException("Can't open " + path + ": " + error);
+    }
+    _length = st.st_size;
+    if (_length == 0) {
+        return;
+    }
+
+    void* map = mmap(NULL, _length, PROT_READ, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        CLOG_WARN("Can't map %s, falling back to reads: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    _map = (char*)map;
+    madvise(_map, _length, MADV_SEQUENTIAL);
+}
+
+MmapFileContent::~MmapFileContent() {
+    if (_map != NULL) {
+        munmap(_map, _length);
+    }
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+std::string MmapFileContent::get_content() {
+    if (_map != NULL) {
+        return std::string(_map, _length);
+    }
+    std::string rst(_length, '\0');
+    long long n = _length > 0 ? read_at(0, &rst[0], _length) : 0;
+    rst.resize(n);
+    return rst;
+}
+
+long long MmapFileContent::read_at(long long pos, char* buffer, long long length) {
+    if (pos >= _length) return 0;
+    if (length > _length - pos) length = _length - pos;
+    if (_map != NULL) {
+        memcpy(buffer, _map + pos, length);
+        return length;
+    }
+
+    long long done = 0;
+    while (done < length) {
+        ssize_t n = pread(_fd, buffer + done, length - done, pos + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+void MmapFileContent::release(long long pos) {
+    if (_map == NULL) return;
+    long long page = sysconf(_SC_PAGESIZE);
+    long long end = pos / page * page;
+    if (end <= _released) return;
+    // the pages come back from the file if they are ever touched again
+    madvise(_map + _released, end - _released, MADV_DONTNEED);
+    _released = end;
+}
+
+size_t MmapFileContent::_read(char* buffer, size_t length) {
+    long long n = read_at(_pos, buffer, length);
+    _pos += n;
+    return n;
+}
+
+void MmapFileContent::_seek(long long pos) {
+    _pos = pos;
+    if (pos < _released) {
+        _released = pos / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+    }
+}
+
+long long MmapFileContent::_tell() {
+    return _pos;
+}
+
+StreamFileContent::StreamFileContent(int fd, std::string mimetype)
+    :FileContent(mimetype), _fd(fd), _pos(0)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("StreamFileContent", COMMON::L_DEBUG)
+#endif
+}
+
+StreamFileContent::StreamFileContent(StreamReadFunction reader, std::string mimetype)
+    :FileContent(mimetype), _fd(-1), _reader(reader), _pos(0)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("StreamFileContent", COMMON::L_DEBUG)
+#endif
+}
+
+long long StreamFileContent::read_next(char* buffer, long long length) {
+    long long n;
+    if (_reader) {
+        n = _reader(buffer, length);
+    } else {
+        do {
+            n = ::read(_fd, buffer, length);
+        } while (n < 0 && errno == EINTR);
+    }
+    if (n > 0) {
+        digest(_pos, buffer, n);
+        _pos += n;
+    }
+    return n;
+}
+
+std::string StreamFileContent::get_content() {
+    // the rest of the stream, whatever it is
+    std::string rst;
+    char buffer[64 * 1024];
+    long long n;
+    while ((n = read_next(buffer, sizeof(buffer))) > 0) {
+        rst.append(buffer, n);
+    }
+    return rst;
+}
+
+long long StreamFileContent::read_at(long long pos, char* buffer, long long length) {
+    if (pos != _pos) {
+        CLOG_ERROR("Can't read a stream at %lld, it is at %lld\n", pos, _pos);
+        return -1;
+    }
+    return read_next(buffer, length);
+}
+
+size_t StreamFileContent::_read(char* buffer, size_t length) {
+    long long n = read_next(buffer, length);
+    return n < 0 ? 0 : n;
+}
+
+void StreamFileContent::_seek(long long pos) {
+    if (pos != _pos) {
+        CLOG_ERROR("Can't seek a stream to %lld, it is at %lld\n", pos, _pos);
+    }
+}
+
+long long StreamFileContent::_tell() {
+    return _pos;
+}
+
 }
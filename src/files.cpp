@@ -9,6 +9,7 @@ namespace GDRIVE {
 FileService FileService::_single_instance;
 
 FileService::FileService()
+    :_dedup(NULL), _dedup_action(DA_NONE)
 {
 #ifdef GDRIVE_DEBUG
     CLASS_INIT_LOGGER("FileService", L_DEBUG)
@@ -27,6 +28,9 @@ std::vector<GFile> FileService::Listall() {
         GFileList filelist = list.execute();
         const std::vector<GFile>& tmp = filelist.get_items();
         files.insert(files.end(), tmp.begin(), tmp.end());
+        if (_dedup != NULL) {
+            _dedup->add(tmp);
+        }
         list.clear();
 
         std::string pageToken = filelist.get_nextPageToken();
@@ -99,6 +103,15 @@ FileInsertRequest FileService::Insert(GFile* file, FileContent* content, bool re
     VarString vs;
     vs.append(FILE_UPLOAD_URL);
     FileInsertRequest fir(content, file, _cred, vs.toString(), resumable);
+    if (_dedup != NULL) {
+        fir.set_dedup(_dedup, _dedup_action);
+    }
+    return fir;
+}
+
+FileInsertRequest FileService::ResumeUpload(UploadJournal* journal, std::string path, GFile* file, FileContent* content) {
+    FileInsertRequest fir = Insert(file, content, true);
+    fir.set_journal(journal, path);
     return fir;
 }
 
@@ -106,7 +119,25 @@ FileUpdateRequest FileService::Update(std::string id, GFile* file, FileContent*
     VarString vs;
     vs.append(FILE_UPLOAD_URL).append("/").append(id);
     FileUpdateRequest fur(content, file, _cred, vs.toString(), resumable);
+    fur.set_file_id(id);
+    if (_dedup != NULL) {
+        fur.set_dedup(_dedup, _dedup_action);
+    }
     return fur;
 }
 
+FileDownloadRequest FileService::Download(std::string id, int fd) {
+    VarString vs;
+    vs.append(FILES_URL).append('/').append(id);
+    FileDownloadRequest fdr(_cred, vs.toString(), fd);
+    return fdr;
+}
+
+FileDownloadRequest FileService::Download(std::string id, std::string path) {
+    VarString vs;
+    vs.append(FILES_URL).append('/').append(id);
+    FileDownloadRequest fdr(_cred, vs.toString(), path);
+    return fdr;
+}
+
 }
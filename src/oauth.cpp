@@ -65,7 +65,7 @@ bool OAuth::build_credential(std::string code, Credential& cred) {
     header["user-agent"] = USER_AGENT;
 
     HttpRequest request(TOKEN_URL, RM_POST, header, URLHelper::encode(body));
-    HttpResponse resp = request.request();
+    HttpResponse& resp = request.request();
    
     if (resp.status() == 200) {
         CLOG_DEBUG("Response:%s\n", resp.content().c_str());
@@ -0,0 +1,170 @@
+#include "gdrive/ratelimit.hpp"
+
+#include <chrono>
+#include <thread>
+
+namespace GDRIVE {
+
+TokenBucket::TokenBucket()
+    :_max_rate(0), _burst(RATE_LIMIT_BURST), _limit(0), _rate(0), _tokens(RATE_LIMIT_BURST), _last(_now()),
+     _last_cut(0), _window_start(_last), _window_admitted(0), _window_ok(0), _admitted_rate(0), _ok_rate(0)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("TokenBucket", L_DEBUG)
+#endif
+}
+
+double TokenBucket::_now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TokenBucket::configure(double rate, double burst) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_rate = rate > 0 ? rate : 0;
+    _burst = burst < 1 ? 1 : burst;
+    _limit = 0;
+    _rate = _max_rate;
+    _tokens = _burst;
+    _last = _now();
+}
+
+void TokenBucket::_update(double now) {
+    double elapsed = now - _last;
+    _last = now;
+    if (_rate <= 0) return;
+
+    if (_limit > 0) {
+        _limit *= 1 + RATE_LIMIT_PROBE * elapsed;
+        if (_max_rate > 0 && _limit >= _max_rate) {
+            // the quota is back above the configured rate
+            _limit = 0;
+        }
+    }
+    double target = _limit > 0 ? _limit * RATE_LIMIT_TARGET : _max_rate;
+    if (target > 0 && _rate < target) {
+        double step = (_limit > 0 ? _limit : _max_rate) * RATE_LIMIT_RECOVERY * elapsed;
+        _rate = _rate + step < target ? _rate + step : target;
+    }
+    _tokens += _rate * elapsed;
+    if (_tokens > _burst) {
+        _tokens = _burst;
+    }
+}
+
+void TokenBucket::_roll(double now) {
+    double elapsed = now - _window_start;
+    if (elapsed < 1) return;
+    _admitted_rate = _window_admitted / elapsed;
+    _ok_rate = _window_ok / elapsed;
+    _window_start = now;
+    _window_admitted = _window_ok = 0;
+}
+
+void TokenBucket::acquire(int cost) {
+    double wait = reserve(cost);
+    if (wait > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+}
+
+double TokenBucket::reserve(int cost) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    double now = _now();
+    _update(now);
+    _stats.admitted += cost;
+    _roll(now);
+    _window_admitted += cost;
+    if (_rate <= 0) return 0;
+
+    // the tokens may go negative, every caller waits until its own share has come in
+    _tokens -= cost;
+    if (_tokens >= 0) return 0;
+    double wait = -_tokens / _rate;
+    _stats.throttled ++;
+    _stats.waited += wait;
+    return wait;
+}
+
+void TokenBucket::succeeded(int cost) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _roll(_now());
+    _window_ok += cost;
+}
+
+void TokenBucket::rate_limited() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    double now = _now();
+    _update(now);
+    _stats.rate_limited ++;
+    if (now - _last_cut < RATE_LIMIT_HOLD) return;
+    _last_cut = now;
+
+    _roll(now);
+    double window = now - _window_start;
+    double admitted = window > 0.1 ? _window_admitted / window : _admitted_rate;
+    double ok = window > 0.1 ? _window_ok / window : _ok_rate;
+    double current = _rate > 0 ? _rate : admitted;
+    // what got through is close to the quota, unless hardly anything did
+    _limit = ok > 0 && ok < current ? ok : current;
+    if (_limit < 1) _limit = 1;
+    _rate = _limit * RATE_LIMIT_BACKOFF;
+    if (_tokens > 0) {
+        _tokens = 0;
+    }
+    CLOG_INFO("Rate limited at %.1f requests per second, going on at %.1f\n", _limit, _rate);
+}
+
+RateLimitStats TokenBucket::stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    RateLimitStats rst = _stats;
+    rst.rate = _rate;
+    rst.limit = _limit;
+    return rst;
+}
+
+void RateLimiter::set_rate(RateClass cls, double rate, double burst) {
+    _buckets[cls].configure(rate, burst);
+}
+
+void RateLimiter::set_rate(double rate, double burst) {
+    for (int i = 0; i < RC_COUNT; i ++) {
+        _buckets[i].configure(rate, burst);
+    }
+}
+
+bool RateLimiter::update(RateClass cls, HttpResponse& resp, int cost) {
+    if (!is_rate_limited(resp)) {
+        _buckets[cls].succeeded(cost);
+        return false;
+    }
+    _buckets[cls].rate_limited();
+    return true;
+}
+
+RateClass RateLimiter::classify(std::string uri, RequestMethod method) {
+    std::string path = uri.substr(0, uri.find('?'));
+    if (path.find("/upload/") != std::string::npos) {
+        return RC_UPLOAD;
+    }
+    if (method != RM_GET) {
+        return RC_OTHER;
+    }
+    std::string last = path.substr(path.rfind('/') + 1);
+    if (last == "files" || last == "children" || last == "parents" || last == "changes"
+            || last == "permissions" || last == "revisions" || last == "comments"
+            || last == "replies" || last == "apps") {
+        return RC_LIST;
+    }
+    return RC_GET;
+}
+
+bool RateLimiter::is_rate_limited(HttpResponse& resp) {
+    if (resp.status() == 429) {
+        return true;
+    }
+    // the reason sits in error.errors[].reason, a plain search finds it wherever it is
+    return resp.status() == 403 && (resp.content().find("\"rateLimitExceeded\"") != std::string::npos
+            || resp.content().find("\"userRateLimitExceeded\"") != std::string::npos);
+}
+
+}
@@ -2,19 +2,96 @@
 #include "gdrive/util.hpp"
 #include "gdrive/config.hpp"
 #include "gdrive/error.hpp"
+#include "gdrive/connpool.hpp"
+#include "gdrive/asyncengine.hpp"
 #include <curl/curl.h>
 
 #include <sstream>
+#include <strings.h>
+#include <chrono>
+#include <thread>
 using namespace COMMON;
 namespace GDRIVE {
 
+#define RESPONSE_POOL_SIZE 4
+#define RESPONSE_POOL_MAX_CAPACITY 8 * 1024 * 1024
+#define RESPONSE_MAX_RESERVE 64 * 1024 * 1024
+
+bool ResponseBufferPool::_enabled = false;
+static thread_local std::vector<std::string> _spare_buffers;
+
+void ResponseBufferPool::acquire(std::string& buffer) {
+    if (!_enabled || _spare_buffers.size() == 0) return;
+    buffer.swap(_spare_buffers.back());
+    _spare_buffers.pop_back();
+}
+
+void ResponseBufferPool::recycle(std::string& buffer) {
+    if (!_enabled || buffer.capacity() == 0 || buffer.capacity() > RESPONSE_POOL_MAX_CAPACITY) return;
+    if (_spare_buffers.size() >= RESPONSE_POOL_SIZE) return;
+    buffer.clear();
+    _spare_buffers.push_back(std::string());
+    _spare_buffers.back().swap(buffer);
+}
+
+HttpResponse::HttpResponse(const HttpResponse& other)
+    :_content(other._content), _header(other._header), _status(other._status), _header_map(other._header_map)
+{
+}
+
+HttpResponse& HttpResponse::operator=(const HttpResponse& other) {
+    _content = other._content;
+    _header = other._header;
+    _status = other._status;
+    _header_map = other._header_map;
+    return *this;
+}
+
+HttpResponse::~HttpResponse() {
+    ResponseBufferPool::recycle(_content);
+}
+
+void HttpResponse::clear() {
+    ResponseBufferPool::recycle(_content);
+    _content.clear();
+    _header.clear();
+    _header_map.clear();
+}
+
+std::string HttpResponse::release() {
+    std::string body;
+    body.swap(_content);
+    return body;
+}
+
 size_t HttpResponse::curl_write_callback(void* content, size_t size, size_t nmemb, void* userp) {
-    std::string* self = (std::string*)userp;
-    std::string curr_content((char*)content, size * nmemb);
-    *self += curr_content;
+    HttpResponse* self = (HttpResponse*)userp;
+    if (self->_content.capacity() == 0) {
+        ResponseBufferPool::acquire(self->_content);
+    }
+    self->_content.append((const char*)content, size * nmemb);
     return size * nmemb;
 }
 
+size_t HttpResponse::curl_header_callback(void* content, size_t size, size_t nmemb, void* userp) {
+    HttpResponse* self = (HttpResponse*)userp;
+    size_t length = size * nmemb;
+    const char* line = (const char*)content;
+    self->_header.append(line, length);
+
+    // size the body buffer up front when the server tells us how big it is
+    if (length > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+        long long content_length = atoll(line + 15);
+        if (content_length > 0 && content_length <= RESPONSE_MAX_RESERVE) {
+            if (self->_content.capacity() == 0) {
+                ResponseBufferPool::acquire(self->_content);
+            }
+            self->_content.reserve(self->_content.size() + content_length);
+        }
+    }
+    return length;
+}
+
 std::string HttpResponse::get_header(std::string field) {
     if (_header_map.size() == 0) {
         _parse_header();
@@ -50,23 +127,84 @@ void HttpResponse::_parse_header() {
     }
 }
 
+void CancellationToken::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _cancelled = true;
+        // a held handle is still its request's while it is in the set, see _release
+        for (std::set<CURL*>::iterator iter = _held.begin(); iter != _held.end(); iter ++) {
+            AsyncEngine::get_instance().cancel(*iter);
+        }
+        _held.clear();
+    }
+    _cond.notify_all();
+}
+
+bool CancellationToken::_hold(CURL* handle) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_cancelled) return false;
+    _held.insert(handle);
+    return true;
+}
+
+void CancellationToken::_release(CURL* handle) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _held.erase(handle);
+}
+
+bool CancellationToken::wait_for(double seconds) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    while (!_cancelled && _cond.wait_until(lock, until) != std::cv_status::timeout);
+    return _cancelled;
+}
+
 HttpRequest::HttpRequest(std::string uri, RequestMethod method)
-    :_uri(uri), _method(method) 
+    :_uri(uri), _method(method), _body_view(NULL), _body_view_length(0), _body_reader(NULL, 0)
 {
-    _init_curl_handle();    
+    _handle = NULL;
+    _header_list = NULL;
     _read_hook = NULL;
     _read_context = NULL;
+    _write_hook = NULL;
+    _write_context = NULL;
+    _sink_status = 0;
+    _sink_refused = false;
+    _progress_hook = NULL;
+    _progress_context = NULL;
+    _retry = &RetryPolicy::get_instance();
+    _timeout = 0;
+    _connect_timeout = REQUEST_CONNECT_TIMEOUT;
+    _low_speed_limit = REQUEST_LOW_SPEED_LIMIT;
+    _low_speed_time = REQUEST_LOW_SPEED_TIME;
+    _deadline = _deadline_at = _started_at = 0;
+    _cancel = NULL;
 #ifdef GDIRVE_DEBUG
     CLASS_INIT_LOGGER("HttpRequest", L_DEBUG);
 #endif
 }
 
 HttpRequest::HttpRequest(std::string uri, RequestMethod method, RequestHeader& header, std::string body)
-    :_uri(uri), _method(method), _body(body)
+    :_uri(uri), _method(method), _body(body), _body_view(NULL), _body_view_length(0), _body_reader(NULL, 0)
 {
-    _init_curl_handle();
+    _handle = NULL;
+    _header_list = NULL;
     _read_hook = NULL;
     _read_context = NULL;
+    _write_hook = NULL;
+    _write_context = NULL;
+    _sink_status = 0;
+    _sink_refused = false;
+    _progress_hook = NULL;
+    _progress_context = NULL;
+    _retry = &RetryPolicy::get_instance();
+    _timeout = 0;
+    _connect_timeout = REQUEST_CONNECT_TIMEOUT;
+    _low_speed_limit = REQUEST_LOW_SPEED_LIMIT;
+    _low_speed_time = REQUEST_LOW_SPEED_TIME;
+    _deadline = _deadline_at = _started_at = 0;
+    _cancel = NULL;
     _header.insert(header.begin(), header.end());
 #ifdef GDRIVE_DEBUG
     CLASS_INIT_LOGGER("HttpRequest", L_DEBUG);
@@ -74,23 +212,49 @@ HttpRequest::HttpRequest(std::string uri, RequestMethod method, RequestHeader& h
 }
 
 HttpRequest::~HttpRequest() {
-    curl_easy_cleanup(_handle);
+    _release_curl_handle();
 }
 
 void HttpRequest::set_uri(std::string uri) {
     _uri = uri;
-    curl_easy_setopt(_handle, CURLOPT_URL, _uri.c_str());
 }
 
 void HttpRequest::_init_curl_handle() {
-    //curl_global_init(CURL_GLOBAL_ALL);
-    _handle = curl_easy_init();
+    _handle = ConnectionPool::get_instance().acquire(ConnectionPool::host_of(_uri));
     curl_easy_setopt(_handle, CURLOPT_URL, _uri.c_str());
-    curl_easy_setopt(_handle, CURLOPT_HEADERDATA, (void*)&_resp._header);
-    curl_easy_setopt(_handle, CURLOPT_WRITEDATA, (void*)&_resp._content);
-    curl_easy_setopt(_handle, CURLOPT_WRITEFUNCTION, HttpResponse::curl_write_callback);
-    _header.clear();
-    _query.clear();
+    curl_easy_setopt(_handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(_handle, CURLOPT_HEADERDATA, (void*)&_resp);
+    curl_easy_setopt(_handle, CURLOPT_HEADERFUNCTION, HttpResponse::curl_header_callback);
+    _sink_refused = false;
+    if (_write_hook != NULL) {
+        curl_easy_setopt(_handle, CURLOPT_WRITEDATA, (void*)this);
+        curl_easy_setopt(_handle, CURLOPT_WRITEFUNCTION, HttpRequest::_sink_write);
+    } else {
+        curl_easy_setopt(_handle, CURLOPT_WRITEDATA, (void*)&_resp);
+        curl_easy_setopt(_handle, CURLOPT_WRITEFUNCTION, HttpResponse::curl_write_callback);
+    }
+    AsyncEngine::get_instance().configure_handle(_handle);
+}
+
+size_t HttpRequest::_sink_write(void* content, size_t size, size_t nmemb, void* userp) {
+    HttpRequest* self = (HttpRequest*)userp;
+    long status = 0;
+    curl_easy_getinfo(self->_handle, CURLINFO_RESPONSE_CODE, &status);
+    // error bodies are small JSON documents, keep them for GoogleJsonResponseException
+    if (status >= 300) {
+        return HttpResponse::curl_write_callback(content, size, nmemb, (void*)&self->_resp);
+    }
+    if (self->_sink_status != 0 && status != self->_sink_status) {
+        self->_sink_refused = true;
+        return 0;
+    }
+    return self->_write_hook(content, size, nmemb, self->_write_context);
+}
+
+void HttpRequest::_release_curl_handle() {
+    if (_handle == NULL) return;
+    ConnectionPool::get_instance().release(ConnectionPool::host_of(_uri), _handle);
+    _handle = NULL;
 }
 
 void HttpRequest::add_header(RequestHeader& header) {
@@ -115,6 +279,8 @@ void HttpRequest::clear() {
     _resp.clear();
     _header.clear();
     _body = "";
+    _body_view = NULL;
+    _body_view_length = 0;
 }
 
 curl_slist* HttpRequest::_build_header() {
@@ -127,9 +293,10 @@ curl_slist* HttpRequest::_build_header() {
     return list;
 }
 
-HttpResponse& HttpRequest::request() {
+void HttpRequest::_prepare_request() {
+    _init_curl_handle();
     VarString vs;
-    MemoryString ms(_body.c_str(), _body.size());
+    _body_reader = MemoryString(_body.c_str(), _body.size());
     // if there is query paremeter, append to url
     if (_query.size() != 0) {
         vs.append(_uri).append('?').append(URLHelper::encode(_query));
@@ -140,16 +307,32 @@ HttpResponse& HttpRequest::request() {
         // do nothing
     } else {
         if (_header.find("Content-Length") != _header.end()) {
-            curl_easy_setopt(_handle, CURLOPT_POSTFIELDSIZE, atoi(_header["Content-Length"].c_str()));
+            curl_easy_setopt(_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)SizeHelper::stoll(_header["Content-Length"]));
         }
 
     
-        if (_method == RM_PUT) {
+        if (_body_view != NULL) {
+            // curl sends from the caller's memory, PUT included
+            curl_easy_setopt(_handle, CURLOPT_POST, 1);
+            curl_easy_setopt(_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)_body_view_length);
+            curl_easy_setopt(_handle, CURLOPT_POSTFIELDS, _body_view);
+            if (_method == RM_PUT) {
+                curl_easy_setopt(_handle, CURLOPT_CUSTOMREQUEST, "PUT");
+            } else if (_method == RM_DELETE) {
+                curl_easy_setopt(_handle, CURLOPT_CUSTOMREQUEST, "DELETE");
+            } else if (_method == RM_PATCH) {
+                curl_easy_setopt(_handle, CURLOPT_CUSTOMREQUEST, "PATCH");
+            }
+        } else if (_method == RM_PUT) {
             curl_easy_setopt(_handle, CURLOPT_PUT, 1);
             curl_easy_setopt(_handle, CURLOPT_UPLOAD, 1);
+            // without a known size curl falls back to chunked encoding next to our Content-Length
+            if (_header.find("Content-Length") != _header.end()) {
+                curl_easy_setopt(_handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t)SizeHelper::stoll(_header["Content-Length"]));
+            }
             if (_read_hook == NULL) {
                 curl_easy_setopt(_handle, CURLOPT_READFUNCTION, MemoryString::read);
-                curl_easy_setopt(_handle, CURLOPT_READDATA, (void*)&ms);
+                curl_easy_setopt(_handle, CURLOPT_READDATA, (void*)&_body_reader);
             } else {
                 curl_easy_setopt(_handle, CURLOPT_READFUNCTION, _read_hook);
                 curl_easy_setopt(_handle, CURLOPT_READDATA, _read_context);
@@ -174,30 +357,227 @@ HttpResponse& HttpRequest::request() {
             }
         }
     }
+    if (_progress_hook != NULL || _cancel != NULL) {
+        curl_easy_setopt(_handle, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(_handle, CURLOPT_XFERINFOFUNCTION, HttpRequest::_progress);
+        curl_easy_setopt(_handle, CURLOPT_XFERINFODATA, (void*)this);
+    }
+
+    double timeout = _timeout;
+    if (_deadline_at > 0) {
+        double left = _deadline_at - _now();
+        if (timeout <= 0 || left < timeout) {
+            timeout = left;
+        }
+    }
+    if (timeout > 0) {
+        // 0 would mean no timeout at all
+        long ms = (long)(timeout * 1000);
+        curl_easy_setopt(_handle, CURLOPT_TIMEOUT_MS, ms < 1 ? 1L : ms);
+    }
+    if (_connect_timeout > 0) {
+        curl_easy_setopt(_handle, CURLOPT_CONNECTTIMEOUT_MS, (long)(_connect_timeout * 1000));
+    }
+    if (_low_speed_limit > 0 && _low_speed_time > 0) {
+        curl_easy_setopt(_handle, CURLOPT_LOW_SPEED_LIMIT, _low_speed_limit);
+        curl_easy_setopt(_handle, CURLOPT_LOW_SPEED_TIME, _low_speed_time);
+    }
 #ifdef GDRIVE_DEBUG
     curl_easy_setopt(_handle, CURLOPT_VERBOSE, 1);
 #endif
     curl_easy_setopt(_handle, CURLOPT_USE_SSL, CURLUSESSL_ALL);
-    curl_slist* header_list = NULL;
+    _header_list = NULL;
     if (_header.size() > 0) {
-        header_list = _build_header();
-        curl_easy_setopt(_handle, CURLOPT_HTTPHEADER, header_list);
+        _header_list = _build_header();
+        curl_easy_setopt(_handle, CURLOPT_HTTPHEADER, _header_list);
     }
-    CURLcode res = curl_easy_perform(_handle);
-    
-    if (header_list != NULL) {
-        curl_slist_free_all(header_list);
+}
+
+void HttpRequest::_finish_request(CURLcode res) {
+    if (_header_list != NULL) {
+        curl_slist_free_all(_header_list);
+        _header_list = NULL;
     }
 
-    if (res != CURLE_OK) {
+    // a refused body isn't a transfer error, the caller goes by the status
+    if (res != CURLE_OK && !(res == CURLE_WRITE_ERROR && _sink_refused)) {
+        _release_curl_handle();
+        if (res == CURLE_ABORTED_BY_CALLBACK && _cancel != NULL && _cancel->cancelled()) {
+            throw CancelledException();
+        }
+        if (res == CURLE_OPERATION_TIMEDOUT) {
+            throw TimeoutException(curl_easy_strerror(res));
+        }
         throw CurlException(res, curl_easy_strerror(res)); 
     }
 
-    int status;
+    long status;
     curl_easy_getinfo(_handle, CURLINFO_RESPONSE_CODE, &status);
+    ConnectionPool::get_instance().record_transfer(_handle);
+    _release_curl_handle();
  
     _resp.set_status(status);
+}
+
+double HttpRequest::_now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int HttpRequest::_progress(void* context, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    HttpRequest* self = (HttpRequest*)context;
+    if (self->_cancel != NULL && self->_cancel->cancelled()) {
+        return 1;
+    }
+    if (self->_progress_hook != NULL) {
+        return self->_progress_hook(self->_progress_context, dltotal, dlnow, ultotal, ulnow);
+    }
+    return 0;
+}
+
+void HttpRequest::_check_continue() {
+    if (_cancel != NULL && _cancel->cancelled()) {
+        throw CancelledException();
+    }
+    if (_deadline_at > 0 && _now() >= _deadline_at) {
+        throw TimeoutException("Request deadline exceeded");
+    }
+}
+
+double HttpRequest::_retry_delay(int attempt, double start, int curl_code) {
+    if (_retry == NULL || (_cancel != NULL && _cancel->cancelled())) return -1;
+    if (curl_code == CURLE_OK && !_retry->retryable(_resp)) {
+        if (attempt > 1) {
+            _retry->recovered();
+        }
+        return -1;
+    }
+    if (curl_code != CURLE_OK && !_retry->retryable(curl_code)) return -1;
+    // a second attempt mustn't change anything the first one may have done, and
+    // has to be able to send the body again and to take the response from the start
+    if (_method == RM_POST || _method == RM_PATCH || _read_hook != NULL) return -1;
+    if (curl_code != CURLE_OK && _write_hook != NULL) return -1;
+
+    double now = _now();
+    double delay = _retry->backoff(attempt, now - start, curl_code == CURLE_OK ? &_resp : NULL,
+                                   _deadline_at > 0 ? _deadline_at - now : -1);
+    if (delay >= 0) {
+        CLOG_INFO("Attempt %d of %s failed with %d, retrying in %.2fs\n", attempt, _uri.c_str(),
+                  curl_code == CURLE_OK ? _resp.status() : curl_code, delay);
+    }
+    return delay;
+}
+
+void HttpRequest::_transfer() {
+    _prepare_request();
+    CURLcode res;
+    if (AsyncEngine::get_instance().multiplexing()) {
+        res = AsyncEngine::get_instance().perform(_handle);
+    } else {
+        res = curl_easy_perform(_handle);
+    }
+    _finish_request(res);
+}
+
+HttpResponse& HttpRequest::request() {
+    _start_clock();
+    return _perform();
+}
+
+void HttpRequest::_start_clock() {
+    _started_at = _now();
+    _deadline_at = _deadline > 0 ? _started_at + _deadline : 0;
+}
+
+HttpResponse& HttpRequest::_perform() {
+    for (int attempt = 1; ; attempt ++) {
+        _check_continue();
+        double delay;
+        try {
+            _transfer();
+            delay = _retry_delay(attempt, _started_at, CURLE_OK);
+            if (delay < 0) break;
+        } catch (CurlException& e) {
+            delay = _retry_delay(attempt, _started_at, e.code());
+            if (delay < 0) throw;
+        }
+        if (_cancel != NULL) {
+            _cancel->wait_for(delay);
+        } else {
+            std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+        }
+        _resp.clear();
+    }
     return _resp;
 }
 
+void HttpRequest::_transfer_async(RequestCallback callback, double delay) {
+    _submit(callback, delay);
+}
+
+void HttpRequest::_submit(RequestCallback callback, double delay) {
+    _prepare_request();
+    CURL* handle = _handle;
+    // a cancelled token takes the handle out of the engine instead of letting it wait;
+    // if it is cancelled already, the transfer starts and aborts at once
+    CancellationToken* cancel = delay > 0 ? _cancel : NULL;
+    if (cancel != NULL && !cancel->_hold(handle)) {
+        cancel = NULL;
+        delay = 0;
+    }
+    AsyncEngine::get_instance().submit(handle, [this, callback, cancel, handle](CURLcode res) {
+        if (cancel != NULL) {
+            cancel->_release(handle);
+        }
+        try {
+            _finish_request(res);
+        } catch (...) {
+            callback(std::current_exception());
+            return;
+        }
+        callback(std::exception_ptr());
+    }, delay);
+}
+
+void HttpRequest::request_async(RequestCallback callback) {
+    _start_clock();
+    _perform_async(callback);
+}
+
+void HttpRequest::_perform_async(RequestCallback callback) {
+    try {
+        _request_async(1, _started_at, callback);
+    } catch (...) {
+        callback(std::current_exception());
+    }
+}
+
+void HttpRequest::_request_async(int attempt, double start, RequestCallback callback, double delay) {
+    _check_continue();
+    _transfer_async([this, attempt, start, callback](std::exception_ptr error) {
+        int code = CURLE_OK;
+        if (error) {
+            try {
+                std::rethrow_exception(error);
+            } catch (CurlException& e) {
+                code = e.code();
+            } catch (...) {
+                callback(error);
+                return;
+            }
+        }
+        double delay = _retry_delay(attempt, start, code);
+        if (delay < 0) {
+            callback(error);
+            return;
+        }
+        // the engine holds the next attempt back, the I/O thread goes on meanwhile
+        _resp.clear();
+        try {
+            _request_async(attempt + 1, start, callback, delay);
+        } catch (...) {
+            callback(std::current_exception());
+        }
+    }, delay);
+}
+
 }
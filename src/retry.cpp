@@ -0,0 +1,125 @@
+#include "gdrive/retry.hpp"
+#include "gdrive/request.hpp"
+#include "gdrive/ratelimit.hpp"
+
+#include <stdlib.h>
+#include <random>
+
+namespace GDRIVE {
+
+RetryPolicy RetryPolicy::_single_instance;
+
+RetryPolicy::RetryPolicy()
+    :_rate_limited(true), _max_attempts(RETRY_MAX_ATTEMPTS), _initial_delay(RETRY_INITIAL_DELAY),
+     _multiplier(RETRY_MULTIPLIER), _max_delay(RETRY_MAX_DELAY), _jitter(RETRY_JITTER), _deadline(0)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("RetryPolicy", L_DEBUG)
+#endif
+    int statuses[] = { 429, 500, 502, 503, 504 };
+    _statuses.insert(statuses, statuses + sizeof(statuses) / sizeof(statuses[0]));
+    int codes[] = { CURLE_COULDNT_RESOLVE_HOST, CURLE_COULDNT_CONNECT, CURLE_OPERATION_TIMEDOUT,
+                    CURLE_SSL_CONNECT_ERROR, CURLE_GOT_NOTHING, CURLE_SEND_ERROR, CURLE_RECV_ERROR,
+                    CURLE_PARTIAL_FILE, CURLE_HTTP2, CURLE_HTTP2_STREAM };
+    _curl_codes.insert(codes, codes + sizeof(codes) / sizeof(codes[0]));
+}
+
+void RetryPolicy::set_statuses(std::set<int> statuses) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _statuses = statuses;
+}
+
+void RetryPolicy::set_curl_codes(std::set<int> codes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _curl_codes = codes;
+}
+
+void RetryPolicy::set_retry_rate_limited(bool flag) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _rate_limited = flag;
+}
+
+void RetryPolicy::set_max_attempts(int attempts) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_attempts = attempts < 1 ? 1 : attempts;
+}
+
+void RetryPolicy::set_backoff(double initial, double multiplier, double max_delay) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _initial_delay = initial < 0 ? 0 : initial;
+    _multiplier = multiplier < 1 ? 1 : multiplier;
+    _max_delay = max_delay < _initial_delay ? _initial_delay : max_delay;
+}
+
+void RetryPolicy::set_jitter(double jitter) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _jitter = jitter < 0 ? 0 : (jitter > 1 ? 1 : jitter);
+}
+
+void RetryPolicy::set_deadline(double seconds) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _deadline = seconds;
+}
+
+bool RetryPolicy::retryable(int curl_code) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _curl_codes.find(curl_code) != _curl_codes.end();
+}
+
+bool RetryPolicy::retryable(HttpResponse& resp) {
+    bool rate_limited;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_statuses.find(resp.status()) != _statuses.end()) {
+            return true;
+        }
+        rate_limited = _rate_limited;
+    }
+    // parsing the error body doesn't need the lock
+    return rate_limited && RateLimiter::is_rate_limited(resp);
+}
+
+double RetryPolicy::backoff(int attempt, double elapsed, HttpResponse* resp, double time_left) {
+    std::string retry_after = resp != NULL ? resp->get_header("Retry-After") : "";
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    double delay = _initial_delay;
+    for (int i = 1; i < attempt && delay < _max_delay; i ++) {
+        delay *= _multiplier;
+    }
+    if (delay > _max_delay) {
+        delay = _max_delay;
+    }
+    // every client backing off in step would come back all at once
+    static thread_local std::mt19937 generator(std::random_device{}());
+    delay *= 1 - _jitter * std::uniform_real_distribution<double>(0, 1)(generator);
+
+    if (retry_after != "" && atof(retry_after.c_str()) > delay) {
+        delay = atof(retry_after.c_str());
+    }
+
+    if (attempt >= _max_attempts || (_deadline > 0 && elapsed + delay > _deadline)
+            || (time_left >= 0 && delay >= time_left)) {
+        _stats.exhausted ++;
+        return -1;
+    }
+    _stats.retries ++;
+    if (resp != NULL) {
+        _stats.status_retries ++;
+    } else {
+        _stats.curl_retries ++;
+    }
+    return delay;
+}
+
+void RetryPolicy::recovered() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats.recovered ++;
+}
+
+RetryStats RetryPolicy::stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+}
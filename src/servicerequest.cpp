@@ -2,11 +2,10 @@
 #include "jconer/json.hpp"
 
 #include <string.h>
+#include <memory>
+#include <chrono>
 using namespace JCONER;
 
-#define RESUMABLE_THRESHOLD 5 * 1024 * 1024
-#define RESUMABLE_CHUNK_SIZE 256 * 1024
-
 namespace GDRIVE {
 
 GoogleJsonResponseException make_json_exception(std::string content) {
@@ -22,12 +21,42 @@ GoogleJsonResponseException make_json_exception(std::string content) {
 
 void DeleteRequest::execute() {
     CredentialHttpRequest::request();
+    _check_status();
+}
+
+void DeleteRequest::_check_status() {
     if (_resp.status() != 204) {
         GoogleJsonResponseException exc = make_json_exception(_resp.content());
         throw exc;
     }   
 }
 
+void DeleteRequest::execute_async(RequestCallback callback) {
+    CredentialHttpRequest::request_async([this, callback](std::exception_ptr error) {
+        if (!error) {
+            try {
+                _check_status();
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        callback(error);
+    });
+}
+
+std::future<void> DeleteRequest::execute_async() {
+    std::shared_ptr<std::promise<void> > promise(new std::promise<void>());
+    std::future<void> future = promise->get_future();
+    execute_async([promise](std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value();
+        }
+    });
+    return future;
+}
+
 void FileListRequest::set_corpus(std::string corpus) {
     if (corpus == "DEFAULT" or corpus == "DOMAIN") {
         _query["corpus"] = corpus;
@@ -44,156 +73,812 @@ void FileListRequest::set_maxResults(int max_results) {
     }
 }
 
-int FileUploadRequest::_resume() {
+UploadProtocol FileUploadRequest::_prepare_upload() {
+    UploadProtocol protocol;
+    std::set<std::string> fields = _resource->get_modified_fields();
+    // a stream of unknown length can only go out in chunks
+    bool resumable = _resumable || !_content->seekable() || _content->get_length() >= RESUMABLE_THRESHOLD;
+    if (fields.size() == 0 ) {
+        if (resumable) {
+            protocol = UP_RESUMABLE;
+            _query["uploadType"] = "resumable";
+        } else {
+            protocol = UP_MEDIA;
+            _query["uploadType"] = "media";
+        }
+    } else {
+        if (resumable) {
+            protocol = UP_RESUMABLE;
+            _query["uploadType"] = "resumable";
+        } else {
+            protocol = UP_MULTIPART;
+            _query["uploadType"] = "multipart";
+        }
+    }
+
+    _content->reset_digest();
+    if (protocol == UP_MEDIA) { // simple upload
+        if (_content->data() != NULL) {
+            set_body_view(_content->data(), _content->get_length());
+            _chunk_start = 0;
+            set_progress_hook(_release_sent, this);
+        } else {
+            _read_hook = FileContent::read;
+            _read_context = (void*)_content;
+        }
+        _header["Content-Type"] = _content->mimetype();
+        _header["Content-Length"] = SizeHelper::itos(_content->get_length());
+    } else if (protocol == UP_MULTIPART) { // multipart upload
+        // the file part is streamed from _content between the two framing strings
+        std::string preamble, epilogue;
+        _multipart_framing(preamble, epilogue);
+        _multipart.reset(preamble, _content, epilogue);
+        _read_hook = MultipartReader::read;
+        _read_context = (void*)&_multipart;
+        _header["Content-Length"] = SizeHelper::itos(_multipart.length());
+    }
+    return protocol;
+}
+
+void FileUploadRequest::_transfer() {
+    _rewind_body();
+    CredentialHttpRequest::_transfer();
+}
+
+void FileUploadRequest::_transfer_async(RequestCallback callback, double delay) {
+    _rewind_body();
+    CredentialHttpRequest::_transfer_async(callback, delay);
+}
+
+void FileUploadRequest::_rewind_body() {
+    _multipart.rewind();
+    // the last attempt read the chunk up to its end
+    if (_read_hook == FileContent::resumable_read) {
+        _content->set_resumable_start_pos(_chunk_start);
+        _content->set_resumable_length(_chunk_length);
+    } else if (_read_hook == ChunkPipeline::read) {
+        ((ChunkPipeline*)_read_context)->rewind();
+    }
+}
+
+void FileUploadRequest::_multipart_framing(std::string& preamble, std::string& epilogue) {
+    _json_encode_body();
+    std::string boundary = _generate_boundary();
+    _header["Content-Type"] = "multipart/related; boundary=\"" + boundary + "\"";
+    preamble = "--" + boundary + "\n"
+          + "Content-Type: application/json" + "\n\n"
+          + _body + "\n"
+          + "--" + boundary + "\n"
+          + "Content-Type: " + _content->mimetype() + "\n\n";
+    epilogue = "\n--" + boundary + "--";
+    _body = "";
+}
+
+void FileUploadRequest::_prepare_body() {
+    std::string content = _content->get_content();
+    _content->reset_digest();
+    _content->digest(0, content.data(), content.size());
+    if (_resource->get_modified_fields().size() == 0) {
+        _query["uploadType"] = "media";
+        _header["Content-Type"] = _content->mimetype();
+        _body = content;
+    } else {
+        _query["uploadType"] = "multipart";
+        std::string preamble, epilogue;
+        _multipart_framing(preamble, epilogue);
+        _body = preamble + content + epilogue;
+    }
+    _header["Content-Length"] = SizeHelper::itos(_body.size());
+}
+
+GFile FileUploadRequest::result() {
+    return _uploaded(true);
+}
+
+GFile FileUploadRequest::_uploaded(bool check_status) {
+    if (check_status) {
+        _check_upload_status();
+    }
+    GFile _1 = *_resource;
+    this->get_resource(_1);
+    _check_checksum(_1);
+    if (_dedup != NULL) {
+        _dedup->add(_1);
+    }
+    return _1;
+}
+
+void FileUploadRequest::_check_upload_status() {
+    if ((_type == UT_CREATE && _resp.status() != 200) || (_type == UT_UPDATE && _resp.status() != 201)) {
+        GoogleJsonResponseException exc = make_json_exception(_resp.content());
+        throw exc;
+    }
+}
+
+void FileUploadRequest::_check_checksum(GFile& file) {
+    if (!_verify_checksum || file.get_md5Checksum() == "") return;
+    std::string checksum = _content->md5();
+    if (checksum == "") {
+        CLOG_WARN("Upload content wasn't read in full, can't verify md5Checksum\n");
+        return;
+    }
+    if (checksum != file.get_md5Checksum()) {
+        throw IntegrityException(file.get_md5Checksum(), checksum);
+    }
+}
+
+bool FileUploadRequest::_dedup_key(std::string& md5, long long& length) {
+    if (_dedup == NULL || _dedup_action == DA_NONE || !_content->seekable()) {
+        return false;
+    }
+    md5 = _content->compute_md5();
+    length = _content->get_length();
+    return md5 != "";
+}
+
+std::string FileUploadRequest::_dedup_source(std::string md5, long long length) {
+    std::string id;
+    if (_type == UT_UPDATE) {
+        if (_file_id != "" && _dedup->contains(_file_id, md5, length)) {
+            id = _file_id;
+        }
+    } else {
+        id = _dedup->find(md5, length);
+    }
+    if (id != "") {
+        CLOG_DEBUG("Content %s of %lld bytes is already in %s\n", md5.c_str(), length, id.c_str());
+    }
+    return id;
+}
+
+bool FileUploadRequest::_deduplicate(GFile& file) {
+    std::string md5;
+    long long length;
+    if (!_dedup_key(md5, length)) {
+        return false;
+    }
+
+    while (true) {
+        std::string id = _dedup_source(md5, length);
+        if (id == "") {
+            return false;
+        }
+
+        // sending the metadata clears its modified fields, the upload may still need them
+        GFile metadata = *_resource;
+        FileGetRequest get(_cred, _files_url + "/" + id);
+        FilePatchRequest patch(&metadata, _cred, _files_url + "/" + id);
+        FileCopyRequest copy(&metadata, _cred, _files_url + "/" + id + "/copy");
+        HttpRequest* sent = &get;
+        try {
+            if (_type == UT_UPDATE && metadata.get_modified_fields().size() != 0) {
+                // same content, only the metadata changes
+                sent = &patch;
+                file = patch.execute();
+            } else if (_type == UT_CREATE && _dedup_action == DA_COPY) {
+                sent = &copy;
+                file = copy.execute();
+                _dedup->add(file);
+            } else {
+                file = get.execute();
+            }
+            return true;
+        } catch (GoogleJsonResponseException& e) {
+            if (sent->response().status() != 404) {
+                throw;
+            }
+            // the index was stale, try another file with the content or send it after all
+            CLOG_INFO("File %s is gone\n", id.c_str());
+            _dedup->remove(id);
+        }
+    }
+}
+
+void FileUploadRequest::_deduplicate_async(std::string md5, long long length, ResultCallback callback) {
+    std::string id = _dedup_source(md5, length);
+    if (id == "") {
+        _upload_async(callback);
+        return;
+    }
+
+    // the requests outlive this call, their callback holds the last reference to them
+    std::shared_ptr<GFile> metadata(new GFile(*_resource));
+    std::shared_ptr<HttpRequest> sent;
+    FilePatchRequest* patch = NULL;
+    FileCopyRequest* copy = NULL;
+    FileGetRequest* get = NULL;
+    if (_type == UT_UPDATE && metadata->get_modified_fields().size() != 0) {
+        sent.reset(patch = new FilePatchRequest(metadata.get(), _cred, _files_url + "/" + id));
+    } else if (_type == UT_CREATE && _dedup_action == DA_COPY) {
+        sent.reset(copy = new FileCopyRequest(metadata.get(), _cred, _files_url + "/" + id + "/copy"));
+    } else {
+        sent.reset(get = new FileGetRequest(_cred, _files_url + "/" + id));
+    }
+    bool copied = copy != NULL;
+    ResultCallback done = [this, sent, metadata, copied, id, md5, length, callback](GFile& file, std::exception_ptr error) {
+        if (!error) {
+            if (copied) {
+                _dedup->add(file);
+            }
+            callback(file, error);
+            return;
+        }
+        if (sent->response().status() == 404) {
+            CLOG_INFO("File %s is gone\n", id.c_str());
+            _dedup->remove(id);
+            _deduplicate_async(md5, length, callback);
+            return;
+        }
+        callback(file, error);
+    };
+    if (patch != NULL) {
+        patch->execute_async(done);
+    } else if (copy != NULL) {
+        copy->execute_async(done);
+    } else {
+        get->execute_async(done);
+    }
+}
+
+GFile FileUploadRequest::execute() {
+    GFile deduplicated;
+    if (_deduplicate(deduplicated)) {
+        return deduplicated;
+    }
+    if (_prepare_upload() == UP_RESUMABLE) {
+        _resumable_upload();
+        return _uploaded(false);
+    }
+    request();
+    return _uploaded(true);
+}
+
+void FileUploadRequest::execute_async(ResultCallback callback) {
+    std::string md5;
+    long long length;
+    bool deduplicate;
+    try {
+        deduplicate = _dedup_key(md5, length);
+    } catch (...) {
+        GFile _1 = *_resource;
+        callback(_1, std::current_exception());
+        return;
+    }
+    if (deduplicate) {
+        _deduplicate_async(md5, length, callback);
+    } else {
+        _upload_async(callback);
+    }
+}
+
+void FileUploadRequest::_upload_async(ResultCallback callback) {
+    bool resumable = _prepare_upload() == UP_RESUMABLE;
+    RequestCallback finished = [this, resumable, callback](std::exception_ptr error) {
+        GFile _1 = *_resource;
+        if (!error) {
+            try {
+                _1 = _uploaded(!resumable);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        callback(_1, error);
+    };
+    if (resumable) {
+        _resumable_upload_async(finished);
+    } else {
+        CredentialHttpRequest::request_async(finished);
+    }
+}
+
+long long FileUploadRequest::_round_chunk_size(long long size) {
+    if (size < RESUMABLE_CHUNK_SIZE) {
+        return RESUMABLE_CHUNK_SIZE;
+    }
+    return (size + RESUMABLE_CHUNK_SIZE - 1) / RESUMABLE_CHUNK_SIZE * RESUMABLE_CHUNK_SIZE;
+}
+
+void FileUploadRequest::set_chunk_size(long long size) {
+    if (size <= 0) {
+        CLOG_WARN("Wrong chunk size[%lld], using %d\n", size, RESUMABLE_CHUNK_SIZE);
+        size = RESUMABLE_CHUNK_SIZE;
+    }
+    _chunk_size = _round_chunk_size(size);
+}
+
+void FileUploadRequest::set_chunk_size_bounds(long long min_size, long long max_size) {
+    if (min_size <= 0 || max_size < min_size) {
+        CLOG_WARN("Wrong chunk size bounds[%lld, %lld], keeping [%lld, %lld]\n",
+                  min_size, max_size, _min_chunk_size, _max_chunk_size);
+        return;
+    }
+    _min_chunk_size = _round_chunk_size(min_size);
+    _max_chunk_size = _round_chunk_size(max_size);
+}
+
+long long FileUploadRequest::chunk_size_for(double bandwidth, double rtt) {
+    return _round_chunk_size((long long)(bandwidth * rtt));
+}
+
+void FileUploadRequest::_adapt_chunk_size(double seconds, bool failed) {
+    if (!_adaptive) return;
+    long long size = _chunk_size;
+    if (failed) {
+        size = _round_chunk_size(size / 2);
+        _stats.shrinks ++;
+    } else if (seconds < _chunk_target) {
+        size *= 2;
+    }
+    if (size < _min_chunk_size) size = _min_chunk_size;
+    if (size > _max_chunk_size) size = _max_chunk_size;
+    if (size != _chunk_size) {
+        CLOG_DEBUG("Chunk size %lld -> %lld after %.3fs\n", _chunk_size, size, seconds);
+        _chunk_size = size;
+    }
+}
+
+int FileUploadRequest::_release_sent(void* context, curl_off_t, curl_off_t,
+                                     curl_off_t, curl_off_t ulnow) {
+    FileUploadRequest* self = (FileUploadRequest*)context;
+    self->_content->digest(self->_chunk_start, self->_content->data() + self->_chunk_start, ulnow);
+    self->_content->release(self->_chunk_start + ulnow);
+    return 0;
+}
+
+void FileUploadRequest::_report(long long sent, long long chunk_bytes, double seconds, double total_seconds) {
+    _stats.sent = sent;
+    _stats.chunks ++;
+    _stats.rate = seconds > 0 ? chunk_bytes / seconds : 0;
+    _stats.average_rate = total_seconds > 0 ? sent / total_seconds : 0;
+    if (_progress) {
+        _progress(_stats);
+    }
+}
+
+void FileUploadRequest::_prepare_session() {
+    std::set<std::string> fields = _resource->get_modified_fields();
+    // Step 1 - Start a resumable session
+    _header["X-Upload-Content-Type"] = _content->mimetype();
+    if (_content->get_length() >= 0) {
+        _header["X-Upload-Content-Length"] = SizeHelper::itos(_content->get_length());
+    }
+    if (fields.size() != 0) {
+        _json_encode_body();
+    }
+}
+
+void FileUploadRequest::_session_opened() {
+    // Step 2 - Save the resumable session URI
+    if (_resp.status() != 200)  {
+        GoogleJsonResponseException exc = make_json_exception(_resp.content());
+        throw exc;
+    }
+
+    std::string location = _resp.get_header("Location");
+    if (_journal != NULL && _content->seekable()) {
+        UploadSession session;
+        if (UploadJournal::current(_journal_path, session)) {
+            session.uri = location;
+            _journal->save(_journal_path, session);
+        } else {
+            CLOG_WARN("Can't stat %s, its upload session isn't journaled\n", _journal_path.c_str());
+        }
+    }
+
+    // Prepare for step 3
+    set_uri(location);
+    _method = RM_PUT;
+}
+
+bool FileUploadRequest::_journaled_session(UploadSession& session) {
+    if (_journal == NULL || !_content->seekable() || !_journal->load(_journal_path, session)) {
+        return false;
+    }
+    UploadSession now;
+    if (!UploadJournal::current(_journal_path, now) || now.size != session.size
+            || now.mtime != session.mtime || now.size != _content->get_length()) {
+        CLOG_INFO("%s changed since its upload started, starting over\n", _journal_path.c_str());
+        _journal->remove(_journal_path);
+        return false;
+    }
+    return true;
+}
+
+void FileUploadRequest::_prepare_reopen(UploadSession& session) {
+    _origin_uri = _uri;
+    _origin_query = _query;
+    _origin_method = _method;
+    set_uri(session.uri);
+    _method = RM_PUT;
+    _prepare_resume(session.size);
+}
+
+bool FileUploadRequest::_session_reopened() {
+    try {
+        _cur_pos = _resumed(_content->get_length());
+    } catch (GoogleJsonResponseException& e) {
+        if (_resp.status() != 404 && _resp.status() != 410) {
+            throw;
+        }
+        // sessions expire after a while, a new one has to start from the beginning
+        CLOG_INFO("Upload session of %s expired, starting over\n", _journal_path.c_str());
+        _journal->remove(_journal_path);
+        set_uri(_origin_uri);
+        _query = _origin_query;
+        _method = _origin_method;
+        _resp.clear();
+        _cur_pos = 0;
+        return false;
+    }
+    CLOG_INFO("Resuming the upload of %s at %lld\n", _journal_path.c_str(), _cur_pos);
+    // what the server already has goes into the checksum from disk
+    _content->digest_to(_cur_pos);
+    return true;
+}
+
+void FileUploadRequest::_prepare_resume(long long total) {
     clear();
-    int cur_pos = 0;
     _read_hook = NULL;
     _read_context = NULL;
     _header["Content-Length"] = "0";
-    _header["Content-Range"] = "bytes */" + VarString::itos(_content->get_length());
-    request();
+    _header["Content-Range"] = "bytes */" + (total < 0 ? std::string("*") : SizeHelper::itos(total));
+}
+
+long long FileUploadRequest::_resumed(long long total) {
+    long long cur_pos = 0;
     if ( _resp.status() == 308) {
+        // no Range header means nothing was persisted yet
         std::string range = _resp.get_header("Range");
-        cur_pos = atoi(VarString::split(range, "-")[1].c_str());
+        if (range != "") {
+            cur_pos = SizeHelper::range_end(range) + 1;
+        }
+    } else if (_resp.status() == 200 || _resp.status() == 201) {
+        // the upload went through, only its response got lost
+        cur_pos = total;
     } else {
         GoogleJsonResponseException exc = make_json_exception(_resp.content());
         throw exc;
     }
-    _read_hook = FileContent::resumable_read;
-    _read_context = (void*)_content;
     return cur_pos;
 }
 
-GFile FileUploadRequest::execute() {
-    int upload_type = -1;
-    std::set<std::string> fields = _resource->get_modified_fields();
-    if (fields.size() == 0 ) {
-        if ( _resumable == true || _content->get_length() >= RESUMABLE_THRESHOLD) {
-            upload_type = 2;
-            _query["uploadType"] = "resumable";
-        } else {
-            upload_type = 0;
-            _query["uploadType"] = "media";
+bool FileUploadRequest::_start_chunks(bool resumed) {
+    // Step 3 - Upload the file, a chunk at a time unless it fits into one
+    if (_adaptive) {
+        if (_chunk_size < _min_chunk_size) _chunk_size = _min_chunk_size;
+        if (_chunk_size > _max_chunk_size) _chunk_size = _max_chunk_size;
+    }
+    _stats = UploadStats();
+    _pipeline.reset();
+    _buffer.clear();
+    _buffer_start = 0;
+    _session_start = std::chrono::steady_clock::now();
+    if (!_content->seekable()) {
+        _file_length = -1;
+        _stats.total = -1;
+        return false;
+    }
+    _file_length = _content->get_length();
+    _stats.total = _file_length;
+    // mapped content is already in memory, there is nothing to read ahead
+    if (_pipelined && _file_length > _chunk_size && _content->data() == NULL) {
+        _pipeline.reset(new ChunkPipeline(_content, UPLOAD_PIPELINE_BLOCK_SIZE, _pipeline_depth));
+    }
+    // the server may have had it all already
+    if (resumed && _resp.status() != 308) {
+        _report(_file_length, 0, 0, 0);
+        return true;
+    }
+    return false;
+}
+
+void FileUploadRequest::_prepare_chunk() {
+    if (!_content->seekable()) {
+        _prepare_stream_chunk();
+        return;
+    }
+    clear();
+    long long cur_length = _file_length - _cur_pos > _chunk_size ? _chunk_size : _file_length - _cur_pos;
+    _chunk_start = _cur_pos;
+    _chunk_length = cur_length;
+    if (_content->data() != NULL) {
+        set_body_view(_content->data() + _cur_pos, cur_length);
+        set_progress_hook(_release_sent, this);
+    } else if (_pipeline) {
+        _pipeline->set_range(_cur_pos, cur_length);
+        _read_hook = ChunkPipeline::read;
+        _read_context = (void*)_pipeline.get();
+    } else {
+        _read_hook = FileContent::resumable_read;
+        _read_context = (void*)_content;
+    }
+    _header["Content-Length"] = SizeHelper::itos(cur_length);
+    _header["Content-Type"] = _content->mimetype();
+    _header["Content-Range"] = "bytes " + SizeHelper::itos(_cur_pos) + "-" + SizeHelper::itos(_cur_pos + cur_length -1 ) + "/" + SizeHelper::itos(_file_length);
+    CLOG_DEBUG("Sending out from %lld - %lld/%lld\n", _cur_pos, _cur_pos + cur_length - 1, _file_length);
+    _sent_at = std::chrono::steady_clock::now();
+}
+
+void FileUploadRequest::_prepare_stream_chunk() {
+    clear();
+    while (_file_length < 0 && (long long)_buffer.size() < _chunk_size) {
+        size_t have = _buffer.size();
+        _buffer.resize(_chunk_size);
+        long long n = _content->read_next(&_buffer[have], _chunk_size - have);
+        _buffer.resize(have + (n > 0 ? n : 0));
+        if (n < 0) {
+            throw UploadException("Can't read the upload source at " + SizeHelper::itos(_buffer_start + have));
+        }
+        if (n == 0) {
+            _file_length = _buffer_start + _buffer.size();
+            _stats.total = _file_length;
         }
+    }
+
+    long long cur_length = (long long)_buffer.size() > _chunk_size ? _chunk_size : _buffer.size();
+    std::string length = _file_length < 0 ? "*" : SizeHelper::itos(_file_length);
+    _chunk_start = _buffer_start;
+    _chunk_length = cur_length;
+    if (cur_length > 0) {
+        set_body_view(_buffer.data(), cur_length);
+        _header["Content-Range"] = "bytes " + SizeHelper::itos(_buffer_start) + "-" + SizeHelper::itos(_buffer_start + cur_length - 1) + "/" + length;
     } else {
-        if ( _resumable == true || _content->get_length() >= RESUMABLE_THRESHOLD) {
-            upload_type = 2;
-            _query["uploadType"] = "resumable";
-        } else {
-            upload_type = 1;
-            _query["uploadType"] = "multipart";
+        // the stream ended on a chunk boundary, only its length is left to tell
+        _header["Content-Range"] = "bytes */" + length;
+    }
+    _header["Content-Length"] = SizeHelper::itos(cur_length);
+    _header["Content-Type"] = _content->mimetype();
+    CLOG_DEBUG("Sending out stream from %lld - %lld/%s\n", _buffer_start, _buffer_start + cur_length - 1, length.c_str());
+    _sent_at = std::chrono::steady_clock::now();
+}
+
+bool FileUploadRequest::_chunk_timed_out(std::exception_ptr error) {
+    bool timeout = false;
+    if (error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (CurlException& e) {
+            if (_pipeline && _pipeline->error() != "") {
+                throw UploadException(_pipeline->error());
+            }
+            if (e.code() != CURLE_OPERATION_TIMEDOUT) {
+                throw;
+            }
+            timeout = true;
         }
     }
+    _read_hook = NULL;
+    _read_context = NULL;
+    set_progress_hook(NULL, NULL);
+    return timeout;
+}
 
-    if (upload_type == 0) { // simple upload
-        _read_hook = FileContent::read;
-        _read_context = (void*)_content;
-        _header["Content-Type"] = _content->mimetype();
-        _header["Content-Length"] = VarString::itos(_content->get_length());
+bool FileUploadRequest::_send_chunk() {
+    std::exception_ptr error;
+    try {
         request();
-        if ((_type == UT_CREATE && _resp.status() != 200) || (_type == UT_UPDATE && _resp.status() != 201)) {
-            GoogleJsonResponseException exc = make_json_exception(_resp.content());
-            throw exc;
+    } catch (...) {
+        error = std::current_exception();
+    }
+    return _chunk_timed_out(error);
+}
+
+ChunkOutcome FileUploadRequest::_chunk_sent(bool timeout) {
+    std::chrono::steady_clock::time_point chunk_end = std::chrono::steady_clock::now();
+    _chunk_seconds = std::chrono::duration<double>(chunk_end - _sent_at).count();
+    _session_seconds = std::chrono::duration<double>(chunk_end - _session_start).count();
+    _track_chunk(_chunk_length);
+    if (!_content->seekable()) {
+        return _stream_chunk_sent(timeout);
+    }
+
+    if (timeout || _resp.status() >= 500) {
+        // resume an interrupted upload with smaller chunks
+        CLOG_WARN("Chunk at %lld failed after %.3fs, resuming\n", _cur_pos, _chunk_seconds);
+        _adapt_chunk_size(_chunk_seconds, true);
+        _prev_pos = _cur_pos;
+        return CO_RESUME;
+    } else if (_resp.status() == 308) {
+        CLOG_DEBUG("Resumabled\n");
+        std::string range = _resp.get_header("Range");
+        long long prev_pos = _cur_pos;
+        _cur_pos = SizeHelper::range_end(range) + 1;
+        _content->release(_cur_pos);
+        _report(_cur_pos, _cur_pos - prev_pos, _chunk_seconds, _session_seconds);
+        _adapt_chunk_size(_chunk_seconds, false);
+        return CO_NEXT;
+    } else if (_resp.status() == 200 || _resp.status() == 201) {
+        _content->release(_file_length);
+        _report(_file_length, _file_length - _cur_pos, _chunk_seconds, _session_seconds);
+        return CO_DONE;
+    }
+    GoogleJsonResponseException exc = make_json_exception(_resp.content());
+    throw exc;
+}
+
+ChunkOutcome FileUploadRequest::_stream_chunk_sent(bool timeout) {
+    if (timeout || _resp.status() >= 500) {
+        CLOG_WARN("Chunk at %lld failed after %.3fs, resuming\n", _buffer_start, _chunk_seconds);
+        _adapt_chunk_size(_chunk_seconds, true);
+        _prev_pos = _buffer_start;
+        return CO_RESUME;
+    } else if (_resp.status() == 308) {
+        long long acked = SizeHelper::range_end(_resp.get_header("Range")) + 1;
+        _report(acked, acked - _buffer_start, _chunk_seconds, _session_seconds);
+        _adapt_chunk_size(_chunk_seconds, false);
+        _confirm_stream(acked);
+        return CO_NEXT;
+    } else if (_resp.status() == 200 || _resp.status() == 201) {
+        _report(_file_length, _file_length - _buffer_start, _chunk_seconds, _session_seconds);
+        return CO_DONE;
+    }
+    GoogleJsonResponseException exc = make_json_exception(_resp.content());
+    throw exc;
+}
+
+bool FileUploadRequest::_chunk_resumed() {
+    long long acked = _resumed(_file_length);
+    if (_resp.status() != 308) {
+        if (_content->seekable()) {
+            _content->release(_file_length);
         }
-    } else if (upload_type == 1) { // multipart upload
-        _json_encode_body();
-        std::string boundary = _generate_boundary();
-        _header["Content-Type"] = "multipart/related; boundary=\"" + boundary + "\"";
-
-        _body = "--" + boundary + "\n"
-              + "Content-Type: application/json" + "\n\n"
-              + _body + "\n"
-              + "--" + boundary + "\n"
-              + "Content-Type: " + _content->mimetype() + "\n\n"
-              + _content->get_content() + "\n"
-              + "--" + boundary + "--";
-        _header["Content-Length"] = VarString::itos(_body.size());
+        _report(_file_length, _file_length - _prev_pos, _chunk_seconds, _session_seconds);
+        return true;
+    }
+    if (_content->seekable()) {
+        _cur_pos = acked;
+    } else {
+        _confirm_stream(acked);
+    }
+    return false;
+}
+
+void FileUploadRequest::_confirm_stream(long long acked) {
+    if (acked < _buffer_start || acked > _buffer_start + (long long)_buffer.size()) {
+        throw UploadException("Server confirmed " + SizeHelper::itos(acked) + " bytes, the stream only keeps "
+                              + SizeHelper::itos(_buffer_start) + " - " + SizeHelper::itos(_buffer_start + _buffer.size()));
+    }
+    _buffer.erase(0, acked - _buffer_start);
+    _buffer_start = acked;
+}
+
+void FileUploadRequest::_finish_chunks() {
+    _pipeline.reset();
+    _buffer.clear();
+    if (_journal != NULL) {
+        _journal->remove(_journal_path);
+    }
+}
+
+void FileUploadRequest::_track_chunk(long long length) {
+    _stats.chunk_size = length;
+    if (_stats.min_chunk_size == 0 || length < _stats.min_chunk_size) _stats.min_chunk_size = length;
+    if (length > _stats.max_chunk_size) _stats.max_chunk_size = length;
+}
+
+void FileUploadRequest::_resumable_upload() {
+    _cur_pos = 0;
+    UploadSession session;
+    bool resumed = false;
+    if (_journaled_session(session)) {
+        _prepare_reopen(session);
         request();
-        if ((_type == UT_CREATE && _resp.status() != 200) || (_type == UT_UPDATE && _resp.status() != 201)) {
-            GoogleJsonResponseException exc = make_json_exception(_resp.content());
-            throw exc;
-        }
+        resumed = _session_reopened();
+    }
+    if (!resumed) {
+        _prepare_session();
+        request();
+        _session_opened();
+    }
 
-    } else {
-        // Step 1 - Start a resumable session
-        _header["X-Upload-Content-Type"] = _content->mimetype();
-        _header["X-Upload-Content-Length"] = VarString::itos(_content->get_length());
-        if (fields.size() != 0) {
-            _json_encode_body();
+    bool done = _start_chunks(resumed);
+    while (!done) {
+        _prepare_chunk();
+        ChunkOutcome outcome = _chunk_sent(_send_chunk());
+        if (outcome == CO_RESUME) {
+            _prepare_resume(_file_length);
+            request();
+            done = _chunk_resumed();
+        } else {
+            done = outcome == CO_DONE;
         }
-        request();
-        
-        // Step 2 - Save the resumable session URI
-        if (_resp.status() != 200)  {
-            GoogleJsonResponseException exc = make_json_exception(_resp.content());
-            throw exc;
-        }
-
-        std::string location = _resp.get_header("Location");
-
-        // Prepare for step 3
-        set_uri(location);
-        _method = RM_PUT;
-
-        // Step 3 - Upload the file
-        int file_length = _content->get_length();
-        if (_content->get_length() > RESUMABLE_CHUNK_SIZE) { // Uploading the file in chunks
-            int cur_pos = 0;
-            while (true) {
-                clear();
-                int cur_length = file_length - cur_pos > RESUMABLE_CHUNK_SIZE ? RESUMABLE_CHUNK_SIZE : file_length - cur_pos;
-                _header["Content-Length"] = VarString::itos(cur_length);
-                _header["Content-Type"] = _content->mimetype();
-                _header["Content-Range"] = "bytes " + VarString::itos(cur_pos) + "-" + VarString::itos(cur_pos + cur_length -1 ) + "/" + VarString::itos(file_length);
-                _content->set_resumable_start_pos(cur_pos);
-                _content->set_resumable_length(cur_length);
-                _read_hook = FileContent::resumable_read;
-                _read_context = (void*)_content;
-                CLOG_DEBUG("Sending out from %d - %d/%d\n", cur_pos, cur_pos + cur_length - 1, file_length);
-                request();
-                
-                if (_resp.status() == 308) {
-                    CLOG_DEBUG("Resumabled\n");
-                    std::string range = _resp.get_header("Range");
-                    cur_pos = atoi(VarString::split(range, "-")[1].c_str()) + 1;
-                } else if (_resp.status() == 200 || _resp.status() == 201) {
-                    break;
-                } else if (_resp.status() >= 500) {
-                    // resume an interrupted upload
-                    cur_pos = _resume();
-                } else {
-                    GoogleJsonResponseException exc = make_json_exception(_resp.content());
-                    throw exc;
-                }
+    }
+    _finish_chunks();
+}
+
+void FileUploadRequest::_resumable_upload_async(RequestCallback callback) {
+    _cur_pos = 0;
+    UploadSession session;
+    if (!_journaled_session(session)) {
+        _open_session_async(callback);
+        return;
+    }
+    _prepare_reopen(session);
+    CredentialHttpRequest::request_async([this, callback](std::exception_ptr error) {
+        bool done;
+        try {
+            if (error) {
+                std::rethrow_exception(error);
             }
-        } else { // Uploading the file completely in one request
-            int cur_pos;
-            while(true) {
-                clear();
-                _header["Content-Length"] = VarString::itos(_content->get_length());
-                _header["Content-Type"] = _content->mimetype();
-                _content->set_resumable_start_pos(cur_pos);
-                _content->set_resumable_length(file_length - cur_pos);
-                _read_hook = FileContent::resumable_read;
-                _read_context = (void*)_content;
-                request();
-                _read_hook = NULL;
-                _read_context = NULL;
-                if (_resp.status() == 200 || _resp.status() == 201) {
-                    break;
-                } else if (_resp.status() >= 500 ){
-                    // resume an interrupted upload
-                    cur_pos = _resume();
-                } else {
-                    GoogleJsonResponseException exc = make_json_exception(_resp.content());
-                    throw exc;
-                }
+            if (!_session_reopened()) {
+                _open_session_async(callback);
+                return;
             }
+            done = _start_chunks(true);
+        } catch (...) {
+            callback(std::current_exception());
+            return;
+        }
+        if (done) {
+            _finish_chunks();
+            callback(std::exception_ptr());
+        } else {
+            _next_chunk_async(callback);
         }
+    });
+}
+
+void FileUploadRequest::_open_session_async(RequestCallback callback) {
+    _prepare_session();
+    CredentialHttpRequest::request_async([this, callback](std::exception_ptr error) {
+        try {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            _session_opened();
+            _start_chunks(false);
+        } catch (...) {
+            callback(std::current_exception());
+            return;
+        }
+        _next_chunk_async(callback);
+    });
+}
+
+void FileUploadRequest::_next_chunk_async(RequestCallback callback) {
+    try {
+        _prepare_chunk();
+    } catch (...) {
+        callback(std::current_exception());
+        return;
     }
-    GFile _1 = *_resource;
-    this->get_resource(_1);
-    return _1;
+    CredentialHttpRequest::request_async([this, callback](std::exception_ptr error) {
+        ChunkOutcome outcome;
+        try {
+            outcome = _chunk_sent(_chunk_timed_out(error));
+        } catch (...) {
+            callback(std::current_exception());
+            return;
+        }
+        if (outcome == CO_NEXT) {
+            _next_chunk_async(callback);
+            return;
+        }
+        if (outcome == CO_DONE) {
+            _finish_chunks();
+            callback(std::exception_ptr());
+            return;
+        }
+        _prepare_resume(_file_length);
+        CredentialHttpRequest::request_async([this, callback](std::exception_ptr error) {
+            bool done;
+            try {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                done = _chunk_resumed();
+            } catch (...) {
+                callback(std::current_exception());
+                return;
+            }
+            if (done) {
+                _finish_chunks();
+                callback(std::exception_ptr());
+            } else {
+                _next_chunk_async(callback);
+            }
+        });
+    });
 }
 
 }
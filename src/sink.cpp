@@ -0,0 +1,151 @@
+#include "gdrive/sink.hpp"
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace JCONER;
+
+#define ITEMS_DEPTH 2
+
+namespace GDRIVE {
+
+size_t FdSink::write(void* ptr, size_t size, size_t nmemb, void* userp) {
+    FdSink* self = (FdSink*)userp;
+    size_t length = size * nmemb;
+    const char* buf = (const char*)ptr;
+    size_t done = 0;
+    size_t allowed = length;
+    if (self->_limit >= 0 && self->_written + (long long)length > self->_limit) {
+        CLOG_ERROR("Response is larger than %lld bytes\n", self->_limit);
+        allowed = self->_limit - self->_written;
+    }
+    while (done < allowed) {
+        ssize_t n;
+        if (self->_offset >= 0) {
+            n = pwrite(self->_fd, buf + done, allowed - done, self->_offset + self->_written);
+        } else {
+            n = ::write(self->_fd, buf + done, allowed - done);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            CLOG_ERROR("Failed to write response to fd %d: %s\n", self->_fd, strerror(errno));
+            // a short count makes curl abort the transfer
+            return done;
+        }
+        done += n;
+        self->_written += n;
+    }
+    // short of length if the limit cut the body, which aborts the transfer
+    return done;
+}
+
+size_t MmapSink::write(void* ptr, size_t size, size_t nmemb, void* userp) {
+    MmapSink* self = (MmapSink*)userp;
+    size_t length = size * nmemb;
+    if (length > self->_length - self->_pos) {
+        CLOG_ERROR("Response is larger than the mapped region[%ld]\n", (long)self->_length);
+        return 0;
+    }
+    memcpy(self->_region + self->_pos, ptr, length);
+    self->_pos += length;
+    return length;
+}
+
+JsonItemSink::JsonItemSink(JsonItemFunction callback, void* context)
+    :_callback(callback), _context(context), _after_colon(false), _depth(0), _in_string(false),
+     _escape(false), _in_items(false), _capturing(false), _items(0)
+{
+}
+
+size_t JsonItemSink::write(void* ptr, size_t size, size_t nmemb, void* userp) {
+    JsonItemSink* self = (JsonItemSink*)userp;
+    const char* buf = (const char*)ptr;
+    size_t length = size * nmemb;
+    for (size_t i = 0; i < length; i ++) {
+        self->_feed(buf[i]);
+    }
+    return length;
+}
+
+void JsonItemSink::_feed(char c) {
+    std::string& out = _capturing ? _capture : _envelope;
+
+    if (_in_string) {
+        out += c;
+        if (_escape) {
+            _escape = false;
+        } else if (c == '\\') {
+            _escape = true;
+        } else if (c == '"') {
+            _in_string = false;
+            if (_depth == 1) _last_string = _string;
+        } else if (_depth == 1) {
+            _string += c;
+        }
+        return;
+    }
+
+    if (_in_items && !_capturing && _depth == ITEMS_DEPTH) {
+        // between two elements of the items array, only whitespace and commas
+        if (c == '{') {
+            _capturing = true;
+            _capture = "{";
+            _depth ++;
+        } else if (c == ']') {
+            _in_items = false;
+            _depth --;
+            _envelope += c;
+        }
+        return;
+    }
+
+    out += c;
+    // a top-level string is a key only if a colon follows it, "items" can be a value too
+    bool value = false;
+    if (_depth == 1 && !isspace((unsigned char)c)) {
+        if (c == ':') {
+            _key = _last_string;
+            _after_colon = true;
+        } else {
+            value = _after_colon;
+            _after_colon = false;
+        }
+    }
+    if (c == '"') {
+        _in_string = true;
+        _string.clear();
+    } else if (c == '{' || c == '[') {
+        if (c == '[' && _depth == 1 && value && _key == "items") {
+            _in_items = true;
+        }
+        _depth ++;
+    } else if (c == '}' || c == ']') {
+        _depth --;
+        if (_capturing && _depth == ITEMS_DEPTH) {
+            _emit();
+        }
+    }
+}
+
+void JsonItemSink::_emit() {
+    _capturing = false;
+    PError error;
+    JObject* item = (JObject*)loads(_capture, error);
+    _capture.clear();
+    if (item == NULL) {
+        CLOG_WARN("Failed to parse list item\n");
+        return;
+    }
+    _items ++;
+    _callback(item, _context);
+    delete item;
+}
+
+JObject* JsonItemSink::envelope() {
+    PError error;
+    return (JObject*)loads(_envelope, error);
+}
+
+}
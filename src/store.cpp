@@ -35,7 +35,12 @@ FileStore::FileStore(std::string filename)
     }
 }
 
+FileStore::~FileStore() {
+    flush();
+}
+
 std::string FileStore::get(std::string key) {
+    std::lock_guard<std::mutex> lock(_mutex);
     if (_content.find(key) != _content.end()) {
         return _content[key];
     }
@@ -43,20 +48,130 @@ std::string FileStore::get(std::string key) {
 }
 
 void FileStore::put(std::string key, std::string value) {
+    std::lock_guard<std::mutex> lock(_mutex);
     _content[key] = value;
 }
 
 bool FileStore::dump() {
-    std::ofstream fout(_filename.c_str());
-    if (!fout.good()) {
+    // the content is taken under the write lock, so a later write never has older content
+    std::lock_guard<std::mutex> write_lock(_write_mutex);
+    VarString vs;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(std::map<std::string, std::string>::iterator iter = _content.begin();
+                iter != _content.end(); iter ++) {
+            vs.append(iter->first).append('=').append(iter->second).append('\n');
+        }
+    }
+    if (!FileHelper::write_atomic(_filename, vs.toString(), 0600)) {
+        CLOG_ERROR("Can't write the store to %s\n", _filename.c_str());
         return false;
     }
+    return true;
+}
+
+void FileStore::dump_async() {
+    if (!StoreWriter::alive()) {
+        dump();
+        return;
+    }
+    StoreWriter::get_instance().schedule(this);
+}
 
-    for(std::map<std::string, std::string>::iterator iter = _content.begin();
-            iter != _content.end(); iter ++) {
-        fout << iter->first << "=" << iter->second << std::endl;
+bool FileStore::flush() {
+    // a writer that is gone wrote everything it had before it stopped
+    if (!StoreWriter::alive()) {
+        return true;
+    }
+    if (StoreWriter::get_instance().remove(this)) {
+        return dump();
     }
     return true;
 }
 
+std::atomic<bool> StoreWriter::_alive(false);
+StoreWriter StoreWriter::_single_instance;
+
+StoreWriter::StoreWriter()
+    :_writing(NULL), _started(false), _stopping(false)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("StoreWriter", L_DEBUG)
+#endif
+    _alive = true;
+}
+
+StoreWriter::~StoreWriter() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_started) {
+        _stopping = true;
+        _wakeup.notify_all();
+        lock.unlock();
+        // the thread writes what is left before it stops
+        _thread.join();
+    }
+    _alive = false;
+}
+
+void StoreWriter::schedule(FileStore* store) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats.scheduled ++;
+    if (!_started) {
+        _started = true;
+        _thread = std::thread(&StoreWriter::_run, this);
+    }
+    if (_queued.insert(store).second) {
+        _queue.push_back(store);
+        _wakeup.notify_one();
+    }
+}
+
+void StoreWriter::_run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _wakeup.wait(lock, [this]() { return !_queue.empty() || _stopping; });
+        if (_queue.empty()) {
+            return;
+        }
+        FileStore* store = _queue.front();
+        _queue.pop_front();
+        _queued.erase(store);
+        _writing = store;
+        lock.unlock();
+
+        bool ok = store->dump();
+
+        lock.lock();
+        _writing = NULL;
+        if (ok) {
+            _stats.written ++;
+        } else {
+            _stats.failed ++;
+        }
+        _idle.notify_all();
+    }
+}
+
+void StoreWriter::flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]() { return _queue.empty() && _writing == NULL; });
+}
+
+bool StoreWriter::remove(FileStore* store) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    bool queued = _queued.erase(store) > 0;
+    if (queued) {
+        _queue.remove(store);
+        // a flush may be waiting for the queue to run empty
+        _idle.notify_all();
+    }
+    _idle.wait(lock, [this, store]() { return _writing != store; });
+    return queued;
+}
+
+StoreWriterStats StoreWriter::stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
 }
@@ -0,0 +1,267 @@
+#include "gdrive/upload.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <curl/curl.h>
+#include <sys/stat.h>
+
+namespace GDRIVE {
+
+void MultipartReader::reset(std::string preamble, FileContent* content, std::string epilogue) {
+    _preamble = preamble;
+    _content = content;
+    _epilogue = epilogue;
+    _pos = 0;
+}
+
+long long MultipartReader::length() {
+    return _preamble.size() + _content->get_length() + _epilogue.size();
+}
+
+size_t MultipartReader::read(void* ptr, size_t size, size_t nmemb, void* userp) {
+    FUNC_MAKE_LOGGER
+
+    MultipartReader* self = (MultipartReader*)userp;
+    char* out = (char*)ptr;
+    size_t room = size * nmemb;
+    size_t done = 0;
+    long long content_end = self->_preamble.size() + self->_content->get_length();
+
+    while (done < room) {
+        long long pos = self->_pos;
+        long long n;
+        if (pos < (long long)self->_preamble.size()) {
+            n = std::min((long long)(room - done), (long long)self->_preamble.size() - pos);
+            memcpy(out + done, self->_preamble.data() + pos, n);
+        } else if (pos < content_end) {
+            long long offset = pos - self->_preamble.size();
+            n = std::min((long long)(room - done), content_end - pos);
+            n = self->_content->read_at(offset, out + done, n);
+            if (n <= 0) {
+                FLOG_ERROR("Upload content ended at %lld of %lld\n", offset, self->_content->get_length());
+                return CURL_READFUNC_ABORT;
+            }
+            self->_content->digest(offset, out + done, n);
+            self->_content->release(offset + n);
+        } else if (pos < self->length()) {
+            n = std::min((long long)(room - done), self->length() - pos);
+            memcpy(out + done, self->_epilogue.data() + (pos - content_end), n);
+        } else {
+            break;
+        }
+        done += n;
+        self->_pos += n;
+    }
+    return done;
+}
+
+ChunkPipeline::ChunkPipeline(FileContent* content, int block_size, int depth)
+    :_content(content), _block_size(block_size), _next(0), _stopping(false), _range_start(0), _range_length(0),
+     _cursor(0), _remaining(0)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("ChunkPipeline", L_DEBUG)
+#endif
+    _length = _content->get_length();
+    if (depth < 2) depth = 2;
+    _spare.resize(depth);
+    for (size_t i = 0; i < _spare.size(); i ++) {
+        _spare[i].reserve(_block_size);
+    }
+    _start(0);
+}
+
+ChunkPipeline::~ChunkPipeline() {
+    _stop();
+}
+
+void ChunkPipeline::_start(long long pos) {
+    _next = pos;
+    _stopping = false;
+    _error.clear();
+    _reader = std::thread(&ChunkPipeline::_read_loop, this);
+}
+
+void ChunkPipeline::_stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _cond.notify_all();
+    if (_reader.joinable()) {
+        _reader.join();
+    }
+    while (!_ready.empty()) {
+        _spare.push_back(std::string());
+        _spare.back().swap(_ready.front().data);
+        _ready.pop_front();
+    }
+}
+
+void ChunkPipeline::_read_loop() {
+    while (true) {
+        std::string buffer;
+        long long offset;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (!_stopping && _spare.empty()) {
+                _cond.wait(lock);
+            }
+            if (_stopping || _next >= _length) return;
+            buffer.swap(_spare.back());
+            _spare.pop_back();
+            offset = _next;
+        }
+
+        long long n = _length - offset < _block_size ? _length - offset : _block_size;
+        buffer.resize(n);
+        long long got = _content->read_at(offset, &buffer[0], n);
+        if (got == n) {
+            // hashing here keeps it off the thread that feeds curl
+            _content->digest(offset, buffer.data(), n);
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (got != n) {
+            _error = "short read at " + SizeHelper::itos(offset) + " of upload content";
+            _spare.push_back(std::string());
+            _spare.back().swap(buffer);
+            _cond.notify_all();
+            return;
+        }
+        _ready.push_back(Block());
+        _ready.back().offset = offset;
+        _ready.back().data.swap(buffer);
+        _next = offset + n;
+        _cond.notify_all();
+    }
+}
+
+void ChunkPipeline::set_range(long long pos, long long length) {
+    _range_start = pos;
+    _range_length = length;
+    rewind();
+}
+
+void ChunkPipeline::rewind() {
+    // blocks already handed back are read again by data_at
+    _cursor = _range_start;
+    _remaining = _range_length;
+    _read_error.clear();
+}
+
+size_t ChunkPipeline::read(void* ptr, size_t size, size_t nmemb, void* userp) {
+    ChunkPipeline* self = (ChunkPipeline*)userp;
+    if (self->_remaining == 0) return 0;
+
+    long long available;
+    const char* data;
+    try {
+        data = self->data_at(self->_cursor, available);
+    } catch (UploadException& e) {
+        // exceptions can't cross curl, the uploader picks the error up afterwards
+        self->_read_error = e.error();
+        return CURL_READFUNC_ABORT;
+    }
+    if (data == NULL) {
+        self->_read_error = "upload content ended early";
+        return CURL_READFUNC_ABORT;
+    }
+    long long length = size * nmemb;
+    if (length > available) length = available;
+    if (length > self->_remaining) length = self->_remaining;
+    memcpy(ptr, data, length);
+    self->_cursor += length;
+    self->_remaining -= length;
+    return length;
+}
+
+const char* ChunkPipeline::data_at(long long pos, long long& length) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        // blocks before pos are acknowledged, their buffers go back to the reader
+        while (!_ready.empty() && _ready.front().offset + (long long)_ready.front().data.size() <= pos) {
+            _spare.push_back(std::string());
+            _spare.back().swap(_ready.front().data);
+            _ready.pop_front();
+            _cond.notify_all();
+        }
+
+        if (!_ready.empty() && _ready.front().offset <= pos) {
+            Block& block = _ready.front();
+            length = block.offset + block.data.size() - pos;
+            return block.data.data() + (pos - block.offset);
+        }
+        if (pos >= _length) {
+            length = 0;
+            return NULL;
+        }
+        if (!_error.empty()) {
+            throw UploadException(_error);
+        }
+        if (!_ready.empty() || pos != _next) {
+            // the server kept less than what was sent before the buffered window, read again from pos
+            CLOG_DEBUG("Restarting read ahead at %lld\n", pos);
+            lock.unlock();
+            _stop();
+            _start(pos);
+            lock.lock();
+            continue;
+        }
+        _cond.wait(lock);
+    }
+}
+
+UploadJournal::UploadJournal(Store* store)
+    :_store(store)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("UploadJournal", L_DEBUG)
+#endif
+}
+
+bool UploadJournal::load(std::string path, UploadSession& session) {
+    std::string value;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        value = _store->get(UPLOAD_SESSION_PREFIX + path);
+    }
+    // size mtime uri
+    size_t first = value.find(' ');
+    size_t second = first == std::string::npos ? first : value.find(' ', first + 1);
+    if (second == std::string::npos) {
+        return false;
+    }
+    session.size = SizeHelper::stoll(value.substr(0, first));
+    session.mtime = SizeHelper::stoll(value.substr(first + 1, second - first - 1));
+    session.uri = value.substr(second + 1);
+    return session.uri != "";
+}
+
+void UploadJournal::save(std::string path, UploadSession& session) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _store->put(UPLOAD_SESSION_PREFIX + path, SizeHelper::itos(session.size) + " "
+                + SizeHelper::itos(session.mtime) + " " + session.uri);
+    if (!_store->dump()) {
+        CLOG_WARN("Can't save the upload session of %s\n", path.c_str());
+    }
+}
+
+void UploadJournal::remove(std::string path) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_store->get(UPLOAD_SESSION_PREFIX + path) == "") return;
+    _store->put(UPLOAD_SESSION_PREFIX + path, "");
+    _store->dump();
+}
+
+bool UploadJournal::current(std::string path, UploadSession& session) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    session.size = st.st_size;
+    session.mtime = st.st_mtime;
+    return true;
+}
+
+}
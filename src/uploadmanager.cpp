@@ -0,0 +1,330 @@
+#include "gdrive/uploadmanager.hpp"
+#include "gdrive/error.hpp"
+
+namespace GDRIVE {
+
+UploadManager::UploadManager(Credential* cred, int workers)
+    :_cred(cred), _workers(workers < 1 ? 1 : workers), _large_size(RESUMABLE_THRESHOLD), _batch_files(0),
+     _batch_file_size(UPLOAD_BATCH_FILE_SIZE), _upload_uri(FILE_UPLOAD_URL), _dedup(NULL),
+     _dedup_action(DA_COPY), _stopping(false),
+     _next_id(0), _running(0), _running_large(0), _running_bytes(0), _started(false)
+{
+#ifdef GDRIVE_DEBUG
+    CLASS_INIT_LOGGER("UploadManager", L_DEBUG)
+#endif
+}
+
+UploadManager::~UploadManager() {
+    shutdown();
+}
+
+void UploadManager::set_batching(int max_files, long long max_file_size) {
+    if (max_files > BATCH_MAX_REQUESTS) {
+        CLOG_WARN("Wrong batch size[%d], using %d\n", max_files, BATCH_MAX_REQUESTS);
+        max_files = BATCH_MAX_REQUESTS;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _batch_files = max_files;
+    _batch_file_size = max_file_size;
+    if (_batch_files > 1 && _batch_uri == "") {
+        CLOG_WARN("Drive's batch endpoint doesn't take uploads, batching waits for set_batch_uri\n");
+    }
+}
+
+void UploadManager::set_batch_uri(std::string uri) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _batch_uri = uri;
+}
+
+int UploadManager::add(GFile file, FileContent* content, UploadJobCallback callback) {
+    long long size = content->get_length();
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_stopping) {
+        throw UploadException("The upload manager is shut down");
+    }
+    int id = _next_id ++;
+    Job& job = _jobs[id];
+    job.file = file;
+    job.content = content;
+    job.callback = callback;
+    job.status.id = id;
+    job.status.size = size;
+    if (_large(size)) {
+        _large_queue.insert(std::make_pair(size, id));
+    } else {
+        _small.insert(std::make_pair(size, id));
+    }
+
+    if (!_started) {
+        _started = true;
+        _start = std::chrono::steady_clock::now();
+    }
+    if (_threads.empty()) {
+        for (int i = 0; i < _workers; i ++) {
+            _threads.push_back(std::thread(&UploadManager::_run, this));
+        }
+    }
+    _work.notify_one();
+    return id;
+}
+
+int UploadManager::_next_job() {
+    // one large file keeps going however many small ones arrive, and one
+    // worker stays free for small files however many large ones are queued
+    bool take_large = !_large_queue.empty()
+        && (_running_large == 0 || _small.empty())
+        && (_running_large < _workers - 1 || _workers == 1);
+    JobQueue& queue = take_large ? _large_queue : _small;
+    if (queue.empty()) {
+        return -1;
+    }
+    int id = queue.begin()->second;
+    queue.erase(queue.begin());
+    if (take_large) {
+        _running_large ++;
+    }
+    _running ++;
+    return id;
+}
+
+void UploadManager::_next_batch(std::vector<int>& ids) {
+    // the queue is ordered by size, so the batchable jobs are at its front;
+    // the share of each worker is capped so the others get some of them too
+    size_t share = (_small.size() + ids.size() + _workers - 1) / _workers;
+    size_t limit = share < (size_t)_batch_files ? share : _batch_files;
+    while (ids.size() < limit && !_small.empty() && _batchable(_small.begin()->first)) {
+        ids.push_back(_small.begin()->second);
+        _small.erase(_small.begin());
+        _running ++;
+    }
+}
+
+void UploadManager::_run() {
+    while (true) {
+        std::vector<int> ids;
+        std::vector<GFile> files;
+        std::vector<FileContent*> contents;
+        bool large;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            int id;
+            while (!_stopping && (id = _next_job()) < 0) {
+                _work.wait(lock);
+            }
+            if (_stopping) return;
+            ids.push_back(id);
+            large = _large(_jobs[id].status.size);
+            if (!large && _batchable(_jobs[id].status.size)) {
+                _next_batch(ids);
+            }
+            for (size_t i = 0; i < ids.size(); i ++) {
+                Job& job = _jobs[ids[i]];
+                job.status.state = UJ_RUNNING;
+                files.push_back(job.file);
+                contents.push_back(job.content);
+            }
+        }
+
+        if (ids.size() == 1) {
+            _upload(ids[0], files[0], contents[0], large);
+        } else {
+            _upload_batch(ids, files, contents);
+        }
+    }
+}
+
+void UploadManager::_upload(int id, GFile& file, FileContent* content, bool large) {
+    GFile result;
+    std::exception_ptr error;
+    try {
+        // built here rather than by FileService, whose credential is shared by the whole process
+        FileInsertRequest request(content, &file, _cred, _upload_uri);
+        if (_dedup != NULL) {
+            request.set_dedup(_dedup, _dedup_action);
+        }
+        request.set_progress_callback([this, id](const UploadStats& stats) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                UploadJobStatus& status = _jobs[id].status;
+                _running_bytes += stats.sent - status.sent;
+                status.sent = stats.sent;
+            }
+            if (_progress) {
+                _progress(id, stats);
+            }
+        });
+        result = request.execute();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    _finish(id, large, result, error);
+}
+
+void UploadManager::_upload_batch(const std::vector<int>& ids, std::vector<GFile>& files, std::vector<FileContent*>& contents) {
+    std::vector<std::shared_ptr<FileInsertRequest> > requests;
+    std::vector<GFile> results(ids.size());
+    std::vector<std::exception_ptr> errors(ids.size());
+    BatchRequest batch(_cred, _batch_uri);
+    try {
+        for (size_t i = 0; i < ids.size(); i ++) {
+            requests.push_back(std::shared_ptr<FileInsertRequest>(
+                new FileInsertRequest(contents[i], &files[i], _cred, _upload_uri)));
+            if (_dedup != NULL) {
+                requests[i]->set_dedup(_dedup, _dedup_action);
+            }
+            batch.add(requests[i].get());
+        }
+        CLOG_DEBUG("Uploading %d files in one batch\n", (int)ids.size());
+        batch.execute();
+    } catch (...) {
+        // the batch as a whole failed, so did every job in it
+        std::exception_ptr error = std::current_exception();
+        for (size_t i = 0; i < ids.size(); i ++) {
+            errors[i] = error;
+        }
+    }
+    for (size_t i = 0; i < ids.size(); i ++) {
+        if (errors[i]) continue;
+        try {
+            results[i] = requests[i]->result();
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.batches ++;
+    }
+    for (size_t i = 0; i < ids.size(); i ++) {
+        _finish(ids[i], false, results[i], errors[i]);
+    }
+}
+
+void UploadManager::_finish(int id, bool large, GFile& file, std::exception_ptr error) {
+    UploadJobCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        callback = _jobs[id].callback;
+    }
+    if (callback) {
+        callback(id, file, error);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        UploadJobStatus& status = _jobs[id].status;
+        _running_bytes -= status.sent;
+        status.result = file;
+        status.error = error;
+        if (error) {
+            status.state = UJ_FAILED;
+            _stats.failed ++;
+        } else {
+            status.state = UJ_DONE;
+            if (status.size >= 0) {
+                status.sent = status.size;
+            }
+            _stats.done ++;
+            _stats.bytes += status.sent;
+        }
+        _running --;
+        if (large) {
+            _running_large --;
+        }
+    }
+    // a large job finishing can let the next one start
+    _work.notify_all();
+    _idle.notify_all();
+}
+
+UploadJobStatus UploadManager::status(int job) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::map<int, Job>::iterator iter = _jobs.find(job);
+    if (iter == _jobs.end()) {
+        return UploadJobStatus();
+    }
+    return iter->second.status;
+}
+
+UploadManagerStats UploadManager::stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    UploadManagerStats rst = _stats;
+    rst.queued = _small.size() + _large_queue.size();
+    rst.running = _running;
+    rst.bytes += _running_bytes;
+    if (_started) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+        if (seconds > 0) {
+            rst.rate = rst.bytes / seconds;
+            rst.files_per_second = rst.done / seconds;
+        }
+    }
+    return rst;
+}
+
+size_t UploadManager::queue_depth() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _small.size() + _large_queue.size();
+}
+
+void UploadManager::clear_finished() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (std::map<int, Job>::iterator iter = _jobs.begin(); iter != _jobs.end(); ) {
+        if (iter->second.status.state == UJ_DONE || iter->second.status.state == UJ_FAILED) {
+            _jobs.erase(iter ++);
+        } else {
+            iter ++;
+        }
+    }
+}
+
+void UploadManager::wait() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_running > 0 || (!_stopping && (!_small.empty() || !_large_queue.empty()))) {
+        _idle.wait(lock);
+    }
+}
+
+void UploadManager::shutdown() {
+    std::vector<std::thread> threads;
+    std::vector<int> dropped;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        threads.swap(_threads);
+        for (JobQueue::iterator iter = _small.begin(); iter != _small.end(); iter ++) {
+            dropped.push_back(iter->second);
+        }
+        for (JobQueue::iterator iter = _large_queue.begin(); iter != _large_queue.end(); iter ++) {
+            dropped.push_back(iter->second);
+        }
+        _small.clear();
+        _large_queue.clear();
+    }
+    _work.notify_all();
+
+    for (size_t i = 0; i < dropped.size(); i ++) {
+        GFile file;
+        std::exception_ptr error = std::make_exception_ptr(UploadException("The upload manager shut down before the job started"));
+        UploadJobCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            Job& job = _jobs[dropped[i]];
+            job.status.state = UJ_FAILED;
+            job.status.error = error;
+            _stats.failed ++;
+            callback = job.callback;
+        }
+        if (callback) {
+            callback(dropped[i], file, error);
+        }
+    }
+    // running jobs finish first
+    for (size_t i = 0; i < threads.size(); i ++) {
+        threads[i].join();
+    }
+    _idle.notify_all();
+}
+
+}
@@ -0,0 +1,128 @@
+#include "standin.hpp"
+#include "gdrive/util.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cassert>
+#include <thread>
+
+using namespace GDRIVE;
+
+std::string MemoryStore::get(std::string key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _content[key];
+}
+
+void MemoryStore::put(std::string key, std::string value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _content[key] = value;
+}
+
+bool Connection::fill() {
+    char tmp[65536];
+    ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+    if (n <= 0) return false;
+    buffer.append(tmp, n);
+    return true;
+}
+
+void Connection::send_all(std::string data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, 0);
+        if (n <= 0) return;
+        done += n;
+    }
+}
+
+bool Connection::read_body(size_t length, std::string& body) {
+    while (buffer.size() < length) {
+        if (!fill()) return false;
+    }
+    body = buffer.substr(0, length);
+    buffer.erase(0, length);
+    return true;
+}
+
+void Connection::reply(std::string status, std::string headers, std::string body) {
+    send_all("HTTP/1.1 " + status + "\r\n" + headers + "Content-Length: " + SizeHelper::itos(body.size())
+             + "\r\n\r\n" + body);
+}
+
+std::string parse_head(std::string head, StandInHeaders& headers) {
+    size_t pos = head.find("\r\n") + 2;
+    while (pos < head.size()) {
+        size_t eol = head.find("\r\n", pos);
+        if (eol == std::string::npos) eol = head.size();
+        std::string line = head.substr(pos, eol - pos);
+        size_t colon = line.find(':');
+        std::string key = line.substr(0, colon);
+        for (size_t i = 0; i < key.size(); i ++) key[i] = tolower(key[i]);
+        size_t value = colon == std::string::npos ? std::string::npos : line.find_first_not_of(' ', colon + 1);
+        headers[key] = value == std::string::npos ? "" : line.substr(value);
+        pos = eol + 2;
+    }
+    return head.substr(0, head.find("\r\n"));
+}
+
+StandIn::StandIn(StandInHandler handler, int backlog)
+    :_handler(handler), _accepted(0)
+{
+    _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = 0;
+    int rst = bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    assert(rst == 0);
+    rst = listen(_listen_fd, backlog);
+    assert(rst == 0);
+    socklen_t addr_len = sizeof(addr);
+    getsockname(_listen_fd, (struct sockaddr*)&addr, &addr_len);
+    _port = ntohs(addr.sin_port);
+    std::thread(&StandIn::_serve, this).detach();
+}
+
+std::string StandIn::uri(std::string path) const {
+    char base[32];
+    snprintf(base, sizeof(base), "http://127.0.0.1:%d", _port);
+    return base + path;
+}
+
+void StandIn::_serve() {
+    while (true) {
+        int fd = accept(_listen_fd, NULL, NULL);
+        if (fd < 0) return;
+        _accepted ++;
+        std::thread(&StandIn::_serve_connection, this, fd).detach();
+    }
+}
+
+void StandIn::_serve_connection(int fd) {
+    Connection conn;
+    conn.fd = fd;
+    while (true) {
+        size_t end;
+        while ((end = conn.buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (!conn.fill()) {
+                close(fd);
+                return;
+            }
+        }
+        StandInHeaders headers;
+        std::string request_line = parse_head(conn.buffer.substr(0, end + 2), headers);
+        conn.buffer.erase(0, end + 4);
+        if (headers["expect"] == "100-continue") {
+            conn.send_all("HTTP/1.1 100 Continue\r\n\r\n");
+        }
+        if (!_handler(conn, request_line, headers)) {
+            close(fd);
+            return;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef __GDRIVE_TEST_STANDIN_HPP__
+#define __GDRIVE_TEST_STANDIN_HPP__
+
+#include "gdrive/store.hpp"
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+// Keeps the tokens of a test credential in memory
+class MemoryStore : public GDRIVE::Store {
+    public:
+        std::string get(std::string key);
+        void put(std::string key, std::string value);
+        bool dump() { return true; }
+    private:
+        std::mutex _mutex;
+        std::map<std::string, std::string> _content;
+};
+
+typedef std::map<std::string, std::string> StandInHeaders;
+
+// One client connection of the stand-in, buffer holds what was received
+// and not consumed yet
+struct Connection {
+    int fd;
+    std::string buffer;
+
+    // receives more into buffer, false once the client is gone
+    bool fill();
+    void send_all(std::string data);
+    // moves the next length bytes out of buffer into body
+    bool read_body(size_t length, std::string& body);
+    // status is "200 OK" and the like, each of headers ends in \r\n
+    void reply(std::string status, std::string headers, std::string body);
+};
+
+// Parses the header lines of head into headers, with lower case keys, and
+// returns its request or status line
+std::string parse_head(std::string head, StandInHeaders& headers);
+
+// Answers one request. The head has been read, the body of Content-Length
+// bytes is still in conn and is the handler's to consume. Returning false
+// closes the connection.
+typedef std::function<bool (Connection& conn, std::string request_line, StandInHeaders& headers)> StandInHandler;
+
+// HTTP/1.1 server on a free port of 127.0.0.1 that stands in for the Drive
+// endpoints a test talks to, one thread per connection
+class StandIn {
+    public:
+        StandIn(StandInHandler handler, int backlog = 64);
+        inline int port() const { return _port; }
+        // http://127.0.0.1:port followed by path
+        std::string uri(std::string path) const;
+        // connections accepted so far
+        inline int accepted() const { return _accepted; }
+    private:
+        void _serve();
+        void _serve_connection(int fd);
+
+        StandInHandler _handler;
+        int _listen_fd;
+        int _port;
+        std::atomic<int> _accepted;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/asyncengine.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <future>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <map>
+#include <vector>
+
+using namespace GDRIVE;
+
+const int GETS = 400;
+const int UPLOADS = 50;
+const long long FILE_SIZE = 2 * RESUMABLE_CHUNK_SIZE + 1000;
+
+// State of the stand-in files and resumable upload endpoints. A file is
+// answered with its id; every upload gets a session of its own that keeps
+// the bytes it was sent.
+struct Endpoint {
+    StandIn* server;
+    std::mutex mutex;
+    int sessions;
+    std::map<std::string, long long> totals;
+    std::map<std::string, std::string> received;
+};
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::string path = request_line.substr(request_line.find(' ') + 1);
+    path = path.substr(0, path.find_first_of(" ?"));
+
+    if (path.find("/files/") == 0) {
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"kind\": \"drive#file\", \"id\": \"" + path.substr(7) + "\"}");
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    if (request_line.find("POST ") == 0) {
+        std::string session = "/session/" + SizeHelper::itos(endpoint->sessions ++);
+        endpoint->totals[session] = SizeHelper::stoll(headers["x-upload-content-length"]);
+        conn.reply("200 OK", "Location: " + endpoint->server->uri(session) + "\r\n", "");
+        return true;
+    }
+
+    std::string& received = endpoint->received[path];
+    std::string range = headers["content-range"];
+    if (SizeHelper::stoll(range.substr(range.find(' ') + 1)) != (long long)received.size()) {
+        conn.reply("400 Bad Request", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 400, \"message\": \"Unexpected chunk\"}}");
+        return true;
+    }
+    received += body;
+    if ((long long)received.size() < endpoint->totals[path]) {
+        conn.reply("308 Resume Incomplete", "Range: bytes=0-" + SizeHelper::itos(received.size() - 1) + "\r\n", "");
+    } else {
+        MD5 md5;
+        md5.update(received.data(), received.size());
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"id\": \"upload" + path.substr(9) + "\", \"md5Checksum\": \"" + md5.hexdigest() + "\"}");
+    }
+    return true;
+}
+
+// Collects what the completion callbacks saw
+struct Results {
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+    int done;
+    int failed;
+    std::string nested;
+    std::promise<void> finished;
+};
+
+void completed(Results* results, bool ok) {
+    std::lock_guard<std::mutex> lock(results->mutex);
+    results->threads.insert(std::this_thread::get_id());
+    if (!ok) results->failed ++;
+    if (++ results->done == GETS + UPLOADS) {
+        results->finished.set_value();
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "/tmp/gdrive_async.bin";
+
+    std::string data(FILE_SIZE, '\0');
+    srand(11);
+    for (size_t i = 0; i < data.size(); i ++) {
+        data[i] = rand() % 256;
+    }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ssize_t written = write(fd, data.data(), data.size());
+    assert(written == (ssize_t)data.size());
+    close(fd);
+
+    Endpoint endpoint;
+    endpoint.sessions = 0;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    }, 1024);
+    endpoint.server = &server;
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    AsyncEngine& engine = AsyncEngine::get_instance();
+    engine.set_io_threads(1);
+    // blocking requests go through the engine as well, the one in the callback
+    // below would wait for the very thread it runs on
+    engine.set_http_version(HV_HTTP2);
+
+    Results results;
+    results.done = results.failed = 0;
+    std::vector<std::unique_ptr<FileGetRequest> > gets;
+    std::vector<std::unique_ptr<std::ifstream> > streams;
+    std::vector<std::unique_ptr<FileContent> > contents;
+    std::vector<std::unique_ptr<GFile> > files;
+    std::vector<std::unique_ptr<FileInsertRequest> > uploads;
+
+    for (int i = 0; i < UPLOADS; i ++) {
+        streams.push_back(std::unique_ptr<std::ifstream>(new std::ifstream(filename.c_str(), std::ios::binary)));
+        contents.push_back(std::unique_ptr<FileContent>(new FileContent(*streams.back(), "application/octet-stream")));
+        files.push_back(std::unique_ptr<GFile>(new GFile()));
+        uploads.push_back(std::unique_ptr<FileInsertRequest>(
+            new FileInsertRequest(contents.back().get(), files.back().get(), &cred, server.uri("/upload"), true)));
+        uploads.back()->set_adaptive_chunk_size(false);
+        uploads.back()->execute_async([&results](GFile& file, std::exception_ptr error) {
+            completed(&results, !error && file.get_id().find("upload") == 0);
+        });
+    }
+    for (int i = 0; i < GETS; i ++) {
+        std::string id = "file" + SizeHelper::itos(i);
+        gets.push_back(std::unique_ptr<FileGetRequest>(new FileGetRequest(&cred, server.uri("/files/" + id))));
+        gets.back()->execute_async([&results, &cred, &server, id, i](GFile& file, std::exception_ptr error) {
+            if (i == GETS / 2) {
+                // a blocking request right on the I/O thread
+                FileGetRequest nested(&cred, server.uri("/files/nested"));
+                std::string nested_id = nested.execute().get_id();
+                std::lock_guard<std::mutex> lock(results.mutex);
+                results.nested = nested_id;
+            }
+            completed(&results, !error && file.get_id() == id);
+        });
+    }
+
+    std::future<void> finished = results.finished.get_future();
+    bool done = finished.wait_for(std::chrono::seconds(60)) == std::future_status::ready;
+    std::cout << results.done << " of " << GETS + UPLOADS << " async requests done on "
+              << results.threads.size() << " I/O thread(s), " << results.failed << " failed" << std::endl;
+    assert(done);
+    assert(results.failed == 0);
+    assert(results.threads.size() == 1);
+    assert(results.threads.count(std::this_thread::get_id()) == 0);
+    assert(results.nested == "nested");
+
+    std::lock_guard<std::mutex> lock(endpoint.mutex);
+    assert(endpoint.sessions == UPLOADS);
+    for (std::map<std::string, std::string>::iterator iter = endpoint.received.begin();
+            iter != endpoint.received.end(); iter ++) {
+        assert(iter->second == data);
+    }
+    assert(engine.in_flight() == 0);
+
+    if (remove(filename.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << filename
+                  << "Please remove it manually" << std::endl;
+    }
+}
@@ -0,0 +1,175 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/batch.hpp"
+#include "gdrive/error.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <cassert>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+using namespace GDRIVE;
+
+// How the stand-in batch endpoint answers
+enum AnswerMode {
+    AM_IN_ORDER,
+    AM_REVERSED,    // parts in the opposite order of the requests
+    AM_MISSING,     // no part for every third request
+    AM_NO_IDS       // in order, without Content-ID headers
+};
+
+// State of the stand-in batch endpoint. A part answers a request for
+// /drive/v2/files/<id> with a file of that id, or with a 404 for ids
+// starting with "gone".
+struct Endpoint {
+    std::mutex mutex;
+    AnswerMode mode;
+    std::string boundary;
+    // parts in each batch that came in
+    std::vector<int> batches;
+};
+
+struct Part {
+    std::string content_id;
+    std::string file_id;
+};
+
+std::string answer(Part& part, bool with_id) {
+    VarString vs;
+    vs.append("Content-Type: application/http\r\n");
+    if (with_id) {
+        vs.append("Content-ID: <response-").append(part.content_id).append(">\r\n");
+    }
+    vs.append("\r\n");
+    if (part.file_id.compare(0, 4, "gone") == 0) {
+        vs.append("HTTP/1.1 404 Not Found\r\n")
+          .append("Content-Type: application/json\r\n\r\n")
+          .append("{\"error\": {\"code\": 404, \"message\": \"File not found: ").append(part.file_id).append("\"}}");
+    } else {
+        vs.append("HTTP/1.1 200 OK\r\n")
+          .append("Content-Type: application/json\r\n\r\n")
+          .append("{\"kind\": \"drive#file\", \"id\": \"").append(part.file_id).append("\"}");
+    }
+    vs.append("\r\n");
+    return vs.toString();
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    assert(request_line.find("POST /batch/drive/v2") == 0);
+
+    std::vector<Part> parts;
+    size_t pos = 0;
+    while ((pos = body.find("Content-ID: <", pos)) != std::string::npos) {
+        pos += 13;
+        Part part;
+        part.content_id = body.substr(pos, body.find('>', pos) - pos);
+        size_t path = body.find("/drive/v2/files/", pos) + 16;
+        part.file_id = body.substr(path, body.find_first_of(" ?", path) - path);
+        parts.push_back(part);
+    }
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    endpoint->batches.push_back(parts.size());
+    VarString vs;
+    for (size_t i = 0; i < parts.size(); i ++) {
+        size_t n = endpoint->mode == AM_REVERSED ? parts.size() - 1 - i : i;
+        if (endpoint->mode == AM_MISSING && n % 3 == 1) continue;
+        vs.append("--").append(endpoint->boundary).append("\r\n").append(answer(parts[n], endpoint->mode != AM_NO_IDS));
+    }
+    vs.append("--").append(endpoint->boundary).append("--\r\n");
+    std::string boundary = endpoint->boundary;
+    if (boundary.find('=') != std::string::npos) {
+        boundary = "\"" + boundary + "\"";
+    }
+    conn.reply("200 OK", "Content-Type: multipart/mixed; boundary=" + boundary + "\r\n", vs.toString());
+    return true;
+}
+
+std::string file_id(int i) {
+    return (i % 7 == 3 ? "gone" : "file") + SizeHelper::itos(i);
+}
+
+// Gets count files in one BatchRequest and checks every request got the
+// part meant for it
+void run(StandIn* server, Endpoint* endpoint, Credential* cred, int count, AnswerMode mode, std::string boundary) {
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->mode = mode;
+        endpoint->boundary = boundary;
+        endpoint->batches.clear();
+    }
+
+    std::vector<FileGetRequest*> requests;
+    BatchRequest batch(cred, server->uri("/batch/drive/v2"));
+    for (int i = 0; i < count; i ++) {
+        requests.push_back(new FileGetRequest(cred, server->uri("/drive/v2/files/" + file_id(i))));
+        batch.add(requests.back());
+    }
+    batch.execute();
+
+    int ok = 0, not_found = 0, missing = 0;
+    for (int i = 0; i < count; i ++) {
+        // each request is answered in the batch it went out in, at its place there
+        bool answered = mode != AM_MISSING || i % BATCH_MAX_REQUESTS % 3 != 1;
+        HttpResponse& resp = requests[i]->response();
+        if (!answered) {
+            // a request without a part gets a 500 rather than nothing
+            assert(resp.status() == 500);
+            assert(resp.content().find("no part for this request") != std::string::npos);
+            missing ++;
+        } else if (file_id(i).compare(0, 4, "gone") == 0) {
+            assert(resp.status() == 404);
+            assert(resp.content().find(file_id(i)) != std::string::npos);
+            not_found ++;
+        } else {
+            GFile file = requests[i]->result();
+            assert(file.get_id() == file_id(i));
+            ok ++;
+        }
+        if (resp.status() != 200) {
+            try {
+                requests[i]->result();
+                assert(false);
+            } catch (GoogleJsonResponseException& e) {
+            }
+        }
+        delete requests[i];
+    }
+
+    std::cout << count << " requests in " << endpoint->batches.size() << " batches: " << ok << " found, "
+              << not_found << " not found, " << missing << " without a part" << std::endl;
+    // at most BATCH_MAX_REQUESTS parts go out in one batch
+    assert((int)endpoint->batches.size() == (count + BATCH_MAX_REQUESTS - 1) / BATCH_MAX_REQUESTS);
+    for (size_t i = 0; i < endpoint->batches.size(); i ++) {
+        int expected = count - (int)i * BATCH_MAX_REQUESTS;
+        assert(endpoint->batches[i] == (expected < BATCH_MAX_REQUESTS ? expected : BATCH_MAX_REQUESTS));
+    }
+    assert(ok + not_found + missing == count);
+}
+
+int main() {
+    Endpoint endpoint;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    run(&server, &endpoint, &cred, 10, AM_IN_ORDER, "batch_standin");
+    run(&server, &endpoint, &cred, 10, AM_REVERSED, "batch_standin");
+    // a boundary with an equals sign comes quoted
+    run(&server, &endpoint, &cred, 10, AM_REVERSED, "==batch=standin==");
+    run(&server, &endpoint, &cred, 10, AM_MISSING, "batch_standin");
+    // parts without an id answer the requests in order
+    run(&server, &endpoint, &cred, 10, AM_NO_IDS, "batch_standin");
+    run(&server, &endpoint, &cred, 250, AM_REVERSED, "batch_standin");
+    run(&server, &endpoint, &cred, 250, AM_MISSING, "batch_standin");
+    run(&server, &endpoint, &cred, 250, AM_NO_IDS, "batch_standin");
+}
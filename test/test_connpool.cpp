@@ -0,0 +1,122 @@
+#include "gdrive/request.hpp"
+#include "gdrive/connpool.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <unistd.h>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace GDRIVE;
+
+// A stand-in host, a request for ?ms=<ms> takes that many milliseconds
+bool handle(Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    size_t ms = request_line.find("ms=");
+    if (ms != std::string::npos) {
+        usleep(atoi(request_line.c_str() + ms + 3) * 1000);
+    }
+    conn.reply("200 OK", "Content-Type: application/json\r\n", "{\"kind\": \"drive#about\"}");
+    return true;
+}
+
+void get(StandIn* server, std::string path = "/about") {
+    HttpRequest request(server->uri(path), RM_GET);
+    assert(request.request().status() == 200);
+}
+
+// what happened in the pool since before
+ConnectionPoolStats since(ConnectionPoolStats& before) {
+    ConnectionPoolStats now = ConnectionPool::get_instance().stats();
+    now.requests -= before.requests;
+    now.hits -= before.hits;
+    now.misses -= before.misses;
+    now.idle_evictions -= before.idle_evictions;
+    now.handshakes_avoided -= before.handshakes_avoided;
+    now.connects -= before.connects;
+    return now;
+}
+
+void test_host_of() {
+    assert(ConnectionPool::host_of("https://www.googleapis.com/drive/v2/files?q=x") == "https://www.googleapis.com");
+    assert(ConnectionPool::host_of("http://127.0.0.1:8080?q=x") == "http://127.0.0.1:8080");
+    assert(ConnectionPool::host_of("http://127.0.0.1:8080") == "http://127.0.0.1:8080");
+}
+
+// One request after the other to the same host: the first one connects, the
+// others take its handle and its connection with it
+void test_reuse(StandIn* server) {
+    ConnectionPoolStats before = ConnectionPool::get_instance().stats();
+    for (int i = 0; i < 20; i ++) {
+        get(server);
+    }
+    ConnectionPoolStats stats = since(before);
+    std::cout << "20 requests: " << stats.hits << " hits, " << stats.connects << " connects, "
+              << stats.handshakes_avoided << " handshakes avoided" << std::endl;
+    assert(stats.requests == 20 && stats.hits == 19 && stats.misses == 1);
+    assert(stats.connects == 1 && stats.handshakes_avoided == 19);
+    assert(stats.idle == 1);
+    assert(server->accepted() == 1);
+}
+
+// Handles are kept per host, a request to another host doesn't take one
+// connected somewhere else
+void test_hosts(StandIn* first, StandIn* second) {
+    ConnectionPoolStats before = ConnectionPool::get_instance().stats();
+    for (int i = 0; i < 5; i ++) {
+        get(first);
+        get(second);
+    }
+    ConnectionPoolStats stats = since(before);
+    assert(stats.requests == 10 && stats.misses == 1 && stats.hits == 9);
+    assert(stats.connects == 1 && stats.handshakes_avoided == 9);
+    assert(stats.idle == 2);
+    assert(first->accepted() == 1 && second->accepted() == 1);
+}
+
+// A handle idle for longer than the limit is closed, the next request connects again
+void test_eviction(StandIn* server) {
+    ConnectionPool::get_instance().set_max_idle_seconds(1);
+    ConnectionPoolStats before = ConnectionPool::get_instance().stats();
+    sleep(2);
+    get(server);
+    ConnectionPoolStats stats = since(before);
+    // the idle handles of both hosts went
+    assert(stats.idle_evictions == 2 && stats.misses == 1 && stats.connects == 1);
+    assert(stats.idle == 1);
+    assert(server->accepted() == 2);
+    ConnectionPool::get_instance().set_max_idle_seconds(POOL_MAX_IDLE_SECONDS);
+}
+
+// Requests running at once each take a handle; only as many as the limit stay idle
+void test_max_idle(StandIn* server) {
+    ConnectionPool::get_instance().clear();
+    ConnectionPool::get_instance().set_max_idle_per_host(2);
+    ConnectionPoolStats before = ConnectionPool::get_instance().stats();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i ++) {
+        threads.push_back(std::thread([server]() { get(server, "/about?ms=300"); }));
+    }
+    for (size_t i = 0; i < threads.size(); i ++) {
+        threads[i].join();
+    }
+    ConnectionPoolStats stats = since(before);
+    assert(stats.misses == 4 && stats.connects == 4);
+    assert(stats.idle == 2);
+    ConnectionPool::get_instance().set_max_idle_per_host(POOL_MAX_IDLE_PER_HOST);
+}
+
+int main() {
+    StandIn first(handle);
+    StandIn second(handle);
+
+    test_host_of();
+    test_reuse(&first);
+    test_hosts(&first, &second);
+    test_eviction(&first);
+    test_max_idle(&first);
+}
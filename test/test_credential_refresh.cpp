@@ -0,0 +1,290 @@
+#include "gdrive/credential.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <vector>
+
+using namespace GDRIVE;
+
+const int THREADS = 256;
+const int ROUNDS = 3;
+// the token endpoint takes this long, every thread gets its 401 while a refresh runs
+const int REFRESH_MS = 100;
+// tokens handed out in the steady state part live this long, and are refreshed this long ahead
+const int EXPIRES_IN = 3;
+const int MARGIN = 2;
+const int STEADY_THREADS = 32;
+const int STEADY_SECONDS = 7;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// State of the stand-in token endpoint and API endpoint. The API answers
+// 401 unless it is sent a token that was handed out and hasn't expired yet.
+struct Endpoint {
+    std::mutex mutex;
+    // calls of the token endpoint, the first failing of them are answered with 500
+    int attempts;
+    int failing;
+    int refreshes;
+    int unauthorized;
+    int expires_in;
+    // token, time it expires at
+    std::map<std::string, double> tokens;
+};
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+
+    std::string status, content;
+    if (request_line.find("POST /token") == 0) {
+        assert(body.find("grant_type=refresh_token") != std::string::npos);
+        usleep(REFRESH_MS * 1000);
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->attempts ++;
+        if (endpoint->failing > 0) {
+            endpoint->failing --;
+            conn.reply("500 Internal Server Error", "Content-Type: application/json\r\n",
+                       "{\"error\": \"internal_failure\"}");
+            return true;
+        }
+        endpoint->refreshes ++;
+        std::string token = "token" + SizeHelper::itos(endpoint->refreshes);
+        endpoint->tokens[token] = now() + endpoint->expires_in;
+        status = "200 OK";
+        content = "{\"access_token\": \"" + token + "\", \"token_type\": \"Bearer\", \"expires_in\": "
+                + SizeHelper::itos(endpoint->expires_in) + "}";
+    } else {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        std::string token = headers["authorization"].substr(7);
+        if (endpoint->tokens.count(token) && endpoint->tokens[token] > now()) {
+            status = "200 OK";
+            content = "{\"kind\": \"drive#about\"}";
+        } else {
+            endpoint->unauthorized ++;
+            status = "401 Unauthorized";
+            content = "{\"error\": {\"code\": 401, \"message\": \"Invalid Credentials\"}}";
+        }
+    }
+    conn.reply(status, "Content-Type: application/json\r\n", content);
+    return true;
+}
+
+// Every thread waits for the others, then all of them go out at once with
+// the token that has just expired
+void run(StandIn* server, Endpoint* endpoint, Credential* cred, int round) {
+    std::string uri = server->uri("/drive/v2/about");
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->tokens.clear();
+        endpoint->unauthorized = 0;
+    }
+
+    std::mutex mutex;
+    std::condition_variable go;
+    bool started = false;
+    int ok = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREADS; i ++) {
+        threads.push_back(std::thread([&]() {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                go.wait(lock, [&]() { return started; });
+            }
+            CredentialHttpRequest request(cred, uri, RM_GET);
+            HttpResponse& resp = request.request();
+            if (resp.status() == 200) {
+                std::lock_guard<std::mutex> lock(mutex);
+                ok ++;
+            }
+        }));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        started = true;
+    }
+    go.notify_all();
+    for (size_t i = 0; i < threads.size(); i ++) {
+        threads[i].join();
+    }
+
+    std::cout << "Round " << round << ": " << ok << " of " << THREADS << " requests succeeded, "
+              << endpoint->unauthorized << " 401s, " << endpoint->refreshes << " refreshes so far" << std::endl;
+    assert(ok == THREADS);
+    // a single refresh per expiry, however many requests found the token stale
+    assert(endpoint->refreshes == round);
+    assert(cred->refresh_count() == round);
+    assert(cred->access_token() == "token" + SizeHelper::itos(round));
+}
+
+// Threads keep sending requests while tokens that live a few seconds expire
+// one after the other; every one is refreshed ahead and no request gets a 401
+void steady(StandIn* server, Endpoint* endpoint, Credential* cred) {
+    std::string uri = server->uri("/drive/v2/about");
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->expires_in = EXPIRES_IN;
+    }
+    cred->set_refresh_margin(MARGIN);
+    // one last 401 for a token that lives as long as the ones to come
+    run(server, endpoint, cred, ROUNDS + 1);
+    endpoint->unauthorized = 0;
+    int refreshes = endpoint->refreshes;
+
+    std::mutex mutex;
+    int ok = 0, failed = 0;
+    double end = now() + STEADY_SECONDS;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < STEADY_THREADS; i ++) {
+        threads.push_back(std::thread([&]() {
+            while (now() < end) {
+                CredentialHttpRequest request(cred, uri, RM_GET);
+                HttpResponse& resp = request.request();
+                std::lock_guard<std::mutex> lock(mutex);
+                (resp.status() == 200 ? ok : failed) ++;
+                usleep(10 * 1000);
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i ++) {
+        threads[i].join();
+    }
+
+    std::cout << "Steady state: " << ok << " requests succeeded, " << failed << " failed, "
+              << endpoint->unauthorized << " 401s, " << endpoint->refreshes - refreshes << " refreshes ahead" << std::endl;
+    assert(failed == 0);
+    assert(endpoint->unauthorized == 0);
+    assert(endpoint->refreshes - refreshes >= STEADY_SECONDS / (EXPIRES_IN - MARGIN) - 1);
+    assert(cred->token_expiry() > (long)now());
+}
+
+// A credential whose token has secs left before it expires, and is good until then
+Credential* near_expiry(StandIn* server, Endpoint* endpoint, MemoryStore* store, std::string token, int secs) {
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->tokens[token] = now() + secs;
+        endpoint->unauthorized = 0;
+    }
+    store->put("access_token", token);
+    store->put("refresh_token", "stand-in");
+    store->put("token_expiry", SizeHelper::itos((long)now() + secs));
+    Credential* cred = new Credential(store);
+    cred->set_token_url(server->uri("/token"));
+    cred->set_refresh_margin(secs * 2);
+    return cred;
+}
+
+int attempts(Endpoint* endpoint) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    return endpoint->attempts;
+}
+
+// However many requests find the token near its expiry, it is refreshed once,
+// in the background, and none of them gets a 401
+void ahead_once(StandIn* server, Endpoint* endpoint) {
+    std::string uri = server->uri("/drive/v2/about");
+    endpoint->expires_in = 3600;
+    int before = attempts(endpoint);
+    MemoryStore store;
+    Credential* cred = near_expiry(server, endpoint, &store, "near", 60);
+
+    std::mutex mutex;
+    int ok = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < STEADY_THREADS; i ++) {
+        threads.push_back(std::thread([&]() {
+            for (int j = 0; j < 5; j ++) {
+                CredentialHttpRequest request(cred, uri, RM_GET);
+                if (request.request().status() == 200) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ok ++;
+                }
+                usleep(REFRESH_MS * 1000 / 2);
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i ++) {
+        threads[i].join();
+    }
+
+    std::cout << "Ahead: " << ok << " requests succeeded, " << endpoint->unauthorized << " 401s, "
+              << attempts(endpoint) - before << " refreshes" << std::endl;
+    assert(ok == STEADY_THREADS * 5);
+    assert(endpoint->unauthorized == 0);
+    assert(attempts(endpoint) - before == 1);
+    assert(cred->refresh_count() == 1);
+    assert(cred->access_token() != "near");
+    delete cred;
+}
+
+// A background refresh that failed isn't tried in the background again, the
+// next request gets the new token before it goes out
+void ahead_failed(StandIn* server, Endpoint* endpoint) {
+    std::string uri = server->uri("/drive/v2/about");
+    int before = attempts(endpoint);
+    endpoint->failing = 1;
+    MemoryStore store;
+    Credential* cred = near_expiry(server, endpoint, &store, "near-failing", 60);
+
+    CredentialHttpRequest first(cred, uri, RM_GET);
+    assert(first.request().status() == 200);
+    while (attempts(endpoint) == before) {
+        usleep(10 * 1000);
+    }
+    usleep(100 * 1000);
+    assert(cred->access_token() == "near-failing");
+
+    CredentialHttpRequest second(cred, uri, RM_GET);
+    assert(second.request().status() == 200);
+    std::cout << "Ahead failed: " << attempts(endpoint) - before << " refreshes, "
+              << endpoint->unauthorized << " 401s" << std::endl;
+    assert(attempts(endpoint) - before == 2);
+    assert(cred->access_token() != "near-failing");
+    assert(endpoint->unauthorized == 0);
+    delete cred;
+}
+
+int main() {
+    Endpoint endpoint;
+    endpoint.attempts = 0;
+    endpoint.failing = 0;
+    endpoint.refreshes = 0;
+    endpoint.unauthorized = 0;
+    endpoint.expires_in = 3600;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    }, 1024);
+
+    MemoryStore store;
+    store.put("access_token", "stale");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+    cred.set_token_url(server.uri("/token"));
+
+    for (int round = 1; round <= ROUNDS; round ++) {
+        run(&server, &endpoint, &cred, round);
+    }
+    assert(store.get("access_token") == "token" + SizeHelper::itos(ROUNDS));
+    assert(cred.token_expiry() > (long)now() + 3000);
+
+    steady(&server, &endpoint, &cred);
+    assert(store.get("token_expiry") == SizeHelper::itos(cred.token_expiry()));
+
+    ahead_once(&server, &endpoint);
+    ahead_failed(&server, &endpoint);
+}
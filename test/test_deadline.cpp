@@ -0,0 +1,257 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/error.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <cassert>
+#include <iostream>
+#include <future>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <map>
+
+using namespace GDRIVE;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// State of the stand-in endpoints. A request for /<name>?fail=<n>&after=<s>&ms=<t>
+// is answered with 503 the first n times, with a Retry-After of s seconds if
+// after is given, and after t milliseconds with 200 from then on. /api answers
+// 401 unless it is sent the token /token handed out last, both after t ms.
+struct Endpoint {
+    std::mutex mutex;
+    // requests that came in for each path
+    std::map<std::string, int> hits;
+    std::string token;
+    int refreshes;
+};
+
+std::string param(std::string target, std::string name) {
+    size_t pos = target.find(name + "=");
+    if (pos == std::string::npos) return "";
+    pos += name.size() + 1;
+    return target.substr(pos, target.find('&', pos) - pos);
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::string target = request_line.substr(request_line.find(' ') + 1);
+    target = target.substr(0, target.find(' '));
+    std::string path = target.substr(0, target.find('?'));
+
+    int hits;
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        hits = ++ endpoint->hits[path];
+    }
+    if (hits <= atoi(param(target, "fail").c_str())) {
+        std::string after = param(target, "after");
+        conn.reply("503 Service Unavailable", after == "" ? "" : "Retry-After: " + after + "\r\n",
+                   "{\"error\": {\"code\": 503, \"message\": \"Backend Error\"}}");
+        return true;
+    }
+    usleep(atoi(param(target, "ms").c_str()) * 1000);
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    if (path == "/token") {
+        endpoint->token = "token" + SizeHelper::itos(++ endpoint->refreshes);
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"access_token\": \"" + endpoint->token + "\", \"token_type\": \"Bearer\", \"expires_in\": 3600}");
+    } else if (path == "/api" && headers["authorization"] != "Bearer " + endpoint->token) {
+        conn.reply("401 Unauthorized", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 401, \"message\": \"Invalid Credentials\"}}");
+    } else {
+        conn.reply("200 OK", "Content-Type: application/json\r\n", "{\"path\": \"" + path + "\"}");
+    }
+    return true;
+}
+
+int hits(Endpoint* endpoint, std::string path) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    return endpoint->hits[path];
+}
+
+void reset(Endpoint* endpoint) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    endpoint->hits.clear();
+    endpoint->token = "";
+}
+
+// request_async isn't virtual, the helper calls the one of a credential request
+std::future<void> request_async(CredentialHttpRequest* request) {
+    std::shared_ptr<std::promise<void> > promise(new std::promise<void>());
+    request->request_async([promise](std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value();
+        }
+    });
+    return promise->get_future();
+}
+
+// An attempt that takes longer than the timeout is given up on
+void test_timeout(StandIn* server) {
+    HttpRequest request(server->uri("/slow?ms=3000"), RM_GET);
+    request.set_retry_policy(NULL);
+    request.set_timeout(0.3);
+    double start = now();
+    try {
+        request.request();
+        assert(false);
+    } catch (TimeoutException& e) {
+        std::cout << "Timed out after " << now() - start << "s: " << e.error() << std::endl;
+    }
+    assert(now() - start < 1);
+}
+
+// A Retry-After reaching past the deadline isn't waited for, the 503 is the answer
+void test_wait_past_deadline(StandIn* server, Endpoint* endpoint) {
+    RetryPolicy policy;
+    policy.set_backoff(0.01, 2, 0.1);
+    HttpRequest request(server->uri("/after?fail=1&after=5"), RM_GET);
+    request.set_retry_policy(&policy);
+    request.set_deadline(1);
+    double start = now();
+    assert(request.request().status() == 503);
+    assert(now() - start < 0.5);
+    assert(hits(endpoint, "/after") == 1);
+}
+
+// The attempt after a retry wait only has what is left of the deadline
+void test_deadline_in_retry(StandIn* server, Endpoint* endpoint) {
+    RetryPolicy policy;
+    policy.set_backoff(0.2, 2, 0.5);
+    HttpRequest request(server->uri("/retried?fail=1&ms=3000"), RM_GET);
+    request.set_retry_policy(&policy);
+    request.set_deadline(1);
+    double start = now();
+    try {
+        request.request();
+        assert(false);
+    } catch (TimeoutException& e) {
+    }
+    std::cout << "Deadline of 1s across a retry, gave up after " << now() - start << "s" << std::endl;
+    assert(now() - start >= 0.9 && now() - start < 2);
+    assert(hits(endpoint, "/retried") == 2);
+}
+
+// A transfer under way is aborted when its token is cancelled
+void test_cancel_running(StandIn* server) {
+    CancellationToken token;
+    HttpRequest request(server->uri("/running?ms=5000"), RM_GET);
+    request.set_retry_policy(NULL);
+    request.set_cancellation_token(&token);
+    std::thread canceller([&token]() {
+        usleep(300 * 1000);
+        token.cancel();
+    });
+    double start = now();
+    try {
+        request.request();
+        assert(false);
+    } catch (CancelledException& e) {
+    }
+    canceller.join();
+    std::cout << "Cancelled a running transfer after " << now() - start << "s" << std::endl;
+    assert(now() - start < 2);
+}
+
+// The send that got the 401, the refresh and the resend share one deadline;
+// each of the sends alone fits in it, the two of them don't
+void test_resend(StandIn* server, Endpoint* endpoint, Credential* cred) {
+    reset(endpoint);
+    CredentialHttpRequest request(cred, server->uri("/api?ms=700"), RM_GET);
+    request.set_deadline(1);
+    double start = now();
+    try {
+        request.request();
+        assert(false);
+    } catch (TimeoutException& e) {
+    }
+    std::cout << "Deadline of 1s across a 401 and the resend, gave up after " << now() - start << "s" << std::endl;
+    assert(now() - start < 1.3);
+    assert(hits(endpoint, "/token") == 1);
+
+    reset(endpoint);
+    CredentialHttpRequest async(cred, server->uri("/api?ms=700"), RM_GET);
+    async.set_deadline(1);
+    start = now();
+    try {
+        request_async(&async).get();
+        assert(false);
+    } catch (TimeoutException& e) {
+    }
+    assert(now() - start < 1.3);
+}
+
+// The exchange a request starts is bounded by the deadline of that request,
+// and aborted by its token
+void test_refresh(StandIn* server, Endpoint* endpoint, Credential* cred) {
+    reset(endpoint);
+    cred->set_token_url(server->uri("/token?ms=3000"));
+    CredentialHttpRequest request(cred, server->uri("/api"), RM_GET);
+    request.set_deadline(1);
+    double start = now();
+    try {
+        request.request();
+        assert(false);
+    } catch (TimeoutException& e) {
+    }
+    std::cout << "Slow token endpoint, gave up after " << now() - start << "s" << std::endl;
+    assert(now() - start < 2);
+
+    // the aborted exchange left the token as it was, the next request refreshes it again
+    CancellationToken token;
+    CredentialHttpRequest cancelled(cred, server->uri("/api"), RM_GET);
+    cancelled.set_cancellation_token(&token);
+    std::thread canceller([&token]() {
+        usleep(300 * 1000);
+        token.cancel();
+    });
+    start = now();
+    try {
+        cancelled.request();
+        assert(false);
+    } catch (CancelledException& e) {
+    }
+    canceller.join();
+    std::cout << "Cancelled a refresh after " << now() - start << "s" << std::endl;
+    assert(now() - start < 2);
+    assert(hits(endpoint, "/token") == 2);
+    cred->set_token_url(server->uri("/token"));
+}
+
+int main() {
+    // the stand-in still answers the transfers the client gave up on
+    signal(SIGPIPE, SIG_IGN);
+
+    Endpoint endpoint;
+    endpoint.refreshes = 0;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+
+    test_timeout(&server);
+    test_wait_past_deadline(&server, &endpoint);
+    test_deadline_in_retry(&server, &endpoint);
+    test_cancel_running(&server);
+
+    MemoryStore store;
+    store.put("access_token", "stale");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+    cred.set_token_url(server.uri("/token"));
+    test_resend(&server, &endpoint, &cred);
+    test_refresh(&server, &endpoint, &cred);
+}
@@ -0,0 +1,189 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/dedup.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#include <set>
+
+using namespace GDRIVE;
+
+const long long FILE_SIZE = 100 * 1024 + 7;
+
+// State of the stand-in upload and files endpoints. An upload gets the id
+// up<n>, a copy copy<n>; a copy of a file in gone is answered with 404.
+// /changes lists the deletion of up0 and a new file with the same content.
+struct Endpoint {
+    std::mutex mutex;
+    std::string data;
+    std::string md5;
+    int uploads;
+    int copies;
+    std::set<std::string> gone;
+};
+
+std::string file_json(Endpoint* endpoint, std::string id) {
+    return "{\"kind\": \"drive#file\", \"id\": \"" + id + "\", \"md5Checksum\": \"" + endpoint->md5 + "\", "
+           "\"fileSize\": " + SizeHelper::itos(endpoint->data.size()) + "}";
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::string path = request_line.substr(request_line.find(' ') + 1);
+    path = path.substr(0, path.find_first_of(" ?"));
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+
+    if (path == "/upload") {
+        assert(body.find(endpoint->data) != std::string::npos);
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   file_json(endpoint, "up" + SizeHelper::itos(endpoint->uploads ++)));
+    } else if (path == "/changes") {
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"kind\": \"drive#changeList\", \"items\": ["
+                   "{\"kind\": \"drive#change\", \"id\": \"41\", \"fileId\": \"up0\", \"deleted\": true}, "
+                   "{\"kind\": \"drive#change\", \"id\": \"42\", \"fileId\": \"changed\", \"deleted\": false, "
+                   "\"file\": " + file_json(endpoint, "changed") + "}]}");
+    } else if (path.find("/copy") != std::string::npos) {
+        std::string id = path.substr(7, path.find("/copy") - 7);
+        if (endpoint->gone.count(id)) {
+            conn.reply("404 Not Found", "Content-Type: application/json\r\n",
+                       "{\"error\": {\"code\": 404, \"message\": \"File not found: " + id + "\"}}");
+        } else {
+            conn.reply("200 OK", "Content-Type: application/json\r\n",
+                       file_json(endpoint, "copy" + SizeHelper::itos(endpoint->copies ++)));
+        }
+    } else {
+        conn.reply("200 OK", "Content-Type: application/json\r\n", file_json(endpoint, path.substr(7)));
+    }
+    return true;
+}
+
+int count(Endpoint* endpoint, int Endpoint::* counter) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    return endpoint->*counter;
+}
+
+GFile upload(StandIn* server, Credential* cred, DedupIndex* index, std::string filename, bool async = false) {
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+    FileContent content(fin, "application/octet-stream");
+    GFile file;
+    FileInsertRequest insert(&content, &file, cred, server->uri("/upload"));
+    insert.set_dedup(index, DA_COPY);
+    insert.set_files_url(server->uri("/files"));
+    return async ? insert.execute_async().get() : insert.execute();
+}
+
+// The first upload sends the content and adds it to the index, the second
+// becomes a copy of the first file and doesn't send it again
+void test_copy(StandIn* server, Endpoint* endpoint, Credential* cred, DedupIndex* index, std::string filename) {
+    assert(upload(server, cred, index, filename).get_id() == "up0");
+    assert(index->find(endpoint->md5, FILE_SIZE) == "up0");
+    assert(index->find(endpoint->md5, FILE_SIZE + 1) == "");
+
+    assert(upload(server, cred, index, filename).get_id() == "copy0");
+    assert(upload(server, cred, index, filename, true).get_id() == "copy1");
+    assert(count(endpoint, &Endpoint::uploads) == 1);
+    assert(count(endpoint, &Endpoint::copies) == 2);
+    // the copies are in the index too, the first file stays the source
+    assert(index->size() == 3);
+    assert(index->contains("copy1", endpoint->md5, FILE_SIZE));
+    assert(index->find(endpoint->md5, FILE_SIZE) == "up0");
+}
+
+// A source that is gone is dropped and another file with the content copied
+void test_stale(StandIn* server, Endpoint* endpoint, Credential* cred, DedupIndex* index, std::string filename) {
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->gone.insert("up0");
+    }
+    assert(upload(server, cred, index, filename).get_id() == "copy2");
+    assert(!index->contains("up0", endpoint->md5, FILE_SIZE));
+    assert(index->find(endpoint->md5, FILE_SIZE) == "copy0");
+    assert(count(endpoint, &Endpoint::uploads) == 1);
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->gone.clear();
+    }
+}
+
+// The change list keeps the index up to date and records how far it got
+void test_changes(StandIn* server, Endpoint* endpoint, Credential* cred, DedupIndex* index) {
+    FileGetRequest get(cred, server->uri("/files/up0"));
+    index->add(get.execute());
+    assert(index->contains("up0", endpoint->md5, FILE_SIZE));
+
+    ChangeListRequest list(cred, server->uri("/changes"));
+    GChangeList changes = list.execute();
+    index->apply(changes.get_items());
+    assert(!index->contains("up0", endpoint->md5, FILE_SIZE));
+    assert(index->contains("changed", endpoint->md5, FILE_SIZE));
+    assert(index->change_id() == 42);
+}
+
+// A dumped index is loaded by the next run, whose upload is a copy right away
+void test_persisted(StandIn* server, Endpoint* endpoint, Credential* cred, DedupIndex* index,
+                    std::string path, std::string filename) {
+    assert(index->dump());
+    DedupIndex loaded(path);
+    assert(loaded.size() == index->size());
+    assert(loaded.change_id() == 42);
+    assert(loaded.find(endpoint->md5, FILE_SIZE) != "");
+    assert(loaded.contains("changed", endpoint->md5, FILE_SIZE));
+
+    assert(upload(server, cred, &loaded, filename).get_id().find("copy") == 0);
+    assert(count(endpoint, &Endpoint::uploads) == 1);
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "/tmp/gdrive_dedup.bin";
+    std::string path = filename + ".index";
+    unlink(path.c_str());
+
+    Endpoint endpoint;
+    endpoint.uploads = endpoint.copies = 0;
+    endpoint.data.resize(FILE_SIZE);
+    srand(19);
+    for (size_t i = 0; i < endpoint.data.size(); i ++) {
+        endpoint.data[i] = rand() % 256;
+    }
+    MD5 md5;
+    md5.update(endpoint.data.data(), endpoint.data.size());
+    endpoint.md5 = md5.hexdigest();
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ssize_t written = write(fd, endpoint.data.data(), endpoint.data.size());
+    assert(written == (ssize_t)endpoint.data.size());
+    close(fd);
+
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    DedupIndex index(path);
+    assert(index.size() == 0);
+    test_copy(&server, &endpoint, &cred, &index, filename);
+    test_stale(&server, &endpoint, &cred, &index, filename);
+    test_changes(&server, &endpoint, &cred, &index);
+    test_persisted(&server, &endpoint, &cred, &index, path, filename);
+
+    unlink(path.c_str());
+    if (remove(filename.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << filename
+                  << "Please remove it manually" << std::endl;
+    }
+}
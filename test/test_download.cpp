@@ -0,0 +1,200 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/download.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <map>
+#include <algorithm>
+
+using namespace GDRIVE;
+
+const long long RANGE_SIZE = 64 * 1024;
+const long long FILE_SIZE = 4 * RANGE_SIZE + 123;
+
+// State of the stand-in files endpoint. /files/<name> is the metadata of a
+// file with the test data as content, /content/<name> the content itself,
+// served as the name says:
+//   ranged   every Range is answered with 206
+//   ignored  Range is ignored, the answer is always 200 with the whole file
+//   short    an answer from the start of a range has only half its bytes
+//   flaky    the first answer for the second range is a 503
+//   corrupt  md5Checksum doesn't match the content
+struct Endpoint {
+    StandIn* server;
+    std::string data;
+    std::mutex mutex;
+    // content requests by name and first byte asked for
+    std::map<std::string, int> hits;
+};
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::string path = request_line.substr(request_line.find(' ') + 1);
+    path = path.substr(0, path.find_first_of(" ?"));
+    std::string name = path.substr(path.rfind('/') + 1);
+
+    if (path.find("/files/") == 0) {
+        MD5 md5;
+        md5.update(endpoint->data.data(), endpoint->data.size());
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"kind\": \"drive#file\", \"id\": \"" + name + "\", \"etag\": \"\\\"" + name + "\\\"\", "
+                   "\"downloadUrl\": \"" + endpoint->server->uri("/content/" + name) + "\", "
+                   "\"fileSize\": " + SizeHelper::itos(endpoint->data.size()) + ", "
+                   "\"md5Checksum\": \"" + (name == "corrupt" ? std::string(32, '0') : md5.hexdigest()) + "\"}");
+        return true;
+    }
+
+    std::string range = headers["range"];
+    long long start = 0, end = endpoint->data.size() - 1;
+    if (range != "" && name != "ignored") {
+        start = SizeHelper::stoll(range.substr(range.find('=') + 1));
+        end = SizeHelper::stoll(range.substr(range.find('-') + 1));
+    }
+    int hits;
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        hits = ++ endpoint->hits[name + "@" + SizeHelper::itos(start)];
+    }
+    if (name == "ignored") {
+        conn.reply("200 OK", "", endpoint->data);
+        return true;
+    }
+    if (name == "flaky" && start == RANGE_SIZE && hits == 1) {
+        conn.reply("503 Service Unavailable", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 503, \"message\": \"Backend Error\"}}");
+        return true;
+    }
+    if (name == "short" && start % RANGE_SIZE == 0) {
+        end = start + (end - start + 1) / 2 - 1;
+    }
+    conn.reply("206 Partial Content",
+               "Content-Range: bytes " + SizeHelper::itos(start) + "-" + SizeHelper::itos(end)
+               + "/" + SizeHelper::itos(endpoint->data.size()) + "\r\n",
+               endpoint->data.substr(start, end - start + 1));
+    return true;
+}
+
+int hits(Endpoint* endpoint, std::string name, long long start) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    return endpoint->hits[name + "@" + SizeHelper::itos(start)];
+}
+
+std::string read_file(std::string path) {
+    std::ifstream fin(path.c_str(), std::ios::binary);
+    std::stringstream ss;
+    ss << fin.rdbuf();
+    return ss.str();
+}
+
+GFile download(StandIn* server, Credential* cred, std::string name, std::string path, long long range_size, bool use_mmap = false) {
+    FileDownloadRequest request(cred, server->uri("/files/" + name), path);
+    request.set_range_size(range_size);
+    request.set_use_mmap(use_mmap);
+    return request.execute();
+}
+
+// Each 206 lands at its offset, every range is asked for once
+void test_ranges(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path, bool use_mmap) {
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->hits.clear();
+    }
+    GFile file = download(server, cred, "ranged", path, RANGE_SIZE, use_mmap);
+    assert(file.get_id() == "ranged");
+    assert(read_file(path) == endpoint->data);
+    for (long long start = 0; start < FILE_SIZE; start += RANGE_SIZE) {
+        assert(hits(endpoint, "ranged", start) == 1);
+    }
+    // a finished download leaves no journal behind
+    assert(access((path + DOWNLOAD_JOURNAL_SUFFIX).c_str(), F_OK) != 0);
+}
+
+// A 200 to a ranged request would put byte 0 at the range's offset, the
+// download fails instead; a single range for the whole file takes the 200
+void test_ignored(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path) {
+    try {
+        download(server, cred, "ignored", path, RANGE_SIZE);
+        assert(false);
+    } catch (DownloadException& e) {
+        std::cout << "Range ignored: " << e.error() << std::endl;
+    }
+    unlink((path + DOWNLOAD_JOURNAL_SUFFIX).c_str());
+
+    download(server, cred, "ignored", path, 2 * FILE_SIZE);
+    assert(read_file(path) == endpoint->data);
+}
+
+// A short body is kept and the rest of the range asked for
+void test_short(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path) {
+    download(server, cred, "short", path, RANGE_SIZE);
+    assert(read_file(path) == endpoint->data);
+    for (long long start = 0; start < FILE_SIZE; start += RANGE_SIZE) {
+        long long length = std::min(RANGE_SIZE, FILE_SIZE - start);
+        assert(hits(endpoint, "short", start) == 1);
+        assert(hits(endpoint, "short", start + length / 2) == 1);
+    }
+}
+
+// Only the failed range is fetched again
+void test_flaky(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path) {
+    download(server, cred, "flaky", path, RANGE_SIZE);
+    assert(read_file(path) == endpoint->data);
+    for (long long start = 0; start < FILE_SIZE; start += RANGE_SIZE) {
+        assert(hits(endpoint, "flaky", start) == (start == RANGE_SIZE ? 2 : 1));
+    }
+}
+
+void test_corrupt(StandIn* server, Credential* cred, std::string path) {
+    try {
+        download(server, cred, "corrupt", path, RANGE_SIZE);
+        assert(false);
+    } catch (IntegrityException& e) {
+        std::cout << "Checksum mismatch: expected " << e.expected() << ", got " << e.actual() << std::endl;
+    }
+    assert(access((path + DOWNLOAD_JOURNAL_SUFFIX).c_str(), F_OK) != 0);
+}
+
+int main(int argc, char** argv) {
+    std::string path = argc > 1 ? argv[1] : "/tmp/gdrive_download.bin";
+    // a journal left by an earlier run would be resumed from
+    unlink((path + DOWNLOAD_JOURNAL_SUFFIX).c_str());
+
+    Endpoint endpoint;
+    endpoint.data.resize(FILE_SIZE);
+    srand(13);
+    for (size_t i = 0; i < endpoint.data.size(); i ++) {
+        endpoint.data[i] = rand() % 256;
+    }
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+    endpoint.server = &server;
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    test_ranges(&server, &endpoint, &cred, path, false);
+    test_ranges(&server, &endpoint, &cred, path, true);
+    test_ignored(&server, &endpoint, &cred, path);
+    test_short(&server, &endpoint, &cred, path);
+    test_flaky(&server, &endpoint, &cred, path);
+    test_corrupt(&server, &cred, path);
+
+    if (remove(path.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << path
+                  << "Please remove it manually" << std::endl;
+    }
+}
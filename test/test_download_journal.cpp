@@ -0,0 +1,175 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/download.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <map>
+
+using namespace GDRIVE;
+
+const long long RANGE_SIZE = 64 * 1024;
+const long long FILE_SIZE = 5 * RANGE_SIZE + 321;
+const int RANGES = 6;
+
+// State of the stand-in files endpoint. The content endpoint answers 503 to
+// every range from broken_from on, a download then fails once it gets there.
+struct Endpoint {
+    StandIn* server;
+    std::string data;
+    std::mutex mutex;
+    std::string etag;
+    long long broken_from;
+    // content requests by first byte asked for
+    std::map<long long, int> hits;
+};
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+
+    if (request_line.find("GET /files/") == 0) {
+        MD5 md5;
+        md5.update(endpoint->data.data(), endpoint->data.size());
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"kind\": \"drive#file\", \"id\": \"journaled\", \"etag\": \"" + endpoint->etag + "\", "
+                   "\"downloadUrl\": \"" + endpoint->server->uri("/content") + "\", "
+                   "\"fileSize\": " + SizeHelper::itos(endpoint->data.size()) + ", "
+                   "\"md5Checksum\": \"" + md5.hexdigest() + "\"}");
+        return true;
+    }
+
+    std::string range = headers["range"];
+    long long start = SizeHelper::stoll(range.substr(range.find('=') + 1));
+    long long end = SizeHelper::stoll(range.substr(range.find('-') + 1));
+    endpoint->hits[start] ++;
+    if (start >= endpoint->broken_from) {
+        conn.reply("503 Service Unavailable", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 503, \"message\": \"Backend Error\"}}");
+        return true;
+    }
+    conn.reply("206 Partial Content",
+               "Content-Range: bytes " + SizeHelper::itos(start) + "-" + SizeHelper::itos(end)
+               + "/" + SizeHelper::itos(endpoint->data.size()) + "\r\n",
+               endpoint->data.substr(start, end - start + 1));
+    return true;
+}
+
+void reset(Endpoint* endpoint, std::string etag, long long broken_from) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    endpoint->etag = etag;
+    endpoint->broken_from = broken_from;
+    endpoint->hits.clear();
+}
+
+int hits(Endpoint* endpoint, long long start) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    return endpoint->hits[start];
+}
+
+std::string read_file(std::string path) {
+    std::ifstream fin(path.c_str(), std::ios::binary);
+    std::stringstream ss;
+    ss << fin.rdbuf();
+    return ss.str();
+}
+
+// Ranges are fetched in order by a single worker, so the ones in front of
+// the broken one are exactly those that made it
+bool download(StandIn* server, Credential* cred, std::string path) {
+    FileDownloadRequest request(cred, server->uri("/files/journaled"), path);
+    request.set_range_size(RANGE_SIZE);
+    request.set_parallelism(1);
+    request.set_max_retries(0);
+    try {
+        request.execute();
+        return true;
+    } catch (DownloadException& e) {
+        std::cout << "Interrupted: " << e.error() << std::endl;
+        return false;
+    }
+}
+
+// The journal of the interrupted download has the ranges that made it to disk
+void check_journal(StandIn* server, Credential* cred, std::string path, int completed) {
+    FileGetRequest get(cred, server->uri("/files/journaled"));
+    GFile file = get.execute();
+    DownloadJournal journal(path + DOWNLOAD_JOURNAL_SUFFIX);
+    assert(journal.load(file));
+    assert((int)journal.completed().size() == completed);
+    for (int i = 0; i < completed; i ++) {
+        assert(journal.completed()[i].start == i * RANGE_SIZE);
+        assert(journal.completed()[i].end == (i + 1) * RANGE_SIZE - 1);
+    }
+}
+
+// A second run only fetches the ranges the first one didn't finish
+void test_resume(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path) {
+    reset(endpoint, "v1", 3 * RANGE_SIZE);
+    assert(!download(server, cred, path));
+    assert(hits(endpoint, 3 * RANGE_SIZE) == 1);
+    assert(hits(endpoint, 4 * RANGE_SIZE) == 0);
+    check_journal(server, cred, path, 3);
+
+    reset(endpoint, "v1", FILE_SIZE);
+    assert(download(server, cred, path));
+    for (int i = 0; i < RANGES; i ++) {
+        assert(hits(endpoint, i * RANGE_SIZE) == (i < 3 ? 0 : 1));
+    }
+    assert(read_file(path) == endpoint->data);
+    assert(access((path + DOWNLOAD_JOURNAL_SUFFIX).c_str(), F_OK) != 0);
+}
+
+// The journal of another version of the file is no good, everything is fetched again
+void test_etag_changed(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path) {
+    reset(endpoint, "v1", 2 * RANGE_SIZE);
+    assert(!download(server, cred, path));
+    check_journal(server, cred, path, 2);
+
+    reset(endpoint, "v2", FILE_SIZE);
+    assert(download(server, cred, path));
+    for (int i = 0; i < RANGES; i ++) {
+        assert(hits(endpoint, i * RANGE_SIZE) == 1);
+    }
+    assert(read_file(path) == endpoint->data);
+}
+
+int main(int argc, char** argv) {
+    std::string path = argc > 1 ? argv[1] : "/tmp/gdrive_download_journal.bin";
+    // a journal left by an earlier run would be resumed from
+    unlink((path + DOWNLOAD_JOURNAL_SUFFIX).c_str());
+
+    Endpoint endpoint;
+    endpoint.data.resize(FILE_SIZE);
+    srand(17);
+    for (size_t i = 0; i < endpoint.data.size(); i ++) {
+        endpoint.data[i] = rand() % 256;
+    }
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+    endpoint.server = &server;
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    test_resume(&server, &endpoint, &cred, path);
+    test_etag_changed(&server, &endpoint, &cred, path);
+
+    if (remove(path.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << path
+                  << "Please remove it manually" << std::endl;
+    }
+}
@@ -1,17 +1,61 @@
 #include "gdrive/store.hpp"
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <cassert>
 #include <iostream>
 
 using namespace GDRIVE;
 
+const char* STATIC_FILENAME = "/tmp/gdrive_filestore_static";
+
+// Constructed ahead of the StoreWriter and destroyed after it
+FileStore static_store __attribute__((init_priority(101))) (STATIC_FILENAME);
+
+// Saves static_store once the StoreWriter is gone, in the child process only
+struct LateDump {
+    LateDump() :armed(false) {}
+    ~LateDump() {
+        if (!armed) return;
+        static_store.put("late", "written");
+        static_store.dump_async();
+    }
+    bool armed;
+};
+LateDump late_dump __attribute__((init_priority(101)));
+
+// A store with static storage duration outlives the StoreWriter: what it has
+// scheduled is still written, and a save after the writer stopped is done
+// right away
+void test_static_store() {
+    unlink(STATIC_FILENAME);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        static_store.put("early", "written");
+        static_store.dump_async();
+        late_dump.armed = true;
+        exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    FileStore reloaded(STATIC_FILENAME);
+    assert(reloaded.get("early") == "written");
+    assert(reloaded.get("late") == "written");
+    unlink(STATIC_FILENAME);
+}
+
 int main(int argc, char** argv) {
     if (argc != 2){
         std::cerr << "Usage: ./proj store_filename" << std::endl;
         exit(-1);
     }
     std::string filename(argv[1]);
+    // before anything starts the StoreWriter's thread, which a child wouldn't have
+    test_static_store();
+
     FileStore fs(filename);
     std::string client_id = "client_id_with_random_char_cksjflaueklajfdal;s";
     std::string client_secret = "client_secret_with_random_char_dajla09alksfhfjalajsdfl";
@@ -24,6 +68,34 @@ int main(int argc, char** argv) {
     assert(fs.get("client_id") == client_id);
     assert(fs.get("client_secret") == client_secret);
 
+    // saves put off in quick succession are written once, with the last content
+    StoreWriterStats before = StoreWriter::get_instance().stats();
+    for (int i = 0; i < 1000; i ++) {
+        fs.put("access_token", "access_token_" + SizeHelper::itos(i));
+        fs.dump_async();
+    }
+    StoreWriter::get_instance().flush();
+    StoreWriterStats after = StoreWriter::get_instance().stats();
+    std::cout << after.scheduled - before.scheduled << " saves scheduled, "
+              << after.written - before.written << " written" << std::endl;
+    assert(after.scheduled - before.scheduled == 1000);
+    assert(after.written - before.written >= 1 && after.written - before.written <= 10);
+    assert(after.failed == before.failed);
+    FileStore coalesced(filename);
+    assert(coalesced.get("access_token") == "access_token_999");
+
+    // the store's own flush has its last content on disk, whatever the writer is up to
+    for (int i = 1000; i < 2000; i ++) {
+        fs.put("access_token", "access_token_" + SizeHelper::itos(i));
+        fs.dump_async();
+    }
+    assert(fs.flush());
+
+    FileStore reloaded(filename);
+    assert(reloaded.get("access_token") == "access_token_1999");
+    assert(reloaded.get("client_id") == client_id);
+    assert(access((filename + ".tmp").c_str(), F_OK) != 0);
+
     if (remove(filename.c_str()) != 0) {
         std::cerr << "Can't remove the file " << filename
                   << "Please remove it manually" << std::endl;
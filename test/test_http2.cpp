@@ -0,0 +1,63 @@
+#include "gdrive/request.hpp"
+#include "gdrive/connpool.hpp"
+#include "gdrive/asyncengine.hpp"
+#include <stdlib.h>
+#include <sys/time.h>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace GDRIVE;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Fires n concurrent GETs and reports connections opened and mean latency
+void run(std::string url, int n, std::string label) {
+    ConnectionPool::get_instance().clear();
+    long connects = ConnectionPool::get_instance().stats().connects;
+    std::vector<double> latency(n, 0);
+    std::vector<std::thread> threads;
+
+    double start = now();
+    for (int i = 0; i < n; i ++) {
+        threads.push_back(std::thread([&url, &latency, i]() {
+            HttpRequest request(url, RM_GET);
+            double begin = now();
+            HttpResponse& resp = request.request();
+            latency[i] = now() - begin;
+            assert(resp.status() == 200);
+        }));
+    }
+    for (int i = 0; i < n; i ++) {
+        threads[i].join();
+    }
+    double elapsed = now() - start;
+
+    double total = 0;
+    for (int i = 0; i < n; i ++) total += latency[i];
+    std::cout << label << ": " << n << " requests in " << elapsed << "s, "
+              << ConnectionPool::get_instance().stats().connects - connects << " connections, "
+              << "mean latency " << total / n * 1000 << "ms" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: ./test_http2 h2_server_url [concurrency]" << std::endl;
+        exit(-1);
+    }
+    std::string url(argv[1]);
+    int n = argc > 2 ? atoi(argv[2]) : 100;
+
+    run(url, n, "HTTP/1.1");
+
+    AsyncEngine& engine = AsyncEngine::get_instance();
+    // a local test server usually speaks cleartext h2
+    engine.set_http_version(url.find("http://") == 0 ? HV_HTTP2_PRIOR_KNOWLEDGE : HV_HTTP2);
+    engine.set_max_concurrent_streams(n);
+    run(url, n, "HTTP/2");
+}
@@ -0,0 +1,203 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/ratelimit.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <cassert>
+#include <iostream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <vector>
+
+using namespace GDRIVE;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// State of the stand-in endpoint. A request takes ms milliseconds if the
+// query has ?ms=<ms>; the hits of a path listed in limited are answered
+// with the rate limit error given there, the others with 200.
+struct Endpoint {
+    std::mutex mutex;
+    std::map<std::string, int> hits;
+    // path and hit number -> 403 or 429
+    std::map<std::pair<std::string, int>, int> limited;
+};
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::string target = request_line.substr(request_line.find(' ') + 1);
+    target = target.substr(0, target.find(' '));
+    std::string path = target.substr(0, target.find('?'));
+    size_t ms = target.find("ms=");
+    if (ms != std::string::npos) {
+        usleep(atoi(target.c_str() + ms + 3) * 1000);
+    }
+
+    int status;
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        int hits = ++ endpoint->hits[path];
+        std::map<std::pair<std::string, int>, int>::iterator iter = endpoint->limited.find(std::make_pair(path, hits));
+        status = iter == endpoint->limited.end() ? 200 : iter->second;
+    }
+    if (status == 403) {
+        conn.reply("403 Forbidden", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"errors\": [{\"domain\": \"usageLimits\", \"reason\": \"rateLimitExceeded\", "
+                   "\"message\": \"Rate Limit Exceeded\"}], \"code\": 403, \"message\": \"Rate Limit Exceeded\"}}");
+    } else if (status == 429) {
+        conn.reply("429 Too Many Requests", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 429, \"message\": \"Too Many Requests\"}}");
+    } else {
+        conn.reply("200 OK", "Content-Type: application/json\r\n", "{\"kind\": \"drive#file\"}");
+    }
+    return true;
+}
+
+void limit(Endpoint* endpoint, std::string path, int hit, int status) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    endpoint->limited[std::make_pair(path, hit)] = status;
+}
+
+// Sends count GETs one after the other, returns the seconds they took
+double send(StandIn* server, Credential* cred, std::string path, int count) {
+    double start = now();
+    for (int i = 0; i < count; i ++) {
+        CredentialHttpRequest request(cred, server->uri(path), RM_GET);
+        // the rate limit errors are the limiter's to see, not the retry policy's
+        request.set_retry_policy(NULL);
+        request.request();
+    }
+    return now() - start;
+}
+
+// A configured class goes out at its rate once its burst is used up, the
+// other classes aren't held up by it
+void test_pacing(StandIn* server, Credential* cred) {
+    cred->rate_limiter().set_rate(RC_GET, 20, 5);
+    double seconds = send(server, cred, "/drive/v2/files/paced", 45);
+    RateLimitStats stats = cred->rate_limiter().stats(RC_GET);
+    std::cout << "45 gets at 20/s after a burst of 5: " << seconds << "s, " << stats.throttled << " throttled" << std::endl;
+    assert(seconds >= 1.9 && seconds < 3);
+    assert(stats.admitted == 45 && stats.throttled >= 39);
+    assert(stats.rate == 20 && stats.limit == 0);
+
+    assert(send(server, cred, "/drive/v2/files", 45) < 1);
+    assert(cred->rate_limiter().stats(RC_LIST).throttled == 0);
+}
+
+// Async requests wait for their turn in the engine
+void test_async_pacing(StandIn* server, Credential* cred) {
+    cred->rate_limiter().set_rate(RC_GET, 20, 5);
+    std::vector<std::unique_ptr<CredentialHttpRequest> > requests;
+    std::vector<std::future<void> > futures;
+    double start = now();
+    for (int i = 0; i < 25; i ++) {
+        requests.push_back(std::unique_ptr<CredentialHttpRequest>(
+            new CredentialHttpRequest(cred, server->uri("/drive/v2/files/async"), RM_GET)));
+        std::shared_ptr<std::promise<void> > promise(new std::promise<void>());
+        futures.push_back(promise->get_future());
+        requests.back()->request_async([promise](std::exception_ptr error) {
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value();
+            }
+        });
+    }
+    // every call returned at once, the waiting is the engine's
+    assert(now() - start < 0.5);
+    for (size_t i = 0; i < futures.size(); i ++) {
+        futures[i].get();
+        assert(requests[i]->response().status() == 200);
+    }
+    std::cout << "25 async gets at 20/s after a burst of 5: " << now() - start << "s" << std::endl;
+    assert(now() - start >= 0.9);
+}
+
+// Without a configured rate everything goes through until a rate limit
+// error; the rate is then cut below what got through, a burst of errors
+// from requests already in flight cuts it once, and it climbs back to just
+// under the limit
+void test_backoff(StandIn* server, Endpoint* endpoint, Credential* cred) {
+    std::string path = "/drive/v2/files/adaptive";
+    std::string uri = path + "?ms=20";
+    limit(endpoint, path, 40, 403);
+    send(server, cred, uri, 39);
+    RateLimitStats stats = cred->rate_limiter().stats(RC_GET);
+    assert(stats.throttled == 0 && stats.rate == 0);
+
+    send(server, cred, uri, 1);
+    stats = cred->rate_limiter().stats(RC_GET);
+    std::cout << "Rate limited at " << stats.limit << "/s, going on at " << stats.rate << "/s" << std::endl;
+    assert(stats.rate_limited == 1);
+    // one request every 20ms or a bit more got through
+    assert(stats.limit > 10 && stats.limit <= 50);
+    assert(stats.rate >= stats.limit * RATE_LIMIT_BACKOFF - 0.01 && stats.rate < stats.limit * RATE_LIMIT_BACKOFF + 1);
+    double cut_limit = stats.limit, cut_rate = stats.rate;
+
+    limit(endpoint, path, 41, 429);
+    limit(endpoint, path, 42, 429);
+    send(server, cred, uri, 2);
+    stats = cred->rate_limiter().stats(RC_GET);
+    assert(stats.rate_limited == 3);
+    assert(stats.limit >= cut_limit && stats.rate >= cut_rate);
+
+    // below the limit every request waits its turn now
+    send(server, cred, uri, 20);
+    stats = cred->rate_limiter().stats(RC_GET);
+    assert(stats.throttled > 0);
+
+    // (0.95 - 0.8) / 0.05 per second makes 3s to get back
+    double start = now();
+    while (now() - start < 3.5) {
+        send(server, cred, uri, 1);
+    }
+    stats = cred->rate_limiter().stats(RC_GET);
+    std::cout << "Recovered to " << stats.rate << "/s of " << stats.limit << "/s" << std::endl;
+    assert(stats.rate >= stats.limit * RATE_LIMIT_TARGET * 0.99 && stats.rate <= stats.limit * RATE_LIMIT_TARGET + 0.01);
+
+    // a 429 once the hold is over cuts again
+    int hits;
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        hits = endpoint->hits[path];
+    }
+    limit(endpoint, path, hits + 1, 429);
+    send(server, cred, uri, 1);
+    stats = cred->rate_limiter().stats(RC_GET);
+    assert(stats.rate_limited == 4);
+    assert(stats.rate < stats.limit * RATE_LIMIT_BACKOFF + 1);
+}
+
+Credential* credential(MemoryStore* store) {
+    store->put("access_token", "stand-in");
+    store->put("refresh_token", "stand-in");
+    return new Credential(store);
+}
+
+int main() {
+    Endpoint endpoint;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+
+    // a credential of its own for each, the limiter is part of it
+    MemoryStore paced_store, async_store, adaptive_store;
+    std::unique_ptr<Credential> paced(credential(&paced_store));
+    std::unique_ptr<Credential> async(credential(&async_store));
+    std::unique_ptr<Credential> adaptive(credential(&adaptive_store));
+
+    test_pacing(&server, paced.get());
+    test_async_pacing(&server, async.get());
+    test_backoff(&server, &endpoint, adaptive.get());
+}
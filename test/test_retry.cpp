@@ -0,0 +1,207 @@
+#include "gdrive/request.hpp"
+#include "gdrive/asyncengine.hpp"
+#include "gdrive/error.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <cassert>
+#include <iostream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <vector>
+
+using namespace GDRIVE;
+
+const int ASYNC_REQUESTS = 20;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// State of the stand-in endpoint. A request for /<name>?fail=<n>&after=<s>
+// is answered with 503 the first n times, with a Retry-After of s seconds if
+// after is given, and with 200 from then on.
+struct Endpoint {
+    std::mutex mutex;
+    // requests that came in for each path
+    std::map<std::string, int> hits;
+};
+
+std::string param(std::string target, std::string name) {
+    size_t pos = target.find(name + "=");
+    if (pos == std::string::npos) return "";
+    pos += name.size() + 1;
+    return target.substr(pos, target.find('&', pos) - pos);
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::string target = request_line.substr(request_line.find(' ') + 1);
+    target = target.substr(0, target.find(' '));
+    std::string path = target.substr(0, target.find('?'));
+
+    int hits;
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        hits = ++ endpoint->hits[path];
+    }
+    if (hits <= atoi(param(target, "fail").c_str())) {
+        std::string after = param(target, "after");
+        conn.reply("503 Service Unavailable", after == "" ? "" : "Retry-After: " + after + "\r\n",
+                   "{\"error\": {\"code\": 503, \"message\": \"Backend Error\"}}");
+    } else {
+        conn.reply("200 OK", "Content-Type: application/json\r\n", "{\"path\": \"" + path + "\"}");
+    }
+    return true;
+}
+
+int hits(Endpoint* endpoint, std::string path) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    return endpoint->hits[path];
+}
+
+std::future<void> request_async(HttpRequest* request) {
+    std::shared_ptr<std::promise<void> > promise(new std::promise<void>());
+    request->request_async([promise](std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value();
+        }
+    });
+    return promise->get_future();
+}
+
+// A 503 is tried again and the request ends with the 200 after it
+void test_recovered(StandIn* server, Endpoint* endpoint) {
+    RetryPolicy policy;
+    policy.set_backoff(0.01, 2, 0.1);
+    HttpRequest request(server->uri("/recovered?fail=1"), RM_GET);
+    request.set_retry_policy(&policy);
+    assert(request.request().status() == 200);
+    assert(hits(endpoint, "/recovered") == 2);
+    RetryStats stats = policy.stats();
+    assert(stats.retries == 1 && stats.status_retries == 1 && stats.recovered == 1 && stats.exhausted == 0);
+}
+
+// The wait is never shorter than the server's Retry-After
+void test_retry_after(StandIn* server, Endpoint* endpoint) {
+    RetryPolicy policy;
+    policy.set_backoff(0.01, 2, 0.1);
+    HttpRequest request(server->uri("/after?fail=1&after=1"), RM_GET);
+    request.set_retry_policy(&policy);
+    double start = now();
+    assert(request.request().status() == 200);
+    std::cout << "Retry-After of 1s, done after " << now() - start << "s" << std::endl;
+    assert(now() - start >= 1);
+    assert(hits(endpoint, "/after") == 2);
+}
+
+// A POST may have done something already, its 503 is the answer
+void test_post(StandIn* server, Endpoint* endpoint) {
+    RetryPolicy policy;
+    policy.set_backoff(0.01, 2, 0.1);
+    RequestHeader header;
+    HttpRequest request(server->uri("/post?fail=1"), RM_POST, header, "{}");
+    request.set_retry_policy(&policy);
+    assert(request.request().status() == 503);
+    assert(hits(endpoint, "/post") == 1);
+    assert(policy.stats().retries == 0);
+}
+
+// Once the attempts are used up the last failure is the answer
+void test_exhausted(StandIn* server, Endpoint* endpoint) {
+    RetryPolicy policy;
+    policy.set_backoff(0.01, 2, 0.1);
+    policy.set_max_attempts(3);
+    HttpRequest request(server->uri("/exhausted?fail=100"), RM_GET);
+    request.set_retry_policy(&policy);
+    assert(request.request().status() == 503);
+    assert(hits(endpoint, "/exhausted") == 3);
+    RetryStats stats = policy.stats();
+    assert(stats.retries == 2 && stats.recovered == 0 && stats.exhausted == 1);
+}
+
+// Waiting retries of async requests sit in the engine, no thread sleeps for them
+void test_async_retry(StandIn* server, Endpoint* endpoint, RetryPolicy* policy) {
+    std::vector<HttpRequest*> requests;
+    std::vector<std::future<void> > futures;
+    for (int i = 0; i < ASYNC_REQUESTS; i ++) {
+        requests.push_back(new HttpRequest(server->uri("/async" + SizeHelper::itos(i) + "?fail=1&after=2"), RM_GET));
+        requests.back()->set_retry_policy(policy);
+        futures.push_back(request_async(requests.back()));
+    }
+    double start = now();
+    while (true) {
+        int answered = 0;
+        for (int i = 0; i < ASYNC_REQUESTS; i ++) {
+            answered += hits(endpoint, "/async" + SizeHelper::itos(i));
+        }
+        if (answered == ASYNC_REQUESTS) break;
+        assert(now() - start < 1);
+        usleep(10 * 1000);
+    }
+    usleep(300 * 1000);
+    std::cout << "Async: " << AsyncEngine::get_instance().in_flight() << " retries waiting in the engine" << std::endl;
+    assert(AsyncEngine::get_instance().in_flight() == ASYNC_REQUESTS);
+
+    for (int i = 0; i < ASYNC_REQUESTS; i ++) {
+        futures[i].get();
+        assert(requests[i]->response().status() == 200);
+        assert(hits(endpoint, "/async" + SizeHelper::itos(i)) == 2);
+        delete requests[i];
+    }
+    // Retry-After holds the second attempt back
+    assert(now() - start >= 2);
+}
+
+// A cancelled token takes a waiting retry out of the engine at once
+void test_async_cancel(StandIn* server, Endpoint* endpoint, RetryPolicy* policy) {
+    CancellationToken token;
+    HttpRequest request(server->uri("/cancel?fail=1&after=30"), RM_GET);
+    request.set_retry_policy(policy);
+    request.set_cancellation_token(&token);
+    std::future<void> future = request_async(&request);
+    while (hits(endpoint, "/cancel") == 0) {
+        usleep(10 * 1000);
+    }
+    usleep(200 * 1000);
+    assert(AsyncEngine::get_instance().in_flight() == 1);
+
+    double start = now();
+    token.cancel();
+    try {
+        future.get();
+        assert(false);
+    } catch (CancelledException& e) {
+    }
+    std::cout << "Cancelled a retry wait in " << now() - start << "s" << std::endl;
+    assert(now() - start < 0.5);
+    assert(hits(endpoint, "/cancel") == 1);
+    assert(AsyncEngine::get_instance().in_flight() == 0);
+}
+
+int main() {
+    Endpoint endpoint;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+
+    test_recovered(&server, &endpoint);
+    test_retry_after(&server, &endpoint);
+    test_post(&server, &endpoint);
+    test_exhausted(&server, &endpoint);
+
+    RetryPolicy policy;
+    policy.set_backoff(0.01, 2, 0.1);
+    test_async_retry(&server, &endpoint, &policy);
+    test_async_cancel(&server, &endpoint, &policy);
+}
@@ -0,0 +1,182 @@
+#include "gdrive/request.hpp"
+#include "gdrive/sink.hpp"
+#include "gdrive/error.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <cassert>
+#include <iostream>
+#include <vector>
+
+using namespace GDRIVE;
+using namespace JCONER;
+
+// A list page that trips up a parser looking for "items" naively: the word
+// shows up as a value, inside a string next to brackets and escaped quotes,
+// and as a key inside the items themselves, which also nest arrays
+const std::string PAGE =
+    "{\n"
+    " \"kind\": \"drive#fileList\",\n"
+    " \"etag\": \"items\",\n"
+    " \"selfLink\": \"x\\\"items\\\": [{\\\"id\\\": \\\"fake\\\"}]\",\n"
+    " \"items\" : [\n"
+    "  {\"id\": \"a\", \"title\": \"br]ck}e{t[s\\\\\", \"parents\": [{\"id\": \"p1\"}, {\"id\": \"p2\"}],"
+    " \"matrix\": [[1, 2], [], [[3]]]},\n"
+    "  {\"id\": \"b\", \"items\": [{\"id\": \"inner\"}], \"labels\": {\"items\": \"x\"}},\n"
+    "  {\"id\": \"c\\\"\"}\n"
+    " ],\n"
+    " \"nextPageToken\": \"items\"\n"
+    "}\n";
+const size_t BODY_SIZE = 1000;
+
+void collect(JObject* item, void* context) {
+    std::vector<std::string>* ids = (std::vector<std::string>*)context;
+    ids->push_back(((JString*)item->get("id"))->getValue());
+}
+
+void check_page(JsonItemSink& sink, std::vector<std::string>& ids) {
+    assert(sink.items() == 3);
+    assert(ids.size() == 3 && ids[0] == "a" && ids[1] == "b" && ids[2] == "c\"");
+    JObject* envelope = sink.envelope();
+    assert(envelope != NULL);
+    assert(((JString*)envelope->get("nextPageToken"))->getValue() == "items");
+    assert(((JString*)envelope->get("etag"))->getValue() == "items");
+    delete envelope;
+}
+
+// The page split in two at every byte, then fed one byte at a time
+void test_json_splits() {
+    for (size_t split = 0; split <= PAGE.size(); split ++) {
+        std::vector<std::string> ids;
+        JsonItemSink sink(collect, &ids);
+        assert(JsonItemSink::write((void*)PAGE.data(), 1, split, &sink) == split);
+        assert(JsonItemSink::write((void*)(PAGE.data() + split), 1, PAGE.size() - split, &sink) == PAGE.size() - split);
+        check_page(sink, ids);
+    }
+
+    std::vector<std::string> ids;
+    JsonItemSink sink(collect, &ids);
+    for (size_t i = 0; i < PAGE.size(); i ++) {
+        JsonItemSink::write((void*)(PAGE.data() + i), 1, 1, &sink);
+    }
+    check_page(sink, ids);
+
+    // the last page of a listing has no items at all
+    std::string empty = "{\"kind\": \"drive#fileList\", \"items\": []}";
+    std::vector<std::string> none;
+    JsonItemSink empty_sink(collect, &none);
+    JsonItemSink::write((void*)empty.data(), 1, empty.size(), &empty_sink);
+    assert(empty_sink.items() == 0 && none.empty());
+}
+
+std::string read_fd(int fd) {
+    std::string content;
+    char buffer[4096];
+    ssize_t n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        content.append(buffer, n);
+    }
+    return content;
+}
+
+// Appends or writes at an offset, and stops at the limit in the middle of a chunk
+void test_fd(std::string path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    FdSink append(fd, -1, 10);
+    assert(FdSink::write((void*)"012345", 1, 6, &append) == 6);
+    assert(FdSink::write((void*)"6789ab", 1, 6, &append) == 4);
+    assert(append.written() == 10);
+    assert(read_fd(fd) == "0123456789");
+
+    FdSink placed(fd, 4);
+    assert(FdSink::write((void*)"xy", 1, 2, &placed) == 2);
+    assert(FdSink::write((void*)"z", 1, 1, &placed) == 1);
+    assert(placed.written() == 3);
+    assert(read_fd(fd) == "0123xyz789");
+    close(fd);
+    unlink(path.c_str());
+}
+
+// A chunk that doesn't fit is refused whole, the region is left as it was
+void test_mmap() {
+    char region[10];
+    memset(region, '-', sizeof(region));
+    MmapSink sink(region, sizeof(region));
+    assert(MmapSink::write((void*)"012345", 1, 6, &sink) == 6);
+    assert(MmapSink::write((void*)"6789ab", 1, 6, &sink) == 0);
+    assert(sink.written() == 6);
+    assert(std::string(region, sizeof(region)) == "012345----");
+    assert(MmapSink::write((void*)"6789", 1, 4, &sink) == 4);
+    assert(std::string(region, sizeof(region)) == "0123456789");
+}
+
+bool handle(Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    if (request_line.find("GET /page") == 0) {
+        conn.reply("200 OK", "Content-Type: application/json\r\n", PAGE);
+    } else {
+        conn.reply("200 OK", "Content-Type: application/octet-stream\r\n", std::string(BODY_SIZE, 'x'));
+    }
+    return true;
+}
+
+// The sinks behind real transfers: items come out of a page, and a body too
+// large for its sink fails the request instead of being cut silently
+void test_transfers(StandIn* server, std::string path) {
+    std::vector<std::string> ids;
+    JsonItemSink items(collect, &ids);
+    HttpRequest list(server->uri("/page"), RM_GET);
+    list.set_response_sink(JsonItemSink::write, &items);
+    assert(list.request().status() == 200);
+    assert(list.response().content() == "");
+    check_page(items, ids);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    FdSink limited(fd, -1, BODY_SIZE / 2);
+    HttpRequest big(server->uri("/big"), RM_GET);
+    big.set_retry_policy(NULL);
+    big.set_response_sink(FdSink::write, &limited);
+    try {
+        big.request();
+        assert(false);
+    } catch (CurlException& e) {
+        std::cout << "Over the FdSink limit: " << e.error() << std::endl;
+    }
+    assert(limited.written() == (long long)BODY_SIZE / 2);
+    assert(read_fd(fd) == std::string(BODY_SIZE / 2, 'x'));
+    close(fd);
+    unlink(path.c_str());
+
+    std::vector<char> region(BODY_SIZE / 2);
+    MmapSink mapped(&region[0], region.size());
+    HttpRequest overflow(server->uri("/big"), RM_GET);
+    overflow.set_retry_policy(NULL);
+    overflow.set_response_sink(MmapSink::write, &mapped);
+    try {
+        overflow.request();
+        assert(false);
+    } catch (CurlException& e) {
+        std::cout << "Over the MmapSink region: " << e.error() << std::endl;
+    }
+    assert(mapped.written() <= region.size());
+}
+
+int main(int argc, char** argv) {
+    std::string path = argc > 1 ? argv[1] : "/tmp/gdrive_sink.bin";
+
+    test_json_splits();
+    test_fd(path);
+    test_mmap();
+
+    StandIn server(handle);
+    test_transfers(&server, path);
+}
@@ -0,0 +1,237 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/uploadmanager.hpp"
+#include "gdrive/md5.hpp"
+#include "gdrive/error.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <cassert>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+using namespace GDRIVE;
+
+const int FILE_COUNT = 400;
+const int WORKERS = 4;
+const int BATCH_FILES = 50;
+// added to every HTTP request the stand-in answers, as the round trip to Drive would be
+const int LATENCY_MS = 5;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// State of the stand-in upload and batch endpoints. Uploads are answered
+// with the md5 of the content it received; a file titled "reject..." gets a 400.
+struct Endpoint {
+    std::mutex mutex;
+    int requests;
+    int uploads;
+};
+
+std::string json_string(std::string json, std::string key) {
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos) return "";
+    pos = json.find('"', json.find(':', pos) + 1) + 1;
+    return json.substr(pos, json.find('"', pos) - pos);
+}
+
+// status line and body of the answer to one upload
+std::string upload(Endpoint* endpoint, std::string content_type, std::string body, std::string& json) {
+    std::string title, content;
+    size_t pos = content_type.find("boundary=\"");
+    if (pos != std::string::npos) {
+        pos += 10;
+        std::string boundary = "--" + content_type.substr(pos, content_type.find('"', pos) - pos);
+        size_t metadata = body.find("\n\n") + 2;
+        title = json_string(body.substr(metadata, body.find(boundary, metadata) - metadata), "title");
+        size_t start = body.find("\n\n", body.find(boundary, metadata)) + 2;
+        content = body.substr(start, body.rfind("\n" + boundary + "--") - start);
+    } else {
+        content = body;
+    }
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    int n = endpoint->uploads ++;
+    if (title.compare(0, 6, "reject") == 0) {
+        json = "{\"error\": {\"code\": 400, \"message\": \"Rejected\"}}";
+        return "400 Bad Request";
+    }
+    MD5 md5;
+    md5.update(content.data(), content.size());
+    json = "{\"id\": \"file" + SizeHelper::itos(n) + "\", \"title\": \"" + title + "\", \"fileSize\": "
+         + SizeHelper::itos(content.size()) + ", \"md5Checksum\": \"" + md5.hexdigest() + "\"}";
+    return "200 OK";
+}
+
+std::string batch(Endpoint* endpoint, std::string content_type, std::string body) {
+    std::string boundary = "--" + content_type.substr(content_type.find("boundary=") + 9);
+    VarString vs;
+    size_t start = body.find(boundary);
+    while (start != std::string::npos) {
+        start += boundary.size();
+        if (body.compare(start, 2, "--") == 0) break;
+        size_t next = body.find(boundary, start);
+        std::string part = body.substr(start + 2, next - start - 4);
+
+        // part headers, blank line, request line and headers, blank line, body
+        size_t sep = part.find("\r\n\r\n");
+        std::string part_header = part.substr(0, sep);
+        size_t id_pos = part_header.find("<item") + 5;
+        std::string id = part_header.substr(id_pos, part_header.find('>', id_pos) - id_pos);
+        std::string request = part.substr(sep + 4);
+        sep = request.find("\r\n\r\n");
+        StandInHeaders headers;
+        parse_head(request.substr(0, sep + 2), headers);
+
+        std::string json;
+        std::string status = upload(endpoint, headers["content-type"], request.substr(sep + 4), json);
+        vs.append("--batch_standin\r\n")
+          .append("Content-Type: application/http\r\n")
+          .append("Content-ID: <response-item").append(id).append(">\r\n\r\n")
+          .append("HTTP/1.1 ").append(status).append("\r\n")
+          .append("Content-Type: application/json\r\n\r\n")
+          .append(json).append("\r\n");
+        start = next;
+    }
+    vs.append("--batch_standin--\r\n");
+    return vs.toString();
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->requests ++;
+    }
+    usleep(LATENCY_MS * 1000);
+
+    std::string status, content_type, content;
+    if (request_line.find(" /batch") != std::string::npos) {
+        status = "200 OK";
+        content_type = "multipart/mixed; boundary=batch_standin";
+        content = batch(endpoint, headers["content-type"], body);
+    } else {
+        status = upload(endpoint, headers["content-type"], body, content);
+        content_type = "application/json";
+    }
+    conn.reply(status, "Content-Type: " + content_type + "\r\n", content);
+    return true;
+}
+
+// Uploads every file through an UploadManager and returns files per second
+double run(StandIn* server, Endpoint* endpoint, Credential* cred, std::vector<FileContent*>& contents,
+           std::vector<std::string>& md5s, int batch_files, std::string label) {
+    endpoint->requests = 0;
+    endpoint->uploads = 0;
+    UploadManager manager(cred, WORKERS);
+    manager.set_upload_uri(server->uri("/upload/drive/v2/files"));
+    manager.set_batch_uri(server->uri("/batch/drive/v2"));
+    manager.set_batching(batch_files);
+
+    std::vector<int> jobs;
+    double start = now();
+    for (size_t i = 0; i < contents.size(); i ++) {
+        GFile file;
+        // every tenth file has no metadata and goes out as a media upload
+        if (i % 10 != 0) {
+            file.set_title((i == 7 ? "reject" : "file") + SizeHelper::itos(i));
+        }
+        jobs.push_back(manager.add(file, contents[i]));
+    }
+    manager.wait();
+    double elapsed = now() - start;
+
+    UploadManagerStats stats = manager.stats();
+    assert(stats.done == contents.size() - 1);
+    assert(stats.failed == 1);
+    for (size_t i = 0; i < jobs.size(); i ++) {
+        UploadJobStatus status = manager.status(jobs[i]);
+        if (i == 7) {
+            // only the rejected file fails, whatever batch it was in
+            assert(status.state == UJ_FAILED);
+            try {
+                std::rethrow_exception(status.error);
+            } catch (GoogleJsonResponseException& e) {
+            }
+            continue;
+        }
+        assert(status.state == UJ_DONE);
+        assert(status.result.get_md5Checksum() == md5s[i]);
+        assert(status.result.get_fileSize() == contents[i]->get_length());
+        if (i % 10 != 0) {
+            assert(status.result.get_title() == "file" + SizeHelper::itos(i));
+        }
+    }
+    if (batch_files > 1) {
+        assert(stats.batches > 0);
+    }
+
+    double rate = contents.size() / elapsed;
+    std::cout << label << ": " << contents.size() << " files in " << elapsed << "s, "
+              << endpoint->requests << " requests, " << stats.batches << " batches, "
+              << rate << " files/s" << std::endl;
+    return rate;
+}
+
+int main(int argc, char** argv) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp/gdrive_upload_batch";
+    std::string cmd = "mkdir -p " + dir;
+    int rst = system(cmd.c_str());
+    assert(rst == 0);
+
+    // small files of a few hundred bytes to 4KiB
+    std::vector<std::string> paths;
+    std::vector<std::string> md5s;
+    std::vector<FileContent*> contents;
+    srand(19);
+    for (int i = 0; i < FILE_COUNT; i ++) {
+        std::string data(100 + rand() % (4 * 1024 - 100), '\0');
+        for (size_t j = 0; j < data.size(); j ++) {
+            data[j] = rand() % 256;
+        }
+        std::string path = dir + "/" + SizeHelper::itos(i);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        ssize_t written = write(fd, data.data(), data.size());
+        assert(written == (ssize_t)data.size());
+        close(fd);
+
+        MD5 md5;
+        md5.update(data.data(), data.size());
+        paths.push_back(path);
+        md5s.push_back(md5.hexdigest());
+        contents.push_back(new MmapFileContent(path, "application/octet-stream"));
+    }
+
+    Endpoint endpoint;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    double single = run(&server, &endpoint, &cred, contents, md5s, 0, "One request per file");
+    double batched = run(&server, &endpoint, &cred, contents, md5s, BATCH_FILES, "Batches of " + SizeHelper::itos(BATCH_FILES));
+    std::cout << "Batching uploads " << batched / single << "x the files per second" << std::endl;
+    assert(batched > single);
+
+    for (int i = 0; i < FILE_COUNT; i ++) {
+        delete contents[i];
+        unlink(paths[i].c_str());
+    }
+    rmdir(dir.c_str());
+}
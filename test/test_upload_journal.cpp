@@ -0,0 +1,233 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/upload.hpp"
+#include "gdrive/store.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#include <map>
+#include <set>
+
+using namespace GDRIVE;
+
+const long long CHUNK_SIZE = RESUMABLE_CHUNK_SIZE;
+const long long FILE_SIZE = 4 * CHUNK_SIZE + 1000;
+// the uploading process is killed while the chunk that ends here is answered
+const long long KILL_AT = 2 * CHUNK_SIZE;
+// of the chunk it was killed in, the server only kept this much
+const long long KEPT = KILL_AT - 1000;
+
+// State of the stand-in resumable upload endpoint. Every session keeps the
+// bytes it was sent; a status query finds the last chunk before the kill
+// cut short, and a session in expired is answered with 404.
+struct Endpoint {
+    StandIn* server;
+    std::mutex mutex;
+    pid_t child;
+    int sessions;
+    int queries;
+    std::set<std::string> expired;
+    std::map<std::string, long long> totals;
+    std::map<std::string, std::string> received;
+    // first byte of the first chunk a session got after a status query
+    std::map<std::string, long long> resumed_at;
+};
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::string path = request_line.substr(request_line.find(' ') + 1);
+    path = path.substr(0, path.find_first_of(" ?"));
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+
+    if (request_line.find("POST ") == 0) {
+        std::string session = "/session/" + SizeHelper::itos(endpoint->sessions ++);
+        endpoint->totals[session] = SizeHelper::stoll(headers["x-upload-content-length"]);
+        conn.reply("200 OK", "Location: " + endpoint->server->uri(session) + "\r\n", "");
+        return true;
+    }
+    if (endpoint->expired.count(path)) {
+        conn.reply("404 Not Found", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 404, \"message\": \"Upload session expired\"}}");
+        return true;
+    }
+
+    std::string& received = endpoint->received[path];
+    std::string range = headers["content-range"];
+    if (range.find("*/") != std::string::npos) {
+        endpoint->queries ++;
+        if ((long long)received.size() == KILL_AT) {
+            received.resize(KEPT);
+        }
+        endpoint->resumed_at[path] = -1;
+        conn.reply("308 Resume Incomplete", "Range: bytes=0-" + SizeHelper::itos(received.size() - 1) + "\r\n", "");
+        return true;
+    }
+    long long first = SizeHelper::stoll(range.substr(range.find(' ') + 1));
+    if (first != (long long)received.size()) {
+        conn.reply("400 Bad Request", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 400, \"message\": \"Unexpected chunk\"}}");
+        return true;
+    }
+    if (endpoint->resumed_at.count(path) && endpoint->resumed_at[path] < 0) {
+        endpoint->resumed_at[path] = first;
+    }
+    received += body;
+    if ((long long)received.size() == KILL_AT && endpoint->child > 0) {
+        // the chunk made it, the answer to it never does
+        kill(endpoint->child, SIGKILL);
+        endpoint->child = 0;
+        return false;
+    }
+    if ((long long)received.size() < endpoint->totals[path]) {
+        conn.reply("308 Resume Incomplete", "Range: bytes=0-" + SizeHelper::itos(received.size() - 1) + "\r\n", "");
+    } else {
+        MD5 md5;
+        md5.update(received.data(), received.size());
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"id\": \"upload" + path.substr(9) + "\", \"md5Checksum\": \"" + md5.hexdigest() + "\"}");
+    }
+    return true;
+}
+
+GFile upload(StandIn* server, Credential* cred, UploadJournal* journal, std::string filename, bool async) {
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+    FileContent content(fin, "application/octet-stream");
+    GFile file;
+    FileInsertRequest insert(&content, &file, cred, server->uri("/upload"), true);
+    insert.set_adaptive_chunk_size(false);
+    insert.set_chunk_size(CHUNK_SIZE);
+    insert.set_journal(journal, filename);
+    return async ? insert.execute_async().get() : insert.execute();
+}
+
+// A process uploading with the journal in store_path is killed in the middle
+// of its session, which is returned
+std::string interrupted(StandIn* server, Endpoint* endpoint, std::string filename, std::string store_path) {
+    pid_t pid;
+    int sessions;
+    {
+        // the stand-in only sees the child's requests once it knows whom to kill
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        sessions = endpoint->sessions;
+        pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            FileStore store(store_path);
+            UploadJournal journal(&store);
+            MemoryStore tokens;
+            tokens.put("access_token", "stand-in");
+            tokens.put("refresh_token", "stand-in");
+            Credential cred(&tokens);
+            upload(server, &cred, &journal, filename, false);
+            _exit(0);
+        }
+        endpoint->child = pid;
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+    std::string session = "/session/" + SizeHelper::itos(sessions);
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(endpoint->sessions == sessions + 1);
+    assert((long long)endpoint->received[session].size() == KILL_AT);
+    return session;
+}
+
+// The next run finds the session in the journal, asks the server how far it
+// got and goes on from there instead of opening another session
+void test_resume(StandIn* server, Endpoint* endpoint, std::string filename, std::string store_path,
+                 std::string& data, Credential* cred) {
+    std::string session = interrupted(server, endpoint, filename, store_path);
+
+    FileStore store(store_path);
+    UploadJournal journal(&store);
+    UploadSession journaled;
+    assert(journal.load(filename, journaled));
+    assert(journaled.uri == server->uri(session));
+
+    GFile uploaded = upload(server, cred, &journal, filename, false);
+    assert(uploaded.get_id() == "upload" + session.substr(9));
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(endpoint->sessions == 1);
+    assert(endpoint->queries == 1);
+    // from the Range of the server, not from the end of the chunk it got
+    assert(endpoint->resumed_at[session] == KEPT);
+    assert(endpoint->received[session] == data);
+    assert(!journal.load(filename, journaled));
+}
+
+// A session that expired meanwhile is given up, a new one sends everything
+void test_expired(StandIn* server, Endpoint* endpoint, std::string filename, std::string store_path,
+                  std::string& data, Credential* cred) {
+    std::string session = interrupted(server, endpoint, filename, store_path);
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->expired.insert(session);
+    }
+
+    FileStore store(store_path);
+    UploadJournal journal(&store);
+    GFile uploaded = upload(server, cred, &journal, filename, true);
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    std::string fresh = "/session/" + SizeHelper::itos(endpoint->sessions - 1);
+    assert(fresh != session);
+    assert(uploaded.get_id() == "upload" + fresh.substr(9));
+    assert((long long)endpoint->received[session].size() == KILL_AT);
+    assert(endpoint->received[fresh] == data);
+    assert(endpoint->resumed_at.count(fresh) == 0);
+    UploadSession journaled;
+    assert(!journal.load(filename, journaled));
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "/tmp/gdrive_upload_journal.bin";
+    std::string store_path = filename + ".store";
+    unlink(store_path.c_str());
+
+    std::string data(FILE_SIZE, '\0');
+    srand(23);
+    for (size_t i = 0; i < data.size(); i ++) {
+        data[i] = rand() % 256;
+    }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ssize_t written = write(fd, data.data(), data.size());
+    assert(written == (ssize_t)data.size());
+    close(fd);
+
+    Endpoint endpoint;
+    endpoint.child = 0;
+    endpoint.sessions = 0;
+    endpoint.queries = 0;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+    endpoint.server = &server;
+
+    MemoryStore tokens;
+    tokens.put("access_token", "stand-in");
+    tokens.put("refresh_token", "stand-in");
+    Credential cred(&tokens);
+
+    test_resume(&server, &endpoint, filename, store_path, data, &cred);
+    test_expired(&server, &endpoint, filename, store_path, data, &cred);
+
+    unlink(store_path.c_str());
+    if (remove(filename.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << filename
+                  << "Please remove it manually" << std::endl;
+    }
+}
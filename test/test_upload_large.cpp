@@ -0,0 +1,145 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+
+using namespace GDRIVE;
+
+// A sparse file past 4GiB with a few bytes set around the 32-bit boundaries
+const long long FILE_SIZE = (4LL << 30) + (1 << 20) + 7;
+const long long MARKERS[] = { 0, (1LL << 31) - 1, 1LL << 31, (1LL << 32) - 1, 1LL << 32, (1LL << 32) + 5, FILE_SIZE - 1 };
+const int MARKER_COUNT = sizeof(MARKERS) / sizeof(MARKERS[0]);
+
+// State of the stand-in resumable upload endpoint. It keeps no data, only
+// a running checksum, the bytes seen at the markers and whether every chunk
+// started where the previous one ended.
+struct Endpoint {
+    StandIn* server;
+    long long received;
+    long long total;
+    bool contiguous;
+    MD5 md5;
+    std::map<long long, char> seen;
+};
+
+void consume(Endpoint* endpoint, long long offset, const char* data, size_t length) {
+    endpoint->md5.update(data, length);
+    for (int i = 0; i < MARKER_COUNT; i ++) {
+        if (MARKERS[i] >= offset && MARKERS[i] < offset + (long long)length) {
+            endpoint->seen[MARKERS[i]] = data[MARKERS[i] - offset];
+        }
+    }
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string method = request_line.substr(0, request_line.find(' '));
+    long long length = SizeHelper::stoll(headers["content-length"]);
+    long long start = endpoint->received;
+    if (method == "PUT" && headers["content-range"].find("*/") == std::string::npos) {
+        std::string range = headers["content-range"];
+        long long first = SizeHelper::stoll(range.substr(range.find(' ') + 1));
+        if (first != endpoint->received) endpoint->contiguous = false;
+    }
+    // the body is consumed as it arrives, the chunks are too large to hold
+    long long left = length;
+    while (left > 0) {
+        if (conn.buffer.empty() && !conn.fill()) {
+            return false;
+        }
+        size_t n = conn.buffer.size() < (size_t)left ? conn.buffer.size() : (size_t)left;
+        if (method == "PUT") {
+            consume(endpoint, start + (length - left), conn.buffer.data(), n);
+        }
+        conn.buffer.erase(0, n);
+        left -= n;
+    }
+
+    if (method == "POST") {
+        endpoint->total = SizeHelper::stoll(headers["x-upload-content-length"]);
+        conn.reply("200 OK", "Location: " + endpoint->server->uri("/session") + "\r\n", "");
+        return true;
+    }
+
+    endpoint->received += length;
+    if (endpoint->received < endpoint->total) {
+        std::string range = endpoint->received > 0 ? "Range: bytes=0-" + SizeHelper::itos(endpoint->received - 1) + "\r\n" : "";
+        conn.reply("308 Resume Incomplete", range, "");
+    } else {
+        std::string body = "{\"id\": \"large\", \"md5Checksum\": \"" + endpoint->md5.hexdigest() + "\"}";
+        conn.reply("200 OK", "Content-Type: application/json\r\n", body);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "/tmp/gdrive_upload_large.bin";
+
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    int rst = ftruncate(fd, FILE_SIZE);
+    assert(rst == 0);
+    for (int i = 0; i < MARKER_COUNT; i ++) {
+        char c = 'a' + i;
+        ssize_t written = pwrite(fd, &c, 1, MARKERS[i]);
+        assert(written == 1);
+    }
+
+    MD5 expected;
+    std::vector<char> buffer(8 * 1024 * 1024);
+    for (long long pos = 0; pos < FILE_SIZE; ) {
+        ssize_t n = pread(fd, &buffer[0], buffer.size(), pos);
+        assert(n > 0);
+        expected.update(&buffer[0], n);
+        pos += n;
+    }
+    close(fd);
+
+    Endpoint endpoint;
+    endpoint.received = endpoint.total = 0;
+    endpoint.contiguous = true;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    }, 8);
+    endpoint.server = &server;
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+    FileContent content(fin, "application/octet-stream");
+    assert(content.get_length() == FILE_SIZE);
+
+    GFile file;
+    FileInsertRequest insert(&content, &file, &cred, server.uri("/upload"), true);
+    insert.set_pipelined(true);
+    insert.set_chunk_size(8 * 1024 * 1024);
+    GFile uploaded = insert.execute();
+
+    assert(endpoint.total == FILE_SIZE);
+    assert(endpoint.received == FILE_SIZE);
+    assert(endpoint.contiguous);
+    for (int i = 0; i < MARKER_COUNT; i ++) {
+        assert(endpoint.seen[MARKERS[i]] == 'a' + i);
+    }
+    assert(uploaded.get_md5Checksum() == expected.hexdigest());
+    assert(insert.stats().sent == FILE_SIZE);
+    std::cout << "Uploaded " << insert.stats().sent << " bytes in " << insert.stats().chunks << " chunks, up to "
+              << insert.stats().max_chunk_size << " bytes each" << std::endl;
+
+    if (remove(filename.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << filename
+                  << "Please remove it manually" << std::endl;
+    }
+}
@@ -0,0 +1,195 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <iostream>
+#include <mutex>
+
+using namespace GDRIVE;
+
+const long long CHUNK_SIZE = RESUMABLE_CHUNK_SIZE;
+const long long FILE_SIZE = 4 * CHUNK_SIZE + 777;
+
+// State of the stand-in upload endpoint. A media upload is answered with
+// the md5 of its body; a resumable session keeps the bytes it was sent,
+// and its first chunk starting at fail_at is answered with 503 and dropped.
+struct Endpoint {
+    StandIn* server;
+    std::mutex mutex;
+    std::string received;
+    long long total;
+    int queries;
+    long long fail_at;
+};
+
+void finished(Connection& conn, std::string& received) {
+    MD5 md5;
+    md5.update(received.data(), received.size());
+    conn.reply("200 OK", "Content-Type: application/json\r\n",
+               "{\"id\": \"mapped\", \"md5Checksum\": \"" + md5.hexdigest() + "\"}");
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+
+    if (request_line.find("uploadType=media") != std::string::npos) {
+        endpoint->received = body;
+        finished(conn, endpoint->received);
+        return true;
+    }
+    if (request_line.find("POST ") == 0) {
+        endpoint->total = SizeHelper::stoll(headers["x-upload-content-length"]);
+        conn.reply("200 OK", "Location: " + endpoint->server->uri("/session") + "\r\n", "");
+        return true;
+    }
+
+    std::string range = headers["content-range"];
+    if (range.find("*/") == std::string::npos) {
+        long long first = SizeHelper::stoll(range.substr(range.find(' ') + 1));
+        assert(first == (long long)endpoint->received.size());
+        if (first == endpoint->fail_at) {
+            endpoint->fail_at = -1;
+            conn.reply("503 Service Unavailable", "Content-Type: application/json\r\n",
+                       "{\"error\": {\"code\": 503, \"message\": \"Backend Error\"}}");
+            return true;
+        }
+        endpoint->received += body;
+    } else {
+        endpoint->queries ++;
+    }
+    if ((long long)endpoint->received.size() < endpoint->total) {
+        conn.reply("308 Resume Incomplete", "Range: bytes=0-" + SizeHelper::itos(endpoint->received.size() - 1) + "\r\n", "");
+    } else {
+        finished(conn, endpoint->received);
+    }
+    return true;
+}
+
+void reset(Endpoint* endpoint, long long fail_at) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    endpoint->received.clear();
+    endpoint->total = 0;
+    endpoint->queries = 0;
+    endpoint->fail_at = fail_at;
+}
+
+void write_file(std::string path, std::string& data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ssize_t written = write(fd, data.data(), data.size());
+    assert(written == (ssize_t)data.size());
+    close(fd);
+}
+
+// The mapping reads like the file, at any position and past its end
+void test_source(std::string path, std::string& data) {
+    MmapFileContent content(path, "application/octet-stream");
+    assert(content.get_length() == FILE_SIZE);
+    assert(content.data() != NULL);
+    assert(std::string(content.data(), FILE_SIZE) == data);
+
+    char buffer[1000];
+    assert(content.read_at(CHUNK_SIZE - 10, buffer, sizeof(buffer)) == (long long)sizeof(buffer));
+    assert(std::string(buffer, sizeof(buffer)) == data.substr(CHUNK_SIZE - 10, sizeof(buffer)));
+    assert(content.read_at(FILE_SIZE - 100, buffer, sizeof(buffer)) == 100);
+    assert(content.read_at(FILE_SIZE, buffer, sizeof(buffer)) == 0);
+
+    // dropped pages come back from the file
+    content.release(FILE_SIZE);
+    assert(content.get_content() == data);
+    MD5 md5;
+    md5.update(data.data(), data.size());
+    assert(content.compute_md5() == md5.hexdigest());
+}
+
+// A simple upload sends the whole mapping as its body
+void test_media(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path, std::string& data) {
+    reset(endpoint, -1);
+    MmapFileContent content(path, "application/octet-stream");
+    GFile file;
+    FileInsertRequest insert(&content, &file, cred, server->uri("/upload"));
+    assert(insert.execute().get_id() == "mapped");
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(endpoint->received == data);
+}
+
+// Chunks go out of the mapping, the one answered with 503 again after its
+// pages may have been dropped
+void test_resumable(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path,
+                    std::string& data, bool async) {
+    reset(endpoint, 2 * CHUNK_SIZE);
+    MmapFileContent content(path, "application/octet-stream");
+    GFile file;
+    FileInsertRequest insert(&content, &file, cred, server->uri("/upload"), true);
+    insert.set_adaptive_chunk_size(false);
+    insert.set_chunk_size(CHUNK_SIZE);
+    GFile uploaded = async ? insert.execute_async().get() : insert.execute();
+    assert(uploaded.get_id() == "mapped");
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(endpoint->received == data);
+    assert(endpoint->queries == 1);
+    assert(insert.stats().sent == FILE_SIZE);
+}
+
+// An empty file can't be mapped, it is read instead and uploads as nothing
+void test_empty(StandIn* server, Endpoint* endpoint, Credential* cred, std::string path) {
+    std::string empty;
+    write_file(path, empty);
+    MmapFileContent content(path, "application/octet-stream");
+    assert(content.get_length() == 0);
+    assert(content.data() == NULL);
+    assert(content.get_content() == "");
+
+    reset(endpoint, -1);
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->received = "not sent";
+    }
+    GFile file;
+    FileInsertRequest insert(&content, &file, cred, server->uri("/upload"));
+    insert.execute();
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(endpoint->received == "");
+}
+
+int main(int argc, char** argv) {
+    std::string path = argc > 1 ? argv[1] : "/tmp/gdrive_upload_mmap.bin";
+
+    std::string data(FILE_SIZE, '\0');
+    srand(31);
+    for (size_t i = 0; i < data.size(); i ++) {
+        data[i] = rand() % 256;
+    }
+    write_file(path, data);
+
+    Endpoint endpoint;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+    endpoint.server = &server;
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    test_source(path, data);
+    test_media(&server, &endpoint, &cred, path, data);
+    test_resumable(&server, &endpoint, &cred, path, data, false);
+    test_resumable(&server, &endpoint, &cred, path, data, true);
+    test_empty(&server, &endpoint, &cred, path);
+
+    if (remove(path.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << path
+                  << "Please remove it manually" << std::endl;
+    }
+}
@@ -0,0 +1,154 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+using namespace GDRIVE;
+
+const long long FILE_SIZE = 3 * 1024 * 1024 + 5;
+const std::string TITLE = "streamed multipart";
+
+// State of the stand-in token endpoint and multipart upload endpoint. The
+// upload endpoint only takes the last token handed out, and takes apart
+// every body it gets, the ones it answers with 401 too.
+struct Endpoint {
+    std::mutex mutex;
+    std::string token;
+    int refreshes;
+    int unauthorized;
+    // bodies that weren't the metadata and the content, framed as they should be
+    int malformed;
+    std::string received;
+};
+
+// takes the content part out of a multipart body, false if it isn't framed as it should be
+bool content_part(std::string body, std::string content_type, std::string& content) {
+    std::string boundary = content_type.substr(content_type.find("boundary=") + 9);
+    if (boundary[0] == '"') {
+        boundary = boundary.substr(1, boundary.size() - 2);
+    }
+    std::string metadata = "--" + boundary + "\nContent-Type: application/json\n\n";
+    std::string media = "\n--" + boundary + "\nContent-Type: application/octet-stream\n\n";
+    std::string end = "\n--" + boundary + "--";
+    size_t start = body.find(media);
+    if (body.compare(0, metadata.size(), metadata) != 0 || start == std::string::npos
+            || body.size() < start + media.size() + end.size()
+            || body.compare(body.size() - end.size(), end.size(), end) != 0) {
+        return false;
+    }
+    if (body.substr(metadata.size(), start - metadata.size()).find(TITLE) == std::string::npos) {
+        return false;
+    }
+    content = body.substr(start + media.size(), body.size() - end.size() - start - media.size());
+    return true;
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+
+    if (request_line.find("POST /token") == 0) {
+        endpoint->refreshes ++;
+        endpoint->token = "token" + SizeHelper::itos(endpoint->refreshes);
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"access_token\": \"" + endpoint->token + "\", \"token_type\": \"Bearer\", \"expires_in\": 3600}");
+        return true;
+    }
+
+    assert(request_line.find("uploadType=multipart") != std::string::npos);
+    std::string content;
+    if (!content_part(body, headers["content-type"], content)) {
+        endpoint->malformed ++;
+    }
+    if (headers["authorization"] != "Bearer " + endpoint->token) {
+        endpoint->unauthorized ++;
+        conn.reply("401 Unauthorized", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 401, \"message\": \"Invalid Credentials\"}}");
+        return true;
+    }
+    endpoint->received = content;
+    MD5 md5;
+    md5.update(content.data(), content.size());
+    conn.reply("200 OK", "Content-Type: application/json\r\n",
+               "{\"id\": \"multipart\", \"md5Checksum\": \"" + md5.hexdigest() + "\"}");
+    return true;
+}
+
+// The token is taken away before the upload, the multipart body streamed
+// from the source goes out in full twice: with the old token and after the refresh
+void run(StandIn* server, Endpoint* endpoint, Credential* cred, std::string filename,
+         std::string& data, bool mapped, bool async, int round) {
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->token = "";
+        endpoint->unauthorized = 0;
+        endpoint->malformed = 0;
+        endpoint->received.clear();
+    }
+
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+    std::unique_ptr<FileContent> content(mapped ? new MmapFileContent(filename, "application/octet-stream")
+                                                : new FileContent(fin, "application/octet-stream"));
+    GFile file;
+    file.set_title(TITLE);
+    FileInsertRequest insert(content.get(), &file, cred, server->uri("/upload"));
+    GFile uploaded = async ? insert.execute_async().get() : insert.execute();
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    std::cout << (mapped ? "Mapped" : "Stream") << (async ? ", async" : "") << ": "
+              << endpoint->unauthorized << " 401s, " << endpoint->refreshes << " refreshes so far" << std::endl;
+    assert(uploaded.get_id() == "multipart");
+    assert(endpoint->unauthorized == 1);
+    assert(endpoint->refreshes == round);
+    assert(endpoint->malformed == 0);
+    assert(endpoint->received == data);
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "/tmp/gdrive_upload_multipart.bin";
+
+    std::string data(FILE_SIZE, '\0');
+    srand(37);
+    for (size_t i = 0; i < data.size(); i ++) {
+        data[i] = rand() % 256;
+    }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ssize_t written = write(fd, data.data(), data.size());
+    assert(written == (ssize_t)data.size());
+    close(fd);
+
+    Endpoint endpoint;
+    endpoint.refreshes = 0;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+    cred.set_token_url(server.uri("/token"));
+
+    run(&server, &endpoint, &cred, filename, data, false, false, 1);
+    run(&server, &endpoint, &cred, filename, data, true, false, 2);
+    run(&server, &endpoint, &cred, filename, data, false, true, 3);
+    run(&server, &endpoint, &cred, filename, data, true, true, 4);
+
+    if (remove(filename.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << filename
+                  << "Please remove it manually" << std::endl;
+    }
+}
@@ -0,0 +1,210 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+using namespace GDRIVE;
+
+const long long CHUNK_SIZE = RESUMABLE_CHUNK_SIZE;
+
+// State of the stand-in resumable upload endpoint. It keeps the bytes it
+// was sent and the Content-Range of every chunk; the first chunk starting
+// at fail_at is answered with 503 and dropped.
+struct Endpoint {
+    StandIn* server;
+    std::mutex mutex;
+    std::string received;
+    std::vector<std::string> ranges;
+    int queries;
+    long long fail_at;
+};
+
+void finished(Endpoint* endpoint, Connection& conn) {
+    MD5 md5;
+    md5.update(endpoint->received.data(), endpoint->received.size());
+    conn.reply("200 OK", "Content-Type: application/json\r\n",
+               "{\"id\": \"streamed\", \"md5Checksum\": \"" + md5.hexdigest() + "\"}");
+}
+
+void incomplete(Endpoint* endpoint, Connection& conn) {
+    std::string& received = endpoint->received;
+    conn.reply("308 Resume Incomplete",
+               received.empty() ? "" : "Range: bytes=0-" + SizeHelper::itos(received.size() - 1) + "\r\n", "");
+}
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+
+    if (request_line.find("POST ") == 0) {
+        // the length of a stream isn't known up front
+        assert(headers.count("x-upload-content-length") == 0);
+        conn.reply("200 OK", "Location: " + endpoint->server->uri("/session") + "\r\n", "");
+        return true;
+    }
+
+    std::string range = headers["content-range"];
+    std::string total = range.substr(range.find('/') + 1);
+    if (range.find("bytes */") == 0) {
+        // a status query, or the length of a stream that ended on a chunk boundary
+        endpoint->ranges.push_back(range);
+        if (total == "*") {
+            endpoint->queries ++;
+        }
+        if (total != "*" && SizeHelper::stoll(total) == (long long)endpoint->received.size()) {
+            finished(endpoint, conn);
+        } else {
+            incomplete(endpoint, conn);
+        }
+        return true;
+    }
+
+    long long first = SizeHelper::stoll(range.substr(range.find(' ') + 1));
+    assert(first == (long long)endpoint->received.size());
+    if (first == endpoint->fail_at) {
+        endpoint->fail_at = -1;
+        conn.reply("503 Service Unavailable", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 503, \"message\": \"Backend Error\"}}");
+        return true;
+    }
+    // only the last chunk may be shorter than a multiple of 256KiB
+    assert(total != "*" || body.size() % CHUNK_SIZE == 0);
+    endpoint->ranges.push_back(range);
+    endpoint->received += body;
+    if (total != "*" && SizeHelper::stoll(total) == (long long)endpoint->received.size()) {
+        finished(endpoint, conn);
+    } else {
+        incomplete(endpoint, conn);
+    }
+    return true;
+}
+
+void reset(Endpoint* endpoint, long long fail_at) {
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    endpoint->received.clear();
+    endpoint->ranges.clear();
+    endpoint->queries = 0;
+    endpoint->fail_at = fail_at;
+}
+
+GFile upload(StandIn* server, Credential* cred, FileContent* content) {
+    GFile file;
+    // not asked to be resumable, a stream is anyway
+    FileInsertRequest insert(content, &file, cred, server->uri("/upload"));
+    insert.set_adaptive_chunk_size(false);
+    insert.set_chunk_size(CHUNK_SIZE);
+    return insert.execute();
+}
+
+std::string random_data(long long size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < data.size(); i ++) {
+        data[i] = rand() % 256;
+    }
+    return data;
+}
+
+// Reads data out in pieces of up to piece bytes, the way a generator would
+StreamReadFunction generator(std::string* data, long long* pos, long long piece) {
+    return [data, pos, piece](char* buffer, long long length) -> long long {
+        long long n = std::min(std::min(length, piece), (long long)data->size() - *pos);
+        memcpy(buffer, data->data() + *pos, n);
+        *pos += n;
+        return n;
+    };
+}
+
+// Data from a pipe arrives a bit at a time; every chunk but the last goes out
+// with an unknown length, the last one tells it
+void test_pipe(StandIn* server, Endpoint* endpoint, Credential* cred) {
+    reset(endpoint, -1);
+    std::string data = random_data(3 * CHUNK_SIZE + 12345);
+    int fds[2];
+    assert(pipe(fds) == 0);
+    std::thread writer([&data, &fds]() {
+        for (size_t done = 0; done < data.size(); ) {
+            ssize_t n = write(fds[1], data.data() + done, std::min((size_t)10000, data.size() - done));
+            assert(n > 0);
+            done += n;
+            usleep(100);
+        }
+        close(fds[1]);
+    });
+    StreamFileContent content(fds[0], "application/octet-stream");
+    GFile uploaded = upload(server, cred, &content);
+    writer.join();
+    close(fds[0]);
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(uploaded.get_id() == "streamed");
+    assert(endpoint->received == data);
+    assert(endpoint->ranges.size() == 4);
+    for (size_t i = 0; i < 3; i ++) {
+        assert(endpoint->ranges[i] == "bytes " + SizeHelper::itos(i * CHUNK_SIZE) + "-"
+               + SizeHelper::itos((i + 1) * CHUNK_SIZE - 1) + "/*");
+    }
+    assert(endpoint->ranges[3] == "bytes " + SizeHelper::itos(3 * CHUNK_SIZE) + "-"
+           + SizeHelper::itos(data.size() - 1) + "/" + SizeHelper::itos(data.size()));
+}
+
+// A stream that ends right on a chunk boundary only learns so once the chunk
+// is gone, its length follows without any bytes
+void test_boundary(StandIn* server, Endpoint* endpoint, Credential* cred) {
+    reset(endpoint, -1);
+    std::string data = random_data(2 * CHUNK_SIZE);
+    long long pos = 0;
+    StreamFileContent content(generator(&data, &pos, 4096), "application/octet-stream");
+    upload(server, cred, &content);
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(endpoint->received == data);
+    assert(endpoint->ranges.size() == 3);
+    assert(endpoint->ranges[1] == "bytes " + SizeHelper::itos(CHUNK_SIZE) + "-" + SizeHelper::itos(2 * CHUNK_SIZE - 1) + "/*");
+    assert(endpoint->ranges[2] == "bytes */" + SizeHelper::itos(2 * CHUNK_SIZE));
+}
+
+// A failed chunk is sent again from what the stream keeps of it, after a
+// status query that doesn't know the length either
+void test_retry(StandIn* server, Endpoint* endpoint, Credential* cred) {
+    reset(endpoint, CHUNK_SIZE);
+    std::string data = random_data(3 * CHUNK_SIZE + 7);
+    long long pos = 0;
+    StreamFileContent content(generator(&data, &pos, CHUNK_SIZE), "application/octet-stream");
+    upload(server, cred, &content);
+
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+    assert(endpoint->received == data);
+    assert(endpoint->queries == 1);
+    assert(endpoint->fail_at == -1);
+}
+
+int main() {
+    srand(29);
+    Endpoint endpoint;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+    endpoint.server = &server;
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+
+    test_pipe(&server, &endpoint, &cred);
+    test_boundary(&server, &endpoint, &cred);
+    test_retry(&server, &endpoint, &cred);
+}
@@ -0,0 +1,169 @@
+#include "gdrive/credential.hpp"
+#include "gdrive/servicerequest.hpp"
+#include "gdrive/md5.hpp"
+#include "standin.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <mutex>
+
+using namespace GDRIVE;
+
+const long long CHUNK_SIZE = RESUMABLE_CHUNK_SIZE;
+const long long FILE_SIZE = 4 * CHUNK_SIZE + 1000;
+// the access token expires just as the chunk starting here goes out
+const long long EXPIRE_AT = 2 * CHUNK_SIZE;
+
+// State of the stand-in token endpoint and resumable upload endpoint. The
+// upload endpoint only takes the last token handed out, and keeps every
+// byte it was sent.
+struct Endpoint {
+    StandIn* server;
+    std::mutex mutex;
+    std::string token;
+    bool expired;
+    int refreshes;
+    int unauthorized;
+    // status queries of the session, an upload only needs them after a failed chunk
+    int queries;
+    long long total;
+    std::string received;
+};
+
+bool handle(Endpoint* endpoint, Connection& conn, std::string request_line, StandInHeaders& headers) {
+    std::string body;
+    if (!conn.read_body(SizeHelper::stoll(headers["content-length"]), body)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mutex);
+
+    if (request_line.find("POST /token") == 0) {
+        endpoint->refreshes ++;
+        endpoint->token = "token" + SizeHelper::itos(endpoint->refreshes);
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"access_token\": \"" + endpoint->token + "\", \"token_type\": \"Bearer\", \"expires_in\": 3600}");
+        return true;
+    }
+
+    std::string range = headers["content-range"];
+    long long first = range == "" ? -1 : SizeHelper::stoll(range.substr(range.find(' ') + 1));
+    if (first == EXPIRE_AT && !endpoint->expired) {
+        endpoint->expired = true;
+        endpoint->token = "";
+    }
+    if (headers["authorization"] != "Bearer " + endpoint->token) {
+        endpoint->unauthorized ++;
+        conn.reply("401 Unauthorized", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 401, \"message\": \"Invalid Credentials\"}}");
+        return true;
+    }
+
+    if (request_line.find("POST ") == 0) {
+        endpoint->total = SizeHelper::stoll(headers["x-upload-content-length"]);
+        conn.reply("200 OK", "Location: " + endpoint->server->uri("/session") + "\r\n", "");
+        return true;
+    }
+
+    if (range.find("*/") != std::string::npos) {
+        endpoint->queries ++;
+        std::string kept = endpoint->received.empty() ? "" : "Range: bytes=0-" + SizeHelper::itos(endpoint->received.size() - 1) + "\r\n";
+        conn.reply("308 Resume Incomplete", kept, "");
+        return true;
+    }
+    // a chunk that doesn't continue what was received is refused
+    if (first != (long long)endpoint->received.size()) {
+        conn.reply("400 Bad Request", "Content-Type: application/json\r\n",
+                   "{\"error\": {\"code\": 400, \"message\": \"Unexpected chunk\"}}");
+        return true;
+    }
+    endpoint->received += body;
+    if ((long long)endpoint->received.size() < endpoint->total) {
+        conn.reply("308 Resume Incomplete", "Range: bytes=0-" + SizeHelper::itos(endpoint->received.size() - 1) + "\r\n", "");
+    } else {
+        MD5 md5;
+        md5.update(endpoint->received.data(), endpoint->received.size());
+        conn.reply("200 OK", "Content-Type: application/json\r\n",
+                   "{\"id\": \"uploaded\", \"md5Checksum\": \"" + md5.hexdigest() + "\"}");
+    }
+    return true;
+}
+
+// Uploads the file in chunks and checks the one sent again after the 401
+// went out in full
+void run(StandIn* server, Endpoint* endpoint, Credential* cred, std::string filename,
+         std::string& data, bool pipelined, bool async, int round) {
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mutex);
+        endpoint->expired = false;
+        endpoint->unauthorized = 0;
+        endpoint->queries = 0;
+        endpoint->received.clear();
+    }
+
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+    FileContent content(fin, "application/octet-stream");
+    GFile file;
+    FileInsertRequest insert(&content, &file, cred, server->uri("/upload"), true);
+    insert.set_pipelined(pipelined);
+    insert.set_adaptive_chunk_size(false);
+    insert.set_chunk_size(CHUNK_SIZE);
+    // a chunk sent again without its bytes stalls, it gets picked up by a status query after this long
+    insert.set_low_speed_limit(1, 5);
+    // the refresh and the resend after the 401 are continuations on the engine then
+    GFile uploaded = async ? insert.execute_async().get() : insert.execute();
+
+    std::cout << (pipelined ? "Pipelined" : "Unpipelined") << (async ? ", async" : "") << ": " << insert.stats().chunks << " chunks, "
+              << endpoint->unauthorized << " 401s, " << endpoint->queries << " status queries, "
+              << endpoint->refreshes << " refreshes so far" << std::endl;
+    assert(endpoint->unauthorized == 1);
+    // the chunk went through on the attempt after the refresh
+    assert(endpoint->queries == 0);
+    assert(endpoint->refreshes == round);
+    assert(endpoint->received == data);
+    assert(insert.stats().sent == FILE_SIZE);
+    assert(uploaded.get_id() == "uploaded");
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "/tmp/gdrive_upload_unauthorized.bin";
+
+    std::string data(FILE_SIZE, '\0');
+    srand(9);
+    for (size_t i = 0; i < data.size(); i ++) {
+        data[i] = rand() % 256;
+    }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ssize_t written = write(fd, data.data(), data.size());
+    assert(written == (ssize_t)data.size());
+    close(fd);
+
+    Endpoint endpoint;
+    endpoint.token = "stand-in";
+    endpoint.refreshes = 0;
+    endpoint.total = 0;
+    StandIn server([&endpoint](Connection& conn, std::string request_line, StandInHeaders& headers) {
+        return handle(&endpoint, conn, request_line, headers);
+    });
+    endpoint.server = &server;
+
+    MemoryStore store;
+    store.put("access_token", "stand-in");
+    store.put("refresh_token", "stand-in");
+    Credential cred(&store);
+    cred.set_token_url(server.uri("/token"));
+
+    run(&server, &endpoint, &cred, filename, data, false, false, 1);
+    run(&server, &endpoint, &cred, filename, data, true, false, 2);
+    run(&server, &endpoint, &cred, filename, data, false, true, 3);
+    run(&server, &endpoint, &cred, filename, data, true, true, 4);
+
+    if (remove(filename.c_str()) != 0) {
+        std::cerr << "Can't remove the file " << filename
+                  << "Please remove it manually" << std::endl;
+    }
+}